@@ -22,8 +22,8 @@ struct acceptor {
 	int port;
 };
 
-return_code acceptor_create(acceptor **result,
-	const char *ip_address, int port)
+static return_code create_acceptor(acceptor **result,
+	const char *ip_address, int port, int shared)
 {
 	char portbuf[22]; // enough for 64 bits
 	sprintf(portbuf, "%d", port); 	
@@ -52,6 +52,9 @@ return_code acceptor_create(acceptor **result,
 	}
 
 	set_reuseaddress(fd);
+	if (shared) {
+		set_reuseport(fd);
+	}
 	r = bind(fd, info->ai_addr, info->ai_addrlen);
 	if (r == -1) {
 		close(fd);
@@ -83,6 +86,18 @@ return_code acceptor_create(acceptor **result,
 	return ok;
 }
 
+return_code acceptor_create(acceptor **result,
+	const char *ip_address, int port)
+{
+	return create_acceptor(result, ip_address, port, 0);
+}
+
+return_code acceptor_create_shared(acceptor **result,
+	const char *ip_address, int port)
+{
+	return create_acceptor(result, ip_address, port, 1);
+}
+
 const char *acceptor_ip(const acceptor *acc)
 {
 	return acc->ip;
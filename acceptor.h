@@ -10,6 +10,13 @@ typedef struct acceptor acceptor;
 return_code acceptor_create(acceptor **result,
 	const char *ip_address, int port);
 
+/*
+ * Several acceptors created this way may listen on the same endpoint;
+ * the kernel spreads incoming connections over them.
+ */
+return_code acceptor_create_shared(acceptor **result,
+	const char *ip_address, int port);
+
 const char *acceptor_ip(const acceptor *acceptor);
 int acceptor_port(const acceptor *acceptor);
 
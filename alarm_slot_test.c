@@ -1,4 +1,6 @@
 #include <stddef.h>
+#include <stdlib.h>
+#include <time.h>
 #include "dispatcher.h"
 
 #undef NDEBUG
@@ -230,6 +232,204 @@ void test_multiple_alarms()
 	dispatcher_destroy(disp);
 }
 
+typedef struct {
+	dispatcher *disp;
+	alarm_slot *alarm;
+	int counter;
+} reactivate_ns_data;
+
+static return_code reactivate_ns(void *user_data)
+{
+	reactivate_ns_data *data = user_data;
+
+	--data->counter;
+	if (data->counter != 0) {
+		dispatcher_activate_alarm_slot_ns(
+			data->disp, data->alarm, 100000, &reactivate_ns, data);
+	}
+
+	return ok;
+}	
+
+static unsigned long long monotonic_nsecs()
+{
+	struct timespec ts;
+	int r = clock_gettime(CLOCK_MONOTONIC, &ts);
+	assert(r == 0);
+
+	return (unsigned long long) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void test_sub_msec_alarm()
+{
+	dispatcher *disp;
+	return_code rc = dispatcher_create(&disp);
+	assert(rc == ok);
+
+	alarm_slot *alarm;
+	rc = dispatcher_create_alarm_slot(disp, &alarm);
+	assert(rc == ok);
+
+	reactivate_ns_data data;
+	data.disp = disp;
+	data.alarm = alarm;
+	data.counter = 20;
+
+	unsigned long long start = monotonic_nsecs();
+
+	dispatcher_activate_alarm_slot_ns(disp, alarm, 100000,
+		&reactivate_ns, &data);
+
+	rc = dispatcher_run(disp);
+	assert(rc == ok);
+
+	assert(data.counter == 0);
+
+	/* never early; generous upper bound for loaded machines */
+	unsigned long long elapsed = monotonic_nsecs() - start;
+	assert(elapsed >= 20 * 100000);
+	assert(elapsed < 1000000000);
+
+	dispatcher_destroy_alarm_slot(disp, alarm);
+	dispatcher_destroy(disp);
+}	
+
+typedef struct order_log order_log;
+
+typedef struct {
+	order_log *log;
+	int id;
+} order_entry;
+
+struct order_log {
+	int *ids;
+	int n_ids;
+};
+
+static return_code log_order(void *user_data)
+{
+	order_entry *entry = user_data;
+	order_log *log = entry->log;
+
+	log->ids[log->n_ids] = entry->id;
+	++log->n_ids;
+
+	return ok;
+}
+
+static void test_equal_deadlines()
+{
+	enum { n_alarms = 5 };
+
+	dispatcher *disp;
+	return_code rc = dispatcher_create(&disp);
+	assert(rc == ok);
+
+	int ids[n_alarms];
+	order_log log;
+	log.ids = ids;
+	log.n_ids = 0;
+
+	alarm_slot *alarms[n_alarms];
+	order_entry entries[n_alarms];
+
+	int i;
+	for (i = 0; i != n_alarms; ++i) {
+		rc = dispatcher_create_alarm_slot(disp, &alarms[i]);
+		assert(rc == ok);
+		entries[i].log = &log;
+		entries[i].id = i;
+	}
+
+	/* activation order, not creation order, decides */
+	for (i = n_alarms; i != 0; --i) {
+		dispatcher_activate_alarm_slot(disp, alarms[i - 1], 0,
+			&log_order, &entries[i - 1]);
+	}
+
+	rc = dispatcher_run(disp);
+	assert(rc == ok);
+
+	assert(log.n_ids == n_alarms);
+	for (i = 0; i != n_alarms; ++i) {
+		assert(log.ids[i] == n_alarms - 1 - i);
+	}
+
+	for (i = 0; i != n_alarms; ++i) {
+		dispatcher_destroy_alarm_slot(disp, alarms[i]);
+	}
+	dispatcher_destroy(disp);
+}
+
+static void test_many_alarms()
+{
+	enum { n_alarms = 100000, n_delays = 97, delay_step = 3 };
+
+	dispatcher *disp;
+	return_code rc = dispatcher_create(&disp);
+	assert(rc == ok);
+
+	alarm_slot **alarms = malloc(sizeof *alarms * n_alarms);
+	assert(alarms != NULL);
+	order_entry *entries = malloc(sizeof *entries * n_alarms);
+	assert(entries != NULL);
+
+	order_log log;
+	log.ids = malloc(sizeof *log.ids * n_alarms);
+	assert(log.ids != NULL);
+	log.n_ids = 0;
+
+	int i;
+	for (i = 0; i != n_alarms; ++i) {
+		rc = dispatcher_create_alarm_slot(disp, &alarms[i]);
+		assert(rc == ok);
+		entries[i].log = &log;
+		entries[i].id = i;
+	}
+
+	/* spread deadlines over several level 0 and level 1 slots */
+	for (i = 0; i != n_alarms; ++i) {
+		dispatcher_activate_alarm_slot(disp, alarms[i],
+			(i % n_delays) * delay_step, &log_order, &entries[i]);
+	}
+
+	int n_deactivated = 0;
+	for (i = 0; i < n_alarms; i += 10) {
+		dispatcher_deactivate_alarm_slot(disp, alarms[i]);
+		++n_deactivated;
+	}
+
+	rc = dispatcher_run(disp);
+	assert(rc == ok);
+	assert(log.n_ids == n_alarms - n_deactivated);
+
+	/*
+	 * Alarms with equal delays were activated in id order, so
+	 * their deadlines are ordered too, and they must fire in id
+	 * order.
+	 */
+	int last_id[n_delays];
+	for (i = 0; i != n_delays; ++i) {
+		last_id[i] = -1;
+	}
+
+	for (i = 0; i != log.n_ids; ++i) {
+		int id = log.ids[i];
+		assert(id % 10 != 0);
+		assert(last_id[id % n_delays] < id);
+		last_id[id % n_delays] = id;
+	}
+
+	for (i = 0; i != n_alarms; ++i) {
+		dispatcher_destroy_alarm_slot(disp, alarms[i]);
+	}
+
+	free(log.ids);
+	free(entries);
+	free(alarms);
+	dispatcher_destroy(disp);
+}
+
 int main()
 {
 	test_create_destroy();
@@ -242,6 +442,9 @@ int main()
 	test_reactivate_alarm();
 	test_multiple_alarms();
 	test_stopped_alarm();
+	test_sub_msec_alarm();
+	test_equal_deadlines();
+	test_many_alarms();
 
 	return 0;
 }
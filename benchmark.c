@@ -0,0 +1,588 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "binary_parser.h"
+#include "map.h"
+#include "message_buffer.h"
+#include "push_parser.h"
+
+/*
+ * Throughput benchmarks for the protocol path. The executable is
+ * linked with --wrap for the allocation functions, so that
+ * allocations can be counted.
+ */
+
+static const char *argv0;
+static int csv = 0;
+static double min_seconds = 0.2;
+
+static unsigned long n_allocs = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+	++n_allocs;
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size)
+{
+	++n_allocs;
+	return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+	++n_allocs;
+	return __real_realloc(ptr, size);
+}
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void check(return_code rc)
+{
+	if (rc != ok) {
+		fprintf(stderr, "%s: %s\n", argv0, return_code_string(rc));
+		exit(1);
+	}
+}
+
+typedef struct {
+	const char *name;
+	int n_keys;
+	int value_size;
+	int chunk_size; /* 0 if not applicable */
+} bench_case;
+
+typedef struct {
+	double start;
+	unsigned long start_allocs;
+	long n_msgs;
+	long n_bytes;
+} bench_run;
+
+/* the first message warms up buffers; it is not measured */
+static void start_run(bench_run *run)
+{
+	run->start = now();
+	run->start_allocs = n_allocs;
+	run->n_msgs = 0;
+	run->n_bytes = 0;
+}
+
+static int run_done(const bench_run *run)
+{
+	/* only look at the clock every so often */
+	return run->n_msgs % 64 == 0 && now() - run->start >= min_seconds;
+}
+
+static void report(const bench_case *bc, const bench_run *run)
+{
+	double seconds = now() - run->start;
+	double mb_per_sec = run->n_bytes / seconds / 1e6;
+	double msgs_per_sec = run->n_msgs / seconds;
+	double allocs_per_msg = (double) (n_allocs - run->start_allocs) /
+		run->n_msgs;
+
+	if (csv) {
+		printf("%s,%d,%d,%d,%.1f,%.0f,%.3f\n", bc->name,
+			bc->n_keys, bc->value_size, bc->chunk_size,
+			mb_per_sec, msgs_per_sec, allocs_per_msg);
+	} else {
+		printf("%-14s keys %4d value %4d chunk %5d: "
+			"%8.1f MB/s %10.0f msgs/s %7.3f allocs/msg\n",
+			bc->name, bc->n_keys, bc->value_size, bc->chunk_size,
+			mb_per_sec, msgs_per_sec, allocs_per_msg);
+	}
+	fflush(stdout);
+}
+
+static void make_value(char *value, int value_size, int seed)
+{
+	int i;
+	for (i = 0; i != value_size; ++i) {
+		value[i] = 'a' + (seed + i) % 26;
+	}
+	value[value_size] = '\0';
+}
+
+/* returns a malloced message with n_keys values */
+static char *make_message(const char *type, int n_keys, int value_size,
+	int *length)
+{
+	int size = 64 + n_keys * (2 * 24 + value_size + 8);
+	char *message = malloc(size);
+	char *value = malloc(value_size + 1);
+	if (message == NULL || value == NULL) {
+		check(out_of_memory);
+	}
+
+	int n = sprintf(message, "<%s>\n", type);
+	int i;
+	for (i = 0; i != n_keys; ++i) {
+		if (strcmp(type, "retrieve") == 0) {
+			n += sprintf(message + n, "\t<key>key_%d</key>\n", i);
+		} else {
+			make_value(value, value_size, i);
+			n += sprintf(message + n, "\t<key_%d>%s</key_%d>\n",
+				i, value, i);
+		}
+	}
+	n += sprintf(message + n, "</%s>\n", type);
+
+	free(value);
+
+	*length = n;
+	return message;
+}
+
+/* returns a malloced binary update with n_keys values */
+static char *make_binary_update(int n_keys, int value_size, int *length)
+{
+	message_buffer *buf;
+	check(message_buffer_create(&buf));
+	message_buffer_set_binary(buf);
+
+	char *value = malloc(value_size + 1);
+	if (value == NULL) {
+		check(out_of_memory);
+	}
+
+	check(message_buffer_add_begin_message(buf, "update"));
+	int i;
+	for (i = 0; i != n_keys; ++i) {
+		char key[24];
+		sprintf(key, "key_%d", i);
+		make_value(value, value_size, i);
+		check(message_buffer_add_string_value(buf, key, value));
+	}
+	check(message_buffer_add_end_message(buf, "update"));
+
+	*length = message_buffer_size(buf);
+	char *message = malloc(*length);
+	if (message == NULL) {
+		check(out_of_memory);
+	}
+	memcpy(message, message_buffer_data(buf), *length);
+
+	free(value);
+	message_buffer_destroy(buf);
+
+	return message;
+}
+
+static return_code on_begin_message(void *target_object,
+	const char *type, int type_length)
+{
+	return ok;
+}
+
+static return_code on_message_data(void *target_object,
+	const char *key, int key_length, const char *data, int data_length)
+{
+	return ok;
+}
+
+static return_code on_end_message(void *target_object)
+{
+	++*(long *) target_object;
+	return ok;
+}
+
+static const push_parser_view_vtbl parser_vtbl = {
+	&on_begin_message,
+	&on_message_data,
+	&on_end_message
+};
+
+static void bench_parse(const char *type, const bench_case *bc)
+{
+	int length;
+	char *message = make_message(type, bc->n_keys, bc->value_size,
+		&length);
+
+	/* the parser counts messages in run.n_msgs */
+	bench_run run;
+	run.n_msgs = 0;
+	push_parser *parser;
+	check(push_parser_create_view(&parser, &run.n_msgs, &parser_vtbl));
+
+	int warmed_up = 0;
+	for (;;) {
+
+		int offset;
+		for (offset = 0; offset < length; offset += bc->chunk_size) {
+			int n = length - offset < bc->chunk_size ?
+				length - offset : bc->chunk_size;
+			check(push_parser_push(parser, message + offset, n));
+		}
+
+		if (! warmed_up) {
+			warmed_up = 1;
+			start_run(&run);
+			continue;
+		}
+
+		run.n_bytes += length;
+		if (run_done(&run)) {
+			break;
+		}
+	}
+
+	report(bc, &run);
+
+	push_parser_destroy(parser);
+	free(message);
+}
+
+static void bench_parse_binary(const bench_case *bc)
+{
+	int length;
+	char *message = make_binary_update(bc->n_keys, bc->value_size,
+		&length);
+
+	/* the parser counts messages in run.n_msgs */
+	bench_run run;
+	run.n_msgs = 0;
+	binary_parser *parser;
+	check(binary_parser_create_view(&parser, &run.n_msgs,
+		&parser_vtbl));
+
+	int warmed_up = 0;
+	for (;;) {
+
+		int offset;
+		for (offset = 0; offset < length; offset += bc->chunk_size) {
+			int n = length - offset < bc->chunk_size ?
+				length - offset : bc->chunk_size;
+			check(binary_parser_push(parser, message + offset, n));
+		}
+
+		if (! warmed_up) {
+			warmed_up = 1;
+			start_run(&run);
+			continue;
+		}
+
+		run.n_bytes += length;
+		if (run_done(&run)) {
+			break;
+		}
+	}
+
+	report(bc, &run);
+
+	binary_parser_destroy(parser);
+	free(message);
+}
+
+static void bench_build_status(const bench_case *bc, int gather)
+{
+	char **keys = malloc(sizeof *keys * bc->n_keys);
+	char *value = malloc(bc->value_size + 1);
+	if (keys == NULL || value == NULL) {
+		check(out_of_memory);
+	}
+
+	int i;
+	for (i = 0; i != bc->n_keys; ++i) {
+		keys[i] = malloc(32);
+		if (keys[i] == NULL) {
+			check(out_of_memory);
+		}
+		sprintf(keys[i], "a_typical_sensor_key_%d", i);
+	}
+	make_value(value, bc->value_size, 0);
+
+	message_buffer *buf;
+	check(gather ? message_buffer_create_gather(&buf) :
+		message_buffer_create(&buf));
+
+	bench_run run;
+	int warmed_up = 0;
+	for (;;) {
+
+		check(message_buffer_add_begin_message(buf, "status"));
+		for (i = 0; i != bc->n_keys; ++i) {
+			check(gather ?
+				message_buffer_add_string_value_stable_key(
+					buf, keys[i], value) :
+				message_buffer_add_string_value(
+					buf, keys[i], value));
+		}
+		check(message_buffer_add_end_message(buf, "status"));
+
+		int size = message_buffer_size(buf);
+		message_buffer_discard(buf, size);
+
+		if (! warmed_up) {
+			warmed_up = 1;
+			start_run(&run);
+			continue;
+		}
+
+		++run.n_msgs;
+		run.n_bytes += size;
+		if (run_done(&run)) {
+			break;
+		}
+	}
+
+	report(bc, &run);
+
+	message_buffer_destroy(buf);
+	for (i = 0; i != bc->n_keys; ++i) {
+		free(keys[i]);
+	}
+	free(value);
+	free(keys);
+}
+
+/* arena: fill and clear, like a session's message map */
+static void bench_map(const bench_case *bc, int arena)
+{
+	char (*keys)[32] = malloc(sizeof *keys * bc->n_keys);
+	char *value = malloc(bc->value_size + 1);
+	if (keys == NULL || value == NULL) {
+		check(out_of_memory);
+	}
+
+	int i;
+	for (i = 0; i != bc->n_keys; ++i) {
+		sprintf(keys[i], "key_%d", i);
+	}
+	make_value(value, bc->value_size, 0);
+
+	map *m;
+	check(arena ? map_create_arena(&m) : map_create(&m));
+
+	int bytes_per_msg = 0;
+	for (i = 0; i != bc->n_keys; ++i) {
+		bytes_per_msg += strlen(keys[i]) + bc->value_size;
+	}
+
+	bench_run run;
+	int warmed_up = 0;
+	for (;;) {
+
+		for (i = 0; i != bc->n_keys; ++i) {
+			check(map_set_value(m, keys[i], value));
+		}
+		if (arena) {
+			map_clear(m);
+		}
+
+		if (! warmed_up) {
+			warmed_up = 1;
+			start_run(&run);
+			continue;
+		}
+
+		++run.n_msgs;
+		run.n_bytes += bytes_per_msg;
+		if (run_done(&run)) {
+			break;
+		}
+	}
+
+	report(bc, &run);
+
+	map_destroy(m);
+	free(value);
+	free(keys);
+}
+
+/*
+ * A message is inserting all keys into an empty map, or with find,
+ * finding them all in a full one.
+ */
+static void bench_large_map(const bench_case *bc, int find)
+{
+	char (*keys)[32] = malloc(sizeof *keys * bc->n_keys);
+	char *value = malloc(bc->value_size + 1);
+	if (keys == NULL || value == NULL) {
+		check(out_of_memory);
+	}
+
+	int i;
+	for (i = 0; i != bc->n_keys; ++i) {
+		sprintf(keys[i], "key_%d", i);
+	}
+	make_value(value, bc->value_size, 0);
+
+	int bytes_per_msg = 0;
+	for (i = 0; i != bc->n_keys; ++i) {
+		bytes_per_msg += strlen(keys[i]) + bc->value_size;
+	}
+
+	map *m;
+	check(map_create(&m));
+	for (i = 0; i != bc->n_keys; ++i) {
+		check(map_set_value(m, keys[i], value));
+	}
+
+	bench_run run;
+	int warmed_up = 0;
+	for (;;) {
+
+		if (find) {
+			for (i = 0; i != bc->n_keys; ++i) {
+				if (map_find_value(m, keys[i]) == NULL) {
+					fprintf(stderr, "%s: %s not found\n",
+						argv0, keys[i]);
+					exit(1);
+				}
+			}
+		} else {
+			map_destroy(m);
+			check(map_create(&m));
+			for (i = 0; i != bc->n_keys; ++i) {
+				check(map_set_value(m, keys[i], value));
+			}
+		}
+
+		if (! warmed_up) {
+			warmed_up = 1;
+			start_run(&run);
+			continue;
+		}
+
+		/* every message counts: each one takes a while */
+		++run.n_msgs;
+		run.n_bytes += bytes_per_msg;
+		if (now() - run.start >= min_seconds) {
+			break;
+		}
+	}
+
+	report(bc, &run);
+
+	map_destroy(m);
+	free(value);
+	free(keys);
+}
+
+static const int key_counts[] = { 1, 10, 100 };
+static const int value_sizes[] = { 8, 256 };
+static const int chunk_sizes[] = { 16, 1500, 65536 };
+
+enum {
+	large_map_keys = 1000000,
+	n_key_counts = sizeof key_counts / sizeof key_counts[0],
+	n_value_sizes = sizeof value_sizes / sizeof value_sizes[0],
+	n_chunk_sizes = sizeof chunk_sizes / sizeof chunk_sizes[0]
+};
+
+static int usage()
+{
+	fprintf(stderr, "usage: %s [<option>...]\n", argv0);
+	fprintf(stderr, "options are:\n");
+	fprintf(stderr,
+		"  --csv               prints comma-separated results\n");
+	fprintf(stderr,
+		"  --seconds <number>  sets time per benchmark"
+			" (default: %g)\n", min_seconds);
+
+	return 1;
+}
+
+static int parse_options(int argc, char *argv[])
+{
+	int i;
+	for (i = 1; i != argc && *argv[i] == '-'; ++i) {
+
+		if (strcmp(argv[i], "--csv") == 0) {
+
+			csv = 1;
+
+		} else if (strcmp(argv[i], "--seconds") == 0) {
+
+			if (++i == argc) {
+				return -1;
+			}
+			min_seconds = atof(argv[i]);
+			if (min_seconds <= 0) {
+				return -1;
+			}
+
+		} else {
+			return -1;
+		}
+	}
+
+	return i;
+}
+
+int main(int argc, char *argv[])
+{
+	argv0 = argv[0];
+
+	if (parse_options(argc, argv) != argc) {
+		return usage();
+	}
+
+	if (csv) {
+		printf("benchmark,keys,value_size,chunk_size,"
+			"mb_per_sec,msgs_per_sec,allocs_per_msg\n");
+	}
+
+	int k, v, c;
+	for (k = 0; k != n_key_counts; ++k) {
+		for (v = 0; v != n_value_sizes; ++v) {
+			for (c = 0; c != n_chunk_sizes; ++c) {
+				bench_case bc = { "parse_update",
+					key_counts[k], value_sizes[v],
+					chunk_sizes[c] };
+				bench_parse("update", &bc);
+				bc.name = "parse_binary";
+				bench_parse_binary(&bc);
+			}
+		}
+	}
+
+	for (k = 0; k != n_key_counts; ++k) {
+		for (c = 0; c != n_chunk_sizes; ++c) {
+			bench_case bc = { "parse_retrieve",
+				key_counts[k], 0, chunk_sizes[c] };
+			bench_parse("retrieve", &bc);
+		}
+	}
+
+	for (k = 0; k != n_key_counts; ++k) {
+		for (v = 0; v != n_value_sizes; ++v) {
+			bench_case bc = { "build_status",
+				key_counts[k], value_sizes[v], 0 };
+			bench_build_status(&bc, 0);
+			bc.name = "build_gather";
+			bench_build_status(&bc, 1);
+		}
+	}
+
+	for (k = 0; k != n_key_counts; ++k) {
+		for (v = 0; v != n_value_sizes; ++v) {
+			bench_case bc = { "map_update",
+				key_counts[k], value_sizes[v], 0 };
+			bench_map(&bc, 0);
+			bc.name = "map_arena_fill";
+			bench_map(&bc, 1);
+		}
+	}
+
+	bench_case bc = { "map_insert", large_map_keys, value_sizes[0], 0 };
+	bench_large_map(&bc, 0);
+	bc.name = "map_find";
+	bench_large_map(&bc, 1);
+
+	return 0;
+}
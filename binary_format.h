@@ -0,0 +1,41 @@
+#ifndef BINARY_FORMAT_H
+#define BINARY_FORMAT_H
+
+/*
+ * A connection that starts with binary_protocol_magic carries binary
+ * messages instead of text ones; text never starts with a null
+ * character.
+ *
+ * A binary message is a frame: a frame_header_size byte big-endian
+ * length, followed by that many bytes holding the message type and the
+ * data values. The type and each key are a varint length followed by
+ * that many bytes; each key is followed by a value tag and the value.
+ * A string value is a varint length followed by its bytes, an integer
+ * value a zigzag-encoded varint, a double value 8 bytes of IEEE 754
+ * binary64, little-endian, and a bool value a single 0 or 1 byte.
+ * Varints are little-endian base 128.
+ *
+ * Keys are only spelled out the first time they are sent on a
+ * connection, and referred to by number later. A key's varint is
+ * twice its length for a spelled-out key, which gets the next number
+ * (from 0) while there are fewer than max_key_ids, or twice the key's
+ * number plus one for a reference. Each direction numbers its own
+ * keys.
+ */
+enum {
+	binary_protocol_magic = 0,
+	frame_header_size = 4,
+	max_frame_size = 1 << 24,
+	max_varint_size = 10, /* for 64 bits */
+	double_value_size = 8,
+	max_key_ids = 4096
+};
+
+typedef enum {
+	string_value_tag,
+	integer_value_tag,
+	double_value_tag,
+	bool_value_tag
+} value_tag;
+
+#endif
@@ -0,0 +1,517 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "binary_format.h"
+#include "binary_parser.h"
+
+/*
+ * A frame that arrives in pieces is collected in frame; complete frames
+ * are parsed straight from the pushed bytes. The strings passed to the
+ * callbacks are copied, null-terminated, into strings, which is reused
+ * for every value. Numbered keys are kept, null-terminated, in keys,
+ * and passed from there.
+ */
+struct binary_parser {
+	void *target_object;
+	const push_parser_vtbl *vtbl; /* either this one */
+	const push_parser_view_vtbl *view_vtbl; /* or this one is set */
+	char *frame;
+	int frame_length;
+	int frame_alloc;
+	char *strings;
+	int strings_alloc;
+	char *keys;
+	int keys_size;
+	int keys_alloc;
+	int *key_offsets; /* into keys, by number */
+	int n_key_ids;
+	int n_key_ids_alloc;
+	int curr_key_id; /* -1 if none */
+};
+
+static return_code reserve(char **buf, int *alloc, int size)
+{
+	if (size <= *alloc) {
+		return ok;
+	}
+
+	int new_alloc = *alloc + *alloc / 2 + 1;
+	if (new_alloc < size) {
+		new_alloc = size;
+	}
+
+	char *new_buf = *buf == NULL ? malloc(new_alloc) :
+		realloc(*buf, new_alloc);
+	if (new_buf == NULL) {
+		return out_of_memory;
+	}
+
+	*buf = new_buf;
+	*alloc = new_alloc;
+
+	return ok;
+}
+
+static unsigned long frame_size(const char *header)
+{
+	const unsigned char *p = (const unsigned char *) header;
+
+	return (unsigned long) p[0] << 24 | (unsigned long) p[1] << 16 |
+		(unsigned long) p[2] << 8 | (unsigned long) p[3];
+}
+
+static return_code read_varint(const char **p, const char *end,
+	unsigned long long *result)
+{
+	*result = 0;
+
+	int i;
+	for (i = 0; i != max_varint_size; ++i) {
+
+		if (*p == end) {
+			return invalid_frame;
+		}
+
+		unsigned char c = **p;
+		++*p;
+
+		*result |= (unsigned long long) (c & 0x7f) << (7 * i);
+		if ((c & 0x80) == 0) {
+			return ok;
+		}
+	}
+
+	return invalid_frame;
+}
+
+static return_code read_bytes(const char **p, const char *end,
+	unsigned long long n, const char **str, int *length)
+{
+	if (n > end - *p) {
+		return invalid_frame;
+	}
+
+	if (memchr(*p, '\0', n) != NULL) {
+		return unexpected_null_char;
+	}
+
+	*str = *p;
+	*length = n;
+	*p += n;
+
+	return ok;
+}
+
+static return_code read_string(const char **p, const char *end,
+	const char **str, int *length)
+{
+	unsigned long long n;
+	return_code rc = read_varint(p, end, &n);
+	if (rc != ok) {
+		return rc;
+	}
+
+	return read_bytes(p, end, n, str, length);
+}
+
+static const char *key_string(const binary_parser *parser, int id)
+{
+	return parser->keys + parser->key_offsets[id];
+}
+
+static int key_length(const binary_parser *parser, int id)
+{
+	int end = id + 1 == parser->n_key_ids ? parser->keys_size :
+		parser->key_offsets[id + 1];
+
+	return end - parser->key_offsets[id] - 1;
+}
+
+static return_code add_key_id(binary_parser *parser,
+	const char *key, int length)
+{
+	if (parser->n_key_ids == parser->n_key_ids_alloc) {
+
+		int new_alloc = parser->n_key_ids_alloc +
+			parser->n_key_ids_alloc / 2 + 1;
+		int *new_offsets = parser->key_offsets == NULL ?
+			malloc(sizeof *new_offsets * new_alloc) :
+			realloc(parser->key_offsets,
+				sizeof *new_offsets * new_alloc);
+		if (new_offsets == NULL) {
+			return out_of_memory;
+		}
+
+		parser->key_offsets = new_offsets;
+		parser->n_key_ids_alloc = new_alloc;
+	}
+
+	return_code rc = reserve(&parser->keys, &parser->keys_alloc,
+		parser->keys_size + length + 1);
+	if (rc != ok) {
+		return rc;
+	}
+
+	memcpy(parser->keys + parser->keys_size, key, length);
+	parser->keys[parser->keys_size + length] = '\0';
+	parser->key_offsets[parser->n_key_ids] = parser->keys_size;
+	parser->keys_size += length + 1;
+	parser->curr_key_id = parser->n_key_ids;
+	++parser->n_key_ids;
+
+	return ok;
+}
+
+/*
+ * Reads a key, and sets curr_key_id to its number; a key without one
+ * is left null-terminated at the start of strings.
+ */
+static return_code read_key(binary_parser *parser,
+	const char **p, const char *end, int *length)
+{
+	unsigned long long n;
+	return_code rc = read_varint(p, end, &n);
+	if (rc != ok) {
+		return rc;
+	}
+
+	if ((n & 1) != 0) {
+		if (n >> 1 >= parser->n_key_ids) {
+			return invalid_frame;
+		}
+		parser->curr_key_id = n >> 1;
+		*length = key_length(parser, parser->curr_key_id);
+		return ok;
+	}
+
+	const char *str;
+	rc = read_bytes(p, end, n >> 1, &str, length);
+	if (rc != ok) {
+		return rc;
+	}
+
+	if (parser->n_key_ids < max_key_ids) {
+		return add_key_id(parser, str, *length);
+	}
+
+	rc = reserve(&parser->strings, &parser->strings_alloc, *length + 1);
+	if (rc != ok) {
+		return rc;
+	}
+	memcpy(parser->strings, str, *length);
+	parser->strings[*length] = '\0';
+	parser->curr_key_id = -1;
+
+	return ok;
+}
+
+/*
+ * Reads a value; a string value is left null-terminated in strings at
+ * offset, and *length is set to its length.
+ */
+static return_code read_value(binary_parser *parser,
+	const char **p, const char *end, int offset,
+	typed_value *value, int *length)
+{
+	if (*p == end) {
+		return invalid_frame;
+	}
+
+	value_tag tag = (unsigned char) **p;
+	++*p;
+
+	return_code rc;
+	const char *str;
+	unsigned long long n;
+	int i;
+
+	switch (tag) {
+
+	case string_value_tag :
+
+		rc = read_string(p, end, &str, length);
+		if (rc != ok) {
+			return rc;
+		}
+
+		rc = reserve(&parser->strings, &parser->strings_alloc,
+			offset + *length + 1);
+		if (rc != ok) {
+			return rc;
+		}
+
+		memcpy(parser->strings + offset, str, *length);
+		parser->strings[offset + *length] = '\0';
+		value->type = string_value;
+		value->u.string = parser->strings + offset;
+		break;
+
+	case integer_value_tag :
+
+		rc = read_varint(p, end, &n);
+		if (rc != ok) {
+			return rc;
+		}
+
+		/* zigzag: 0, -1, 1, -2, ... */
+		value->type = integer_value;
+		value->u.integer = (long long) (n >> 1) ^ -(long long) (n & 1);
+		break;
+
+	case double_value_tag :
+
+		if (end - *p < double_value_size) {
+			return invalid_frame;
+		}
+
+		n = 0;
+		for (i = double_value_size; i != 0; --i) {
+			n = n << 8 | (unsigned char) (*p)[i - 1];
+		}
+		*p += double_value_size;
+
+		value->type = double_value;
+		memcpy(&value->u.real, &n, sizeof value->u.real);
+		break;
+
+	case bool_value_tag :
+
+		if (*p == end || (**p != 0 && **p != 1)) {
+			return invalid_frame;
+		}
+
+		value->type = bool_value;
+		value->u.boolean = **p;
+		++*p;
+		break;
+
+	default :
+
+		return invalid_frame;
+		break;
+	}
+
+	return ok;
+}
+
+static return_code begin_message(binary_parser *parser, int type_length)
+{
+	if (parser->view_vtbl != NULL) {
+		return (*parser->view_vtbl->on_begin_message)(
+			parser->target_object, parser->strings, type_length);
+	}
+	return (*parser->vtbl->on_begin_message)(
+		parser->target_object, parser->strings);
+}
+
+/* string_length is only set for string values */
+static return_code message_data(binary_parser *parser,
+	int key_length, const typed_value *value, int string_length)
+{
+	const char *key = parser->curr_key_id == -1 ? parser->strings :
+		key_string(parser, parser->curr_key_id);
+
+	if (parser->view_vtbl != NULL &&
+		parser->view_vtbl->on_typed_message_data != NULL) {
+		return (*parser->view_vtbl->on_typed_message_data)(
+			parser->target_object, key, key_length, value);
+	}
+
+	char buf[typed_value_text_size];
+	const char *data = typed_value_text(value, buf);
+	int data_length = value->type == string_value ?
+		string_length : strlen(data);
+
+	if (parser->view_vtbl != NULL) {
+		return (*parser->view_vtbl->on_message_data)(
+			parser->target_object,
+			key, key_length, data, data_length);
+	}
+	return (*parser->vtbl->on_message_data)(
+		parser->target_object, key, data);
+}
+
+static return_code end_message(binary_parser *parser)
+{
+	return parser->view_vtbl != NULL ?
+		(*parser->view_vtbl->on_end_message)(parser->target_object) :
+		(*parser->vtbl->on_end_message)(parser->target_object);
+}
+
+static return_code parse_frame(binary_parser *parser,
+	const char *p, int size)
+{
+	const char *end = p + size;
+
+	const char *str;
+	int length;
+	return_code rc = read_string(&p, end, &str, &length);
+	if (rc != ok) {
+		return rc;
+	}
+
+	rc = reserve(&parser->strings, &parser->strings_alloc, length + 1);
+	if (rc != ok) {
+		return rc;
+	}
+	memcpy(parser->strings, str, length);
+	parser->strings[length] = '\0';
+
+	rc = begin_message(parser, length);
+	if (rc != ok) {
+		return rc;
+	}
+
+	while (p != end) {
+
+		int key_length;
+		rc = read_key(parser, &p, end, &key_length);
+		if (rc != ok) {
+			return rc;
+		}
+
+		typed_value value;
+		int string_length;
+		rc = read_value(parser, &p, end,
+			parser->curr_key_id == -1 ? key_length + 1 : 0,
+			&value, &string_length);
+		if (rc != ok) {
+			return rc;
+		}
+
+		rc = message_data(parser, key_length, &value, string_length);
+		parser->curr_key_id = -1;
+		if (rc != ok) {
+			return rc;
+		}
+	}
+
+	return end_message(parser);
+}
+
+static return_code create_parser(binary_parser **result,
+	void *target_object, const push_parser_vtbl *vtbl,
+	const push_parser_view_vtbl *view_vtbl)
+{
+	binary_parser *parser = malloc(sizeof *parser);
+	if (parser == NULL) {
+		return out_of_memory;
+	}
+
+	parser->target_object = target_object;
+	parser->vtbl = vtbl;
+	parser->view_vtbl = view_vtbl;
+	parser->frame = NULL;
+	parser->frame_length = 0;
+	parser->frame_alloc = 0;
+	parser->strings = NULL;
+	parser->strings_alloc = 0;
+	parser->keys = NULL;
+	parser->keys_size = 0;
+	parser->keys_alloc = 0;
+	parser->key_offsets = NULL;
+	parser->n_key_ids = 0;
+	parser->n_key_ids_alloc = 0;
+	parser->curr_key_id = -1;
+
+	*result = parser;
+	return ok;
+}
+
+return_code binary_parser_create(binary_parser **result,
+	void *target_object, const push_parser_vtbl *vtbl)
+{
+	return create_parser(result, target_object, vtbl, NULL);
+}
+
+return_code binary_parser_create_view(binary_parser **result,
+	void *target_object, const push_parser_view_vtbl *view_vtbl)
+{
+	return create_parser(result, target_object, NULL, view_vtbl);
+}
+
+return_code binary_parser_push(binary_parser *parser,
+	const char *src, int src_length)
+{
+	return_code rc;
+
+	while (src_length != 0) {
+
+		if (parser->frame_length == 0 &&
+			src_length >= frame_header_size) {
+
+			unsigned long size = frame_size(src);
+			if (size > max_frame_size) {
+				return frame_too_large;
+			}
+
+			if (size <= src_length - frame_header_size) {
+				rc = parse_frame(parser,
+					src + frame_header_size, size);
+				if (rc != ok) {
+					return rc;
+				}
+				src += frame_header_size + size;
+				src_length -= frame_header_size + size;
+				continue;
+			}
+		}
+
+		/* the header goes first, then the rest of the frame */
+		unsigned long wanted = frame_header_size;
+		if (parser->frame_length >= frame_header_size) {
+			wanted += frame_size(parser->frame);
+		}
+
+		int n = wanted - parser->frame_length;
+		if (n > src_length) {
+			n = src_length;
+		}
+
+		rc = reserve(&parser->frame, &parser->frame_alloc,
+			parser->frame_length + n);
+		if (rc != ok) {
+			return rc;
+		}
+
+		memcpy(parser->frame + parser->frame_length, src, n);
+		parser->frame_length += n;
+		src += n;
+		src_length -= n;
+
+		if (parser->frame_length < frame_header_size) {
+			continue;
+		}
+
+		unsigned long size = frame_size(parser->frame);
+		if (size > max_frame_size) {
+			return frame_too_large;
+		}
+
+		if (parser->frame_length == frame_header_size + size) {
+			parser->frame_length = 0;
+			rc = parse_frame(parser,
+				parser->frame + frame_header_size, size);
+			if (rc != ok) {
+				return rc;
+			}
+		}
+	}
+
+	return ok;
+}
+
+int binary_parser_key_id(const binary_parser *parser)
+{
+	return parser->curr_key_id;
+}
+
+void binary_parser_destroy(binary_parser *parser)
+{
+	free(parser->key_offsets);
+	free(parser->keys);
+	free(parser->strings);
+	free(parser->frame);
+	free(parser);
+}
@@ -0,0 +1,37 @@
+#ifndef BINARY_PARSER_H
+#define BINARY_PARSER_H
+
+#include "push_parser.h"
+#include "return_code.h"
+
+/*
+ * Parses the binary message format written by a binary
+ * message_buffer, making the same calls as a push_parser would for
+ * the equivalent text. Values that aren't strings are passed as text,
+ * unless the view vtbl has on_typed_message_data.
+ */
+typedef struct binary_parser binary_parser;
+
+return_code binary_parser_create(binary_parser **result,
+	void *target_object,
+	const push_parser_vtbl *vtbl
+);
+
+return_code binary_parser_create_view(binary_parser **result,
+	void *target_object,
+	const push_parser_view_vtbl *view_vtbl
+);
+
+return_code binary_parser_push(binary_parser *parser,
+	const char *src, int src_length);
+
+/*
+ * During on_message_data, returns the number the sender gave the key,
+ * which always stands for the same key on this connection, or -1 if
+ * it has none.
+ */
+int binary_parser_key_id(const binary_parser *parser);
+
+void binary_parser_destroy(binary_parser *parser);
+
+#endif
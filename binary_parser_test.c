@@ -0,0 +1,411 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "binary_format.h"
+#include "binary_parser.h"
+#include "message_buffer.h"
+
+#undef NDEBUG
+#include <assert.h>
+
+/* records parser events as text, for easy comparison */
+typedef struct {
+	char events[16384];
+	int length;
+} recorder;
+
+static void record(recorder *rec, const char *fmt,
+	const char *arg1, const char *arg2)
+{
+	int n = snprintf(rec->events + rec->length,
+		sizeof rec->events - rec->length, fmt, arg1, arg2);
+	assert(n >= 0);
+	assert(n < sizeof rec->events - rec->length);
+	rec->length += n;
+}
+
+static return_code on_begin_message(void *target_object, const char *type)
+{
+	record(target_object, "begin(%s%s)", type, "");
+	return ok;
+}
+
+static return_code on_message_data(void *target_object,
+	const char *key, const char *data)
+{
+	record(target_object, "data(%s=%s)", key, data);
+	return ok;
+}
+
+static return_code on_end_message(void *target_object)
+{
+	record(target_object, "end%s%s", "", "");
+	return ok;
+}
+
+static const push_parser_vtbl recorder_vtbl = {
+	&on_begin_message,
+	&on_message_data,
+	&on_end_message
+};
+
+static return_code on_begin_message_view(void *target_object,
+	const char *type, int type_length)
+{
+	assert(strlen(type) == type_length);
+
+	return on_begin_message(target_object, type);
+}
+
+static return_code on_message_data_view(void *target_object,
+	const char *key, int key_length, const char *data, int data_length)
+{
+	assert(strlen(key) == key_length);
+	assert(strlen(data) == data_length);
+
+	return on_message_data(target_object, key, data);
+}
+
+static const push_parser_view_vtbl recorder_view_vtbl = {
+	&on_begin_message_view,
+	&on_message_data_view,
+	&on_end_message
+};
+
+/* string values are under keys that start with k */
+static return_code on_typed_message_data(void *target_object,
+	const char *key, int key_length, const typed_value *value)
+{
+	assert(strlen(key) == key_length);
+	assert((*key == 'k') == (value->type == string_value));
+
+	char buf[typed_value_text_size];
+	return on_message_data(target_object, key,
+		typed_value_text(value, buf));
+}
+
+static const push_parser_view_vtbl recorder_typed_vtbl = {
+	&on_begin_message_view,
+	&on_message_data_view,
+	&on_end_message,
+	&on_typed_message_data
+};
+
+/*
+ * pushes input in two parts, split at split_point, with vtbl_kind 0:
+ * plain, 1: view, 2: typed view
+ */
+static return_code parse(recorder *rec, int vtbl_kind,
+	const char *input, int length, int split_point)
+{
+	rec->length = 0;
+	rec->events[0] = '\0';
+
+	binary_parser *parser;
+	return_code rc = vtbl_kind == 0 ?
+		binary_parser_create(&parser, rec, &recorder_vtbl) :
+		binary_parser_create_view(&parser, rec, vtbl_kind == 1 ?
+			&recorder_view_vtbl : &recorder_typed_vtbl);
+	assert(rc == ok);
+
+	rc = binary_parser_push(parser, input, split_point);
+	if (rc == ok) {
+		rc = binary_parser_push(parser, input + split_point,
+			length - split_point);
+	}
+
+	binary_parser_destroy(parser);
+
+	return rc;
+}
+
+/*
+ * checks the outcome is the same wherever input is split, for all
+ * kinds of vtbl
+ */
+static void check(const char *input, int length,
+	return_code expected_rc, const char *expected_events)
+{
+	int vtbl_kind;
+	for (vtbl_kind = 0; vtbl_kind != 3; ++vtbl_kind) {
+
+		int split_point;
+		for (split_point = 0; split_point <= length; ++split_point) {
+
+			recorder rec;
+			return_code rc = parse(&rec, vtbl_kind,
+				input, length, split_point);
+
+			assert(rc == expected_rc);
+			if (expected_events != NULL) {
+				assert(strcmp(rec.events,
+					expected_events) == 0);
+			}
+		}
+	}
+}
+
+static void format_test()
+{
+	message_buffer *buf;
+	return_code rc = message_buffer_create(&buf);
+	assert(rc == ok);
+	message_buffer_set_binary(buf);
+
+	rc = message_buffer_add_begin_message(buf, "update");
+	assert(rc == ok);
+	rc = message_buffer_add_string_value(buf, "k", "v");
+	assert(rc == ok);
+	rc = message_buffer_add_integer_value(buf, "n", -2);
+	assert(rc == ok);
+	rc = message_buffer_add_end_message(buf, "update");
+	assert(rc == ok);
+
+	/* now the keys are referred to by number */
+	rc = message_buffer_add_begin_message(buf, "update");
+	assert(rc == ok);
+	rc = message_buffer_add_string_value(buf, "k", "v");
+	assert(rc == ok);
+	rc = message_buffer_add_string_value(buf, "n", "-2");
+	assert(rc == ok);
+	rc = message_buffer_add_end_message(buf, "update");
+	assert(rc == ok);
+
+	rc = message_buffer_add_begin_message(buf, "u");
+	assert(rc == ok);
+	rc = message_buffer_add_double_value(buf, "d", 0.5);
+	assert(rc == ok);
+	rc = message_buffer_add_bool_value(buf, "b", 1);
+	assert(rc == ok);
+	rc = message_buffer_add_end_message(buf, "u");
+	assert(rc == ok);
+
+	static const char expected[] =
+		"\0\0\0\020"
+		"\006update"
+		"\002k" "\000" "\001v"
+		"\002n" "\001" "\003"
+		"\0\0\0\020"
+		"\006update"
+		"\001" "\000" "\001v"
+		"\003" "\000" "\002-2"
+		"\0\0\0\021"
+		"\001u"
+		"\002d" "\002" "\000\000\000\000\000\000\340\077"
+		"\002b" "\003" "\001";
+
+	assert(message_buffer_size(buf) == sizeof expected - 1);
+	assert(memcmp(message_buffer_data(buf), expected,
+		sizeof expected - 1) == 0);
+
+	/* a new connection starts over */
+	message_buffer_discard(buf, message_buffer_size(buf));
+	rc = message_buffer_add_binary_magic(buf);
+	assert(rc == ok);
+	rc = message_buffer_add_begin_message(buf, "u");
+	assert(rc == ok);
+	rc = message_buffer_add_string_value(buf, "n", "x");
+	assert(rc == ok);
+	rc = message_buffer_add_end_message(buf, "u");
+	assert(rc == ok);
+
+	static const char restarted[] =
+		"\0"
+		"\0\0\0\007"
+		"\001u"
+		"\002n" "\000" "\001x";
+
+	assert(message_buffer_size(buf) == sizeof restarted - 1);
+	assert(memcmp(message_buffer_data(buf), restarted,
+		sizeof restarted - 1) == 0);
+
+	message_buffer_destroy(buf);
+}
+
+typedef struct {
+	binary_parser *parser;
+	int n_values;
+	int n_keys; /* keys in each message */
+} key_checker;
+
+static return_code check_begin(void *target_object, const char *type)
+{
+	key_checker *kc = target_object;
+	kc->n_values = 0;
+	return ok;
+}
+
+static return_code check_data(void *target_object,
+	const char *key, const char *data)
+{
+	key_checker *kc = target_object;
+
+	char expected_key[16];
+	sprintf(expected_key, "k%d", kc->n_values);
+	assert(strcmp(key, expected_key) == 0);
+	assert(strcmp(data, expected_key + 1) == 0);
+
+	int id = binary_parser_key_id(kc->parser);
+	assert(id == (kc->n_values < max_key_ids ? kc->n_values : -1));
+
+	++kc->n_values;
+	return ok;
+}
+
+static return_code check_end(void *target_object)
+{
+	key_checker *kc = target_object;
+	assert(kc->n_values == kc->n_keys);
+	return ok;
+}
+
+static const push_parser_vtbl key_checker_vtbl = {
+	&check_begin,
+	&check_data,
+	&check_end
+};
+
+/* more keys than fit in the dictionary still arrive */
+static void key_ids_test()
+{
+	message_buffer *buf;
+	return_code rc = message_buffer_create(&buf);
+	assert(rc == ok);
+	message_buffer_set_binary(buf);
+
+	key_checker kc;
+	kc.n_keys = max_key_ids + 10;
+
+	int i;
+	for (i = 0; i != 2; ++i) {
+
+		rc = message_buffer_add_begin_message(buf, "update");
+		assert(rc == ok);
+
+		int j;
+		for (j = 0; j != kc.n_keys; ++j) {
+			char key[16];
+			sprintf(key, "k%d", j);
+			rc = message_buffer_add_string_value(buf,
+				key, key + 1);
+			assert(rc == ok);
+		}
+
+		rc = message_buffer_add_end_message(buf, "update");
+		assert(rc == ok);
+	}
+
+	rc = binary_parser_create(&kc.parser, &kc, &key_checker_vtbl);
+	assert(rc == ok);
+
+	rc = binary_parser_push(kc.parser,
+		message_buffer_data(buf), message_buffer_size(buf));
+	assert(rc == ok);
+
+	binary_parser_destroy(kc.parser);
+	message_buffer_destroy(buf);
+}
+
+static void messages_test()
+{
+	message_buffer *buf;
+	return_code rc = message_buffer_create(&buf);
+	assert(rc == ok);
+	message_buffer_set_binary(buf);
+
+	rc = message_buffer_add_begin_message(buf, "update");
+	assert(rc == ok);
+
+	/* strings stay strings */
+	static const char *values[] = {
+		"0", "-1", "123456789012345678", "-300",
+		"007", "-0", "1234567890123456789", "12a", "", "-",
+		" 21 degrees "
+	};
+	int i;
+	for (i = 0; i != sizeof values / sizeof values[0]; ++i) {
+		char key[8];
+		sprintf(key, "k%d", i);
+		rc = message_buffer_add_string_value(buf, key, values[i]);
+		assert(rc == ok);
+	}
+	rc = message_buffer_add_integer_value(buf, "int", -2147483647 - 1);
+	assert(rc == ok);
+	rc = message_buffer_add_integer_value(buf, "min",
+		-9223372036854775807LL - 1);
+	assert(rc == ok);
+	rc = message_buffer_add_double_value(buf, "real", -0.1);
+	assert(rc == ok);
+	rc = message_buffer_add_bool_value(buf, "no", 0);
+	assert(rc == ok);
+
+	rc = message_buffer_add_end_message(buf, "update");
+	assert(rc == ok);
+
+	rc = message_buffer_add_begin_message(buf, "retrieve");
+	assert(rc == ok);
+	rc = message_buffer_add_end_message(buf, "retrieve");
+	assert(rc == ok);
+
+	check(message_buffer_data(buf), message_buffer_size(buf), ok,
+		"begin(update)"
+		"data(k0=0)data(k1=-1)data(k2=123456789012345678)"
+		"data(k3=-300)data(k4=007)data(k5=-0)"
+		"data(k6=1234567890123456789)data(k7=12a)data(k8=)"
+		"data(k9=-)data(k10= 21 degrees )"
+		"data(int=-2147483648)"
+		"data(min=-9223372036854775808)"
+		"data(real=-0.10000000000000001)"
+		"data(no=false)"
+		"end"
+		"begin(retrieve)end");
+
+	check("", 0, ok, "");
+
+	message_buffer_destroy(buf);
+}
+
+static void errors_test()
+{
+	static const char empty_frame[] = "\0\0\0\0";
+	check(empty_frame, sizeof empty_frame - 1, invalid_frame, NULL);
+
+	static const char short_type[] = "\0\0\0\002\005ab";
+	check(short_type, sizeof short_type - 1, invalid_frame, NULL);
+
+	static const char no_tag[] = "\0\0\0\004\001u\002k";
+	check(no_tag, sizeof no_tag - 1, invalid_frame, NULL);
+
+	static const char bad_tag[] = "\0\0\0\005\001u\002k\007";
+	check(bad_tag, sizeof bad_tag - 1, invalid_frame, NULL);
+
+	static const char long_varint[] =
+		"\0\0\0\017\001u\002k\001"
+		"\377\377\377\377\377\377\377\377\377\377\001";
+	check(long_varint, sizeof long_varint - 1, invalid_frame, NULL);
+
+	static const char with_nul[] = "\0\0\0\007\001u\002k\000\001\000";
+	check(with_nul, sizeof with_nul - 1, unexpected_null_char, NULL);
+
+	static const char short_double[] = "\0\0\0\007\001u\002k\002\0\0";
+	check(short_double, sizeof short_double - 1, invalid_frame, NULL);
+
+	static const char bad_bool[] = "\0\0\0\006\001u\002k\003\002";
+	check(bad_bool, sizeof bad_bool - 1, invalid_frame, NULL);
+
+	static const char unknown_key[] = "\0\0\0\005\001u\001\000\000";
+	check(unknown_key, sizeof unknown_key - 1, invalid_frame, NULL);
+
+	static const char too_large[] = "\001\0\0\001";
+	check(too_large, sizeof too_large - 1, frame_too_large, NULL);
+}
+
+int main()
+{
+	format_test();
+	key_ids_test();
+	messages_test();
+	errors_test();
+
+	return 0;
+}
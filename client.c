@@ -9,12 +9,33 @@
 #include "person_sensor.h"
 #include "stop_handler.h"
 
+enum {
+	default_max_latency = 1000,
+	default_heartbeat_interval = 15000
+};
+
+static int binary = 0;
+static int persistent = 0;
+static int snapshot_interval = 0;
+static int coalesce_delay = -1; /* -1: send at fixed intervals */
+static int max_latency = default_max_latency;
+static int heartbeat_interval = default_heartbeat_interval;
+
 static int usage(const char *argv0)
 {
 	fprintf(stderr, "usage: %s [<option>...]"
 		" <target host> <target port\n", argv0);
 	fprintf(stderr, "options are:\n");
+	fprintf(stderr, "  --binary            sends binary messages\n");
+	fprintf(stderr, "  --coalesce <msecs>  sends changes after this delay"
+		" instead of at fixed intervals\n");
+	fprintf(stderr, "  --heartbeat <msecs> sets idle heartbeat interval"
+		" (default: %d)\n", default_heartbeat_interval);
 	fprintf(stderr, "  --loglevel <level>  sets log level\n");
+	fprintf(stderr, "  --max-latency <msecs> sets max change delay"
+		" (default: %d)\n", default_max_latency);
+	fprintf(stderr, "  --persistent        keeps the connection open\n");
+	fprintf(stderr, "  --snapshot <n>      sends all values every n updates\n");
 	return 1;
 }
 
@@ -23,13 +44,61 @@ static int parse_options(int argc, char *argv[])
 	int i;
 	for (i = 1; i != argc && *argv[i] == '-'; ++i) {
 	
-		if (strcmp(argv[i], "--loglevel") == 0) {
+		if (strcmp(argv[i], "--binary") == 0) {
+
+			binary = 1;
+
+		} else if (strcmp(argv[i], "--coalesce") == 0) {
+
+			if (++i == argc) {
+				return -1;
+			}
+			coalesce_delay = atoi(argv[i]);
+			if (coalesce_delay < 0) {
+				return -1;
+			}
+
+		} else if (strcmp(argv[i], "--heartbeat") == 0) {
+
+			if (++i == argc) {
+				return -1;
+			}
+			heartbeat_interval = atoi(argv[i]);
+			if (heartbeat_interval < 0) {
+				return -1;
+			}
+
+		} else if (strcmp(argv[i], "--loglevel") == 0) {
 
 			if (++i == argc) {
 				return -1;
 			}
 			set_loglevel(atoi(argv[i]));
 		
+		} else if (strcmp(argv[i], "--max-latency") == 0) {
+
+			if (++i == argc) {
+				return -1;
+			}
+			max_latency = atoi(argv[i]);
+			if (max_latency < 0) {
+				return -1;
+			}
+
+		} else if (strcmp(argv[i], "--persistent") == 0) {
+
+			persistent = 1;
+
+		} else if (strcmp(argv[i], "--snapshot") == 0) {
+
+			if (++i == argc) {
+				return -1;
+			}
+			snapshot_interval = atoi(argv[i]);
+			if (snapshot_interval < 0) {
+				return -1;
+			}
+
 		} else {
 			return -1;
 		}
@@ -77,13 +146,24 @@ int main(int argc, char *argv[])
 	}
 
 	data_source *src;
-	rc = data_source_create(&src, disp, target_host, target_port);
+	rc = persistent ?
+		data_source_create_persistent(&src, disp,
+			target_host, target_port) :
+		data_source_create(&src, disp, target_host, target_port);
 	if (rc != ok) {
 		fprintf(stderr, "%s: %s\n", argv[0], return_code_string(rc));
 		stop_handler_destroy(sh);
 		dispatcher_destroy(disp);
 		return 1;
 	}
+	if (binary) {
+		data_source_set_binary(src);
+	}
+	data_source_set_snapshot_interval(src, snapshot_interval);
+	if (coalesce_delay != -1) {
+		data_source_set_flush_policy(src, coalesce_delay,
+			max_latency, heartbeat_interval);
+	}
 
 	person_sensor *ps;
 	rc = person_sensor_create(&ps, disp, src);
@@ -72,7 +72,7 @@ return_code connection_create(connection **result,
 	return connection_consume_internal(result, fd);
 }
 
-return_code connection_consume_internal(connection **result, int fd)
+static return_code create_connection(connection **result, int fd)
 {
 	set_nonblocking(fd);
 	set_keepalive(fd);
@@ -85,12 +85,121 @@ return_code connection_consume_internal(connection **result, int fd)
 	}
 
 	conn->fd = fd;
-	get_local_ip_address(conn->local_ip, fd);
-	conn->local_port = get_local_port_number(fd);
-	get_remote_ip_address(conn->remote_ip, fd);
-	conn->remote_port = get_remote_port_number(fd);
+	conn->local_ip[0] = '\0';
+	conn->local_port = 0;
+	conn->remote_ip[0] = '\0';
+	conn->remote_port = 0;
 
 	*result = conn;
+	return ok;
+}
+
+static void get_addresses(connection *conn)
+{
+	get_local_ip_address(conn->local_ip, conn->fd);
+	conn->local_port = get_local_port_number(conn->fd);
+	get_remote_ip_address(conn->remote_ip, conn->fd);
+	conn->remote_port = get_remote_port_number(conn->fd);
+}
+
+return_code connection_resolve_host(char ip[ip_buf_size], const char *host)
+{
+	struct addrinfo *info;
+	struct addrinfo hints;
+
+	memset(&hints, '\0', sizeof hints);
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = 0;
+
+	int r = getaddrinfo(host, NULL, &hints, &info);
+	if (r != 0) {
+		return cant_resolve_host;
+	}
+
+	r = getnameinfo(info->ai_addr, info->ai_addrlen,
+		ip, ip_buf_size, NULL, 0, NI_NUMERICHOST);
+
+	freeaddrinfo(info);
+
+	return r == 0 ? ok : cant_resolve_host;
+}
+
+return_code connection_start_connect(connection **result,
+	const char *host, int port)
+{
+	char portbuf[22]; // enough for 64 bits
+	sprintf(portbuf, "%d", port); 	
+	
+	struct addrinfo *info;
+	struct addrinfo hints;
+
+	memset(&hints, '\0', sizeof hints);
+	hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = 0;
+
+	int r = getaddrinfo(host, portbuf, &hints, &info);
+	if (r != 0) {
+		return cant_resolve_host;
+	}
+
+	int fd = -1;
+	return_code rc = cant_connect;
+
+	/*
+	 * Only the first address is tried: whether it works is only
+	 * known later on.
+	 */
+	struct addrinfo *node = info;
+	if (node != NULL) {
+
+		fd = socket(node->ai_family,
+			node->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			node->ai_protocol);
+		if (fd == -1) {
+			rc = cant_create_socket;
+		} else {
+			r = connect(fd, node->ai_addr, node->ai_addrlen);
+			if (r == 0 || errno == EINPROGRESS) {
+				rc = ok;
+			} else {
+				close(fd);
+				fd = -1;
+			}
+		}
+	}
+
+	freeaddrinfo(info);
+
+	if (fd == -1) {
+		return rc;
+	}
+
+	return create_connection(result, fd);
+}
+
+return_code connection_finish_connect(connection *conn)
+{
+	if (get_socket_error(conn->fd) != 0) {
+		return cant_connect;
+	}
+
+	get_addresses(conn);
+
+	return ok;
+}
+
+return_code connection_consume_internal(connection **result, int fd)
+{
+	return_code rc = create_connection(result, fd);
+	if (rc != ok) {
+		return rc;
+	}
+
+	get_addresses(*result);
+
 	return ok;
 }	
 
@@ -148,6 +257,24 @@ return_code connection_send_nonblocking(connection *conn,
 	return ok;
 }
 
+return_code connection_send_iovecs_nonblocking(connection *conn,
+	int *bytes_sent, const struct iovec *iov, int n_iovs)
+{
+	struct msghdr msg;
+	memset(&msg, '\0', sizeof msg);
+	msg.msg_iov = (struct iovec *) iov;
+	msg.msg_iovlen = n_iovs;
+
+	int r = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+	if (r == -1) {
+		return errno == EAGAIN || errno == EWOULDBLOCK ?
+			would_block : cant_send;
+	}
+
+	*bytes_sent = r;
+	return ok;
+}
+
 return_code connection_receive_blocking(connection *conn,
 	int *bytes_received, char *data, int max_bytes)
 {
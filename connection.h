@@ -1,14 +1,34 @@
 #ifndef CONNECTION_H
 #define CONNECTION_H
 
+#include <sys/uio.h>
+
 #include "dispatcher.h"
 #include "return_code.h"
+#include "socket_utils.h"
 
 typedef struct connection connection;
 
 return_code connection_create(connection **result,
 	const char *host, int port);
 
+/*
+ * Looks host up, which may block, and sets ip to its first address,
+ * as connection_start_connect() takes it.
+ */
+return_code connection_resolve_host(char ip[ip_buf_size], const char *host);
+
+/*
+ * Starts connecting without waiting for the connection to be set up.
+ * Once the connection is ready for output, connection_finish_connect()
+ * tells whether it succeeded; the addresses are only known after that.
+ * So that it doesn't wait for name lookups either, host must be a
+ * numeric address.
+ */
+return_code connection_start_connect(connection **result,
+	const char *host, int port);
+return_code connection_finish_connect(connection *conn);
+
 /* connection_consume_internal is for internal use by acceptor only */
 return_code connection_consume_internal(connection **result, int fd);
 
@@ -25,6 +45,8 @@ return_code connection_send_blocking(connection *conn,
 	int *bytes_sent, const char *data, int max_bytes);
 return_code connection_send_nonblocking(connection *conn,
 	int *bytes_sent, const char *data, int max_bytes);
+return_code connection_send_iovecs_nonblocking(connection *conn,
+	int *bytes_sent, const struct iovec *iov, int n_iovs);
 
 return_code connection_receive_blocking(connection *conn,
 	int *bytes_received, char *data, int max_bytes);
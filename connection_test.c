@@ -99,9 +99,23 @@ static void echo_test()
 	acceptor_destroy(acc);
 }
 
+/* names are looked up beforehand; connecting takes the address */
+static void resolve_test()
+{
+	char ip[ip_buf_size];
+	return_code rc = connection_resolve_host(ip, "localhost");
+	assert(rc == ok);
+	assert(strcmp(ip, "127.0.0.1") == 0);
+
+	connection *conn;
+	rc = connection_start_connect(&conn, "localhost", 1);
+	assert(rc == cant_resolve_host);
+}
+
 int main()
 {
 	echo_test();
+	resolve_test();
 
 	return 0;
 }
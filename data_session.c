@@ -1,58 +1,173 @@
 #include <assert.h>
+#include <errno.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "binary_format.h"
+#include "binary_parser.h"
 #include "connection.h"
 #include "data_session.h"
 #include "lprintf.h"
 #include "message_buffer.h"
 #include "push_parser.h"
+#include "receive_buffer.h"
+
+enum { max_iovs = 64 };
 
 typedef enum {
 	message_type_none,
 	message_type_update,
-	message_type_retrieve
+	message_type_retrieve,
+	message_type_subscribe
 } message_type;
 
+/*
+ * On input, a session reads until the socket is drained, or it has
+ * read its receive budget, so that it doesn't starve other sessions;
+ * its receive_buffer keeps track of both, and adapts its size.
+ *
+ * A session that starts with binary_protocol_magic speaks the binary
+ * format, both ways. The shared full status message is text, so a
+ * binary session builds its own. Binary values keep their types in
+ * the store; text ones are strings. Once a key number from a binary
+ * update is known to stand for a key in the store, the session keeps
+ * that key's slot, and sets its value without looking the key up.
+ *
+ * A retrieve with a since element only gets the requested keys that
+ * changed after that version, followed by a version message with the
+ * store's current version, to pass as since next time.
+ *
+ * Once more than the high watermark is waiting to be sent, the session
+ * stops reading input until its output drops to the low watermark. If
+ * none of it can be sent for the stall timeout, the session is
+ * evicted.
+ *
+ * A subscribed session gets a status message with the subscribed keys
+ * that changed after seen_seq whenever it is notified. Above the high
+ * watermark it skips them, and catches up at the low watermark: a slow
+ * subscriber gets fewer, bigger messages instead of an ever-growing
+ * queue.
+ */
+
 struct data_session {
 	dispatcher *disp;
 	data_store *store;
 	connection *conn;
 	io_slot *input_slot;
+	receive_buffer *receive_buf;
+	int format_known; /* after the first byte */
 	push_parser *parser;
+	binary_parser *bin_parser; /* NULL unless binary */
 	message_type curr_message_type;
 	map *curr_message_map;
+	int *key_slots; /* by key number; -1 if not known yet */
+	int n_key_slots;
+	slot_value *slot_values; /* for the current update */
+	int *slot_value_offsets; /* into slot_data */
+	int n_slot_values;
+	int n_slot_values_alloc;
+	char *slot_data;
+	int slot_data_size;
+	int slot_data_alloc;
+	int curr_message_has_since;
+	unsigned long curr_message_since;
 	io_slot *output_slot;
 	message_buffer *output_buffer;
+	session_limits limits;
+	int throttled; /* not reading input */
+	int ever_throttled;
+	alarm_slot *stall_alarm;
+	map *subscription; /* NULL if not subscribed; empty: all keys */
+	unsigned long seen_seq;
+	int notify_deferred;
 };
 
+static void push_changes(data_session *sess);
+static return_code push_input(data_session *sess,
+	const char *data, int length);
+
+static return_code on_stall_alarm(void *user_data)
+{
+	data_session *sess = user_data;
+
+	lprintf(warning, "session %s %d <-> %s %d: %s\n",
+		connection_local_ip(sess->conn),
+		connection_local_port(sess->conn),
+		connection_remote_ip(sess->conn),
+		connection_remote_port(sess->conn),
+		"output stalled; evicting");
+
+	data_store_record_eviction(sess->store);
+	data_store_stop_session(sess->store, sess);
+
+	return ok;
+}
+
+static void restart_stall_alarm(data_session *sess)
+{
+	if (sess->limits.stall_timeout != 0) {
+		dispatcher_activate_alarm_slot(sess->disp, sess->stall_alarm,
+			sess->limits.stall_timeout, &on_stall_alarm, sess);
+	}
+}
+
 return_code on_input(void *user_data)
 {
 	data_session *sess = user_data;
 
-	char buf[1024];
+	receive_buffer_start(sess->receive_buf);
+	int more = 1;
 
-	int bytes_received;
-	return_code rc = connection_receive_nonblocking(sess->conn,
-		&bytes_received, buf, sizeof buf);
+	while (more && message_buffer_size(sess->output_buffer) <=
+		sess->limits.high_watermark) {
 
-	switch (rc) {
-	case ok :
-		if (bytes_received == 0) {
-			lprintf(info, "session %s %d <-> %s %d: %s\n",
-				connection_local_ip(sess->conn),
-				connection_local_port(sess->conn),
-				connection_remote_ip(sess->conn),
-				connection_remote_port(sess->conn),
-				"disconnected by peer"
-			);
-			data_store_stop_session(sess->store, sess);
-			return ok;
-		}
+		int bytes_received;
+		return_code rc = connection_receive_nonblocking(sess->conn,
+			&bytes_received,
+			receive_buffer_data(sess->receive_buf),
+			receive_buffer_size(sess->receive_buf));
 
-		rc = push_parser_push(sess->parser, buf, bytes_received);
-		if (rc != ok) {
-			lprintf(error, "session %s %d <-> %s %d: %s\n",
+		switch (rc) {
+		case ok :
+			if (bytes_received == 0) {
+				lprintf(info, "session %s %d <-> %s %d: %s\n",
+					connection_local_ip(sess->conn),
+					connection_local_port(sess->conn),
+					connection_remote_ip(sess->conn),
+					connection_remote_port(sess->conn),
+					"disconnected by peer"
+				);
+				data_store_stop_session(sess->store, sess);
+				return ok;
+			}
+
+			rc = push_input(sess,
+				receive_buffer_data(sess->receive_buf),
+				bytes_received);
+			if (rc != ok) {
+				lprintf(error, "session %s %d <-> %s %d: %s\n",
+					connection_local_ip(sess->conn),
+					connection_local_port(sess->conn),
+					connection_remote_ip(sess->conn),
+					connection_remote_port(sess->conn),
+					return_code_string(rc)
+				);
+				data_store_stop_session(sess->store, sess);
+				return ok;
+			}
+
+			more = receive_buffer_received(sess->receive_buf,
+				bytes_received);
+			break;
+
+		case would_block :
+			/* Thank you very much */
+			more = 0;
+			break;
+
+		default :
+			lprintf(warning, "session %s %d <-> %s %d: %s\n",
 				connection_local_ip(sess->conn),
 				connection_local_port(sess->conn),
 				connection_remote_ip(sess->conn),
@@ -62,28 +177,18 @@ return_code on_input(void *user_data)
 			data_store_stop_session(sess->store, sess);
 			return ok;
 		}
-			
-		break;
-
-	case would_block :
-		/* Thank you very much */
-		break;
-
-	default :
-		lprintf(warning, "session %s %d <-> %s %d: %s\n",
-			connection_local_ip(sess->conn),
-			connection_local_port(sess->conn),
-			connection_remote_ip(sess->conn),
-			connection_remote_port(sess->conn),
-			return_code_string(rc)
-		);
-		data_store_stop_session(sess->store, sess);
-		return ok;
 	}
 
-	if (message_buffer_size(sess->output_buffer) == 0) {
+	if (message_buffer_size(sess->output_buffer) <=
+		sess->limits.high_watermark) {
 		connection_activate_io_slot(sess->conn, sess->disp,
 			sess->input_slot, input, &on_input, sess);
+	} else {
+		sess->throttled = 1;
+		if (! sess->ever_throttled) {
+			sess->ever_throttled = 1;
+			data_store_record_throttle(sess->store);
+		}
 	}
 
 	return ok;
@@ -96,17 +201,22 @@ return_code on_output(void *user_data)
 	int size = message_buffer_size(sess->output_buffer);
 	if (size != 0) {
 
+		struct iovec iov[max_iovs];
+		int n_iovs = message_buffer_fill_iovecs(sess->output_buffer,
+			iov, max_iovs);
+
 		int bytes_sent;
-		return_code rc = connection_send_nonblocking(sess->conn, 
-			&bytes_sent,
-			message_buffer_data(sess->output_buffer),
-			size);
+		return_code rc = connection_send_iovecs_nonblocking(
+			sess->conn, &bytes_sent, iov, n_iovs);
 
 		switch (rc) {
 		case ok :
 
 			message_buffer_discard(sess->output_buffer,
 				bytes_sent);
+			if (bytes_sent != 0) {
+				restart_stall_alarm(sess);
+			}
 			break;
 
 		case would_block :
@@ -132,66 +242,363 @@ return_code on_output(void *user_data)
 		connection_activate_io_slot(sess->conn, sess->disp,
 			sess->output_slot, output, &on_output, sess);
 	} else {
-		connection_activate_io_slot(sess->conn, sess->disp,
-			sess->input_slot, input, &on_input, sess);
+		dispatcher_deactivate_alarm_slot(sess->disp,
+			sess->stall_alarm);
+	}
+
+	if (size <= sess->limits.low_watermark) {
+		if (sess->throttled) {
+			sess->throttled = 0;
+			connection_activate_io_slot(sess->conn, sess->disp,
+				sess->input_slot, input, &on_input, sess);
+		}
+		if (sess->notify_deferred) {
+			push_changes(sess);
+		}
 	}
 
 	return ok;
 }
+
+static void start_output(data_session *sess)
+{
+	connection_activate_io_slot(sess->conn, sess->disp,
+		sess->output_slot, output, &on_output, sess);
+	restart_stall_alarm(sess);
+}
 		
-static return_code send_status(data_session *sess, const map *query)
+/*
+ * Adds the keys in one shard of the store that send_status() wants;
+ * begins the status message at the first one.
+ */
+static return_code add_shard_status(data_session *sess,
+	const data_read *read, int shard_idx, const map *query,
+	unsigned long since, int *n_sent)
 {
-	int was_sending = message_buffer_size(sess->output_buffer) != 0;
+	return_code rc = ok;
 
-	return_code rc = message_buffer_add_begin_message(
-		sess->output_buffer, "status");
-	if (rc != ok) {
-		return rc;
-	}
-
-	const map *store_data = data_store_data(sess->store);
-	int n_store_keys = map_get_n_keys(store_data);
+	int n_store_keys = data_store_n_keys(sess->store, shard_idx);
 	int query_empty = map_get_n_keys(query) == 0;
 
 	int i;
-	for (i = 0; i != n_store_keys; ++i) {
-
-		const char *store_key = map_get_key(store_data, i);
-		if (query_empty || map_find_value(query, store_key) != NULL) {
+	for (i = 0; rc == ok && i != n_store_keys; ++i) {
+
+		const typed_value *value;
+		unsigned long version;
+		const char *store_key = data_store_read_key(sess->store,
+			read, shard_idx, i, &value, &version);
+		if (store_key != NULL && version > since &&
+			(query_empty ||
+			map_find_value(query, store_key) != NULL)) {
+
+			if (*n_sent == 0) {
+				rc = message_buffer_add_begin_message(
+					sess->output_buffer, "status");
+				if (rc != ok) {
+					break;
+				}
+			}
+			++*n_sent;
 
-			rc = message_buffer_add_string_value(
+			/* store keys live as long as the store */
+			rc = message_buffer_add_typed_value_stable_key(
 				sess->output_buffer, 
-				store_key,
-				map_get_value(store_data, i));
-			if (rc != ok) {
-				return rc;
-			}
+				store_key, value);
 		}
 	}	
 
+	return rc;
+}
+
+/*
+ * Sends the keys in query (all if it is empty) that changed after
+ * since, as of the store's change sequence number, to which it sets
+ * *seen. Unless always, a status without keys isn't sent.
+ */
+static return_code send_status(data_session *sess, const map *query,
+	unsigned long since, unsigned long *seen, int always)
+{
+	int was_sending = message_buffer_size(sess->output_buffer) != 0;
+
+	data_read read;
+	data_store_begin_read(sess->store, &read);
+	*seen = read.version;
+
+	int n_shards = data_store_n_shards(sess->store);
+	int n_sent = 0;
+	return_code rc = ok;
+	int i;
+	for (i = 0; rc == ok && i != n_shards; ++i) {
+		rc = add_shard_status(sess, &read, i, query, since, &n_sent);
+	}
+
+	data_store_end_read(sess->store, &read);
+	if (rc != ok) {
+		return rc;
+	}
+
+	if (n_sent == 0) {
+		if (! always) {
+			return ok;
+		}
+		rc = message_buffer_add_begin_message(
+			sess->output_buffer, "status");
+		if (rc != ok) {
+			return rc;
+		}
+	}
+
 	rc = message_buffer_add_end_message(sess->output_buffer, "status");
 	if (rc != ok) {
 		return rc;
 	}
 
 	if (! was_sending) {
-		connection_activate_io_slot(sess->conn, sess->disp,
-			sess->output_slot, output, &on_output, sess);
+		start_output(sess);
 	}
 	
 	return ok;
 }	
 
-static return_code on_begin_message(void *target_object, const char *type)
+/* shares the store's status message instead of building one */
+static return_code send_full_status(data_session *sess)
+{
+	int was_sending = message_buffer_size(sess->output_buffer) != 0;
+
+	const char *data;
+	int size;
+	void *handle;
+	return_code rc = data_store_acquire_status(sess->store,
+		&data, &size, &handle);
+	if (rc != ok) {
+		return rc;
+	}
+
+	rc = message_buffer_add_shared(sess->output_buffer, data, size,
+		&data_store_release_status, handle);
+	if (rc != ok) {
+		data_store_release_status(handle);
+		return rc;
+	}
+
+	if (! was_sending) {
+		start_output(sess);
+	}
+
+	return ok;
+}
+
+static return_code send_changes(data_session *sess, const map *query,
+	unsigned long since)
+{
+	unsigned long version;
+	return_code rc = send_status(sess, query, since, &version, 1);
+	if (rc != ok) {
+		return rc;
+	}
+
+	rc = message_buffer_add_begin_message(sess->output_buffer, "version");
+	if (rc != ok) {
+		return rc;
+	}
+
+	rc = message_buffer_add_integer_value(sess->output_buffer,
+		"value", version);
+	if (rc != ok) {
+		return rc;
+	}
+
+	return message_buffer_add_end_message(sess->output_buffer, "version");
+}
+
+static void push_changes(data_session *sess)
+{
+	if (message_buffer_size(sess->output_buffer) >
+		sess->limits.high_watermark) {
+		sess->notify_deferred = 1;
+		return;
+	}
+	sess->notify_deferred = 0;
+
+	return_code rc = send_status(sess, sess->subscription,
+		sess->seen_seq, &sess->seen_seq, 0);
+	if (rc != ok) {
+		lprintf(error, "session %s %d <-> %s %d: %s\n",
+			connection_local_ip(sess->conn),
+			connection_local_port(sess->conn),
+			connection_remote_ip(sess->conn),
+			connection_remote_port(sess->conn),
+			return_code_string(rc));
+		data_store_stop_session(sess->store, sess);
+	}
+}
+
+static return_code subscribe(data_session *sess, const map *query)
+{
+	return_code rc;
+
+	if (sess->subscription == NULL) {
+
+		rc = map_create(&sess->subscription);
+		if (rc != ok) {
+			return rc;
+		}
+
+		rc = data_store_subscribe(sess->store, sess->disp, sess);
+		if (rc != ok) {
+			map_destroy(sess->subscription);
+			sess->subscription = NULL;
+			return rc;
+		}
+	}
+
+	/* a new subscription replaces the old one */
+	map_clear(sess->subscription);
+
+	int n_keys = map_get_n_keys(query);
+	int i;
+	for (i = 0; i != n_keys; ++i) {
+		rc = map_set_value(sess->subscription,
+			map_get_key(query, i), "");
+		if (rc != ok) {
+			return rc;
+		}
+	}
+
+	/* the current values go first */
+	sess->notify_deferred = 0;
+	return send_status(sess, sess->subscription, 0, &sess->seen_seq, 1);
+}
+
+/* sets *slot for the key just parsed, or to -1 if it isn't known */
+static return_code key_slot(data_session *sess, const char *key, int *slot)
+{
+	int id = binary_parser_key_id(sess->bin_parser);
+	if (id == -1) {
+		*slot = -1;
+		return ok;
+	}
+
+	/* keys in other messages than updates have numbers too */
+	if (id >= sess->n_key_slots) {
+		int *new_slots = sess->key_slots == NULL ?
+			malloc(sizeof *new_slots * (id + 1)) :
+			realloc(sess->key_slots, sizeof *new_slots * (id + 1));
+		if (new_slots == NULL) {
+			return out_of_memory;
+		}
+		sess->key_slots = new_slots;
+		for (; sess->n_key_slots != id + 1; ++sess->n_key_slots) {
+			sess->key_slots[sess->n_key_slots] = -1;
+		}
+	}
+
+	if (sess->key_slots[id] == -1) {
+		sess->key_slots[id] = data_store_find_slot(sess->store, key);
+	}
+
+	*slot = sess->key_slots[id];
+	return ok;
+}
+
+static return_code add_slot_value(data_session *sess,
+	int slot, const typed_value *value)
+{
+	if (sess->n_slot_values == sess->n_slot_values_alloc) {
+
+		int new_alloc = sess->n_slot_values_alloc +
+			sess->n_slot_values_alloc / 2 + 1;
+		slot_value *new_values = sess->slot_values == NULL ?
+			malloc(sizeof *new_values * new_alloc) :
+			realloc(sess->slot_values,
+				sizeof *new_values * new_alloc);
+		if (new_values == NULL) {
+			return out_of_memory;
+		}
+		sess->slot_values = new_values;
+
+		int *new_offsets = sess->slot_value_offsets == NULL ?
+			malloc(sizeof *new_offsets * new_alloc) :
+			realloc(sess->slot_value_offsets,
+				sizeof *new_offsets * new_alloc);
+		if (new_offsets == NULL) {
+			return out_of_memory;
+		}
+		sess->slot_value_offsets = new_offsets;
+
+		sess->n_slot_values_alloc = new_alloc;
+	}
+
+	slot_value *sv = &sess->slot_values[sess->n_slot_values];
+	sv->slot = slot;
+	sv->value = *value;
+	if (value->type != string_value) {
+		++sess->n_slot_values;
+		return ok;
+	}
+
+	int length = strlen(value->u.string);
+	int size = sess->slot_data_size + length + 1;
+	if (size > sess->slot_data_alloc) {
+
+		int new_alloc = sess->slot_data_alloc +
+			sess->slot_data_alloc / 2 + 1;
+		if (new_alloc < size) {
+			new_alloc = size;
+		}
+		char *new_data = sess->slot_data == NULL ?
+			malloc(new_alloc) :
+			realloc(sess->slot_data, new_alloc);
+		if (new_data == NULL) {
+			return out_of_memory;
+		}
+		sess->slot_data = new_data;
+		sess->slot_data_alloc = new_alloc;
+	}
+
+	memcpy(sess->slot_data + sess->slot_data_size, value->u.string,
+		length + 1);
+	sess->slot_value_offsets[sess->n_slot_values] = sess->slot_data_size;
+	++sess->n_slot_values;
+	sess->slot_data_size = size;
+
+	return ok;
+}
+
+static return_code update(data_session *sess)
+{
+	/* slot_data may have moved while the strings were added */
+	int i;
+	for (i = 0; i != sess->n_slot_values; ++i) {
+		slot_value *sv = &sess->slot_values[i];
+		if (sv->value.type == string_value) {
+			sv->value.u.string =
+				sess->slot_data + sess->slot_value_offsets[i];
+		}
+	}
+
+	return data_store_update_slots(sess->store, sess->curr_message_map,
+		sess->slot_values, sess->n_slot_values);
+}
+
+static int is_name(const char *name, const char *str, int length)
+{
+	return strlen(name) == length && memcmp(name, str, length) == 0;
+}
+
+static return_code on_begin_message(void *target_object,
+	const char *type, int type_length)
 {
 	data_session *sess = target_object;
 
 	assert(sess->curr_message_type == message_type_none);
 
-	if (strcmp(type, "update") == 0) {
+	if (is_name("update", type, type_length)) {
 		sess->curr_message_type = message_type_update;
-	} else if (strcmp(type, "retrieve") == 0) {
+	} else if (is_name("retrieve", type, type_length)) {
 		sess->curr_message_type = message_type_retrieve;
+	} else if (is_name("subscribe", type, type_length)) {
+		sess->curr_message_type = message_type_subscribe;
 	} else {
 		return invalid_message_type;
 	}
@@ -199,17 +606,32 @@ static return_code on_begin_message(void *target_object, const char *type)
 	return ok;
 }
 
-static return_code on_message_data(void *target_object,
-	const char *key, const char *data)
+/* text values are strings; binary ones are typed */
+static return_code on_typed_message_data(void *target_object,
+	const char *key, int key_length, const typed_value *value)
 {
 	data_session *sess = target_object;
 	return_code rc;
+	int slot;
+	char buf[typed_value_text_size];
+	const char *data = NULL; /* the value as text, once it is needed */
 
 	switch (sess->curr_message_type) {
 
 	case message_type_update :
 
-		rc = map_set_value(sess->curr_message_map, key, data);
+		slot = -1;
+		if (sess->bin_parser != NULL) {
+			rc = key_slot(sess, key, &slot);
+			if (rc != ok) {
+				return rc;
+			}
+		}
+
+		rc = slot == -1 ?
+			map_set_typed_value(sess->curr_message_map,
+				key, value) :
+			add_slot_value(sess, slot, value);
 		if (rc != ok) {
 			return rc;
 		}
@@ -218,10 +640,32 @@ static return_code on_message_data(void *target_object,
 
 	case message_type_retrieve :
 
-		if (strcmp(key, "key") != 0) {
+		data = typed_value_text(value, buf);
+
+		if (is_name("since", key, key_length)) {
+
+			char *end;
+			errno = 0;
+			sess->curr_message_since = strtoul(data, &end, 10);
+			if (*data == '\0' || *end != '\0' ||
+				errno != 0 || *data == '-') {
+				return invalid_version;
+			}
+			sess->curr_message_has_since = 1;
+			break;
+		}
+
+		/* FALLTHROUGH */
+
+	case message_type_subscribe :
+
+		if (! is_name("key", key, key_length)) {
 			return key_expected;
 		}
 
+		if (data == NULL) {
+			data = typed_value_text(value, buf);
+		}
 		rc = map_set_value(sess->curr_message_map, data, "");
 		if (rc != ok) {
 			return rc;
@@ -237,6 +681,16 @@ static return_code on_message_data(void *target_object,
 	return ok;
 }
 
+static return_code on_message_data(void *target_object,
+	const char *key, int key_length, const char *data, int data_length)
+{
+	typed_value string;
+	string.type = string_value;
+	string.u.string = data;
+
+	return on_typed_message_data(target_object, key, key_length, &string);
+}
+
 static return_code on_end_message(void *target_object)
 {
 	data_session *sess = target_object;
@@ -246,7 +700,7 @@ static return_code on_end_message(void *target_object)
 
 	case message_type_update :
 
-		rc = data_store_update(sess->store, sess->curr_message_map);
+		rc = update(sess);
 		if (rc != ok) {
 			return rc;
 		}
@@ -261,7 +715,17 @@ static return_code on_end_message(void *target_object)
 
 	case message_type_retrieve :
 
-		rc = send_status(sess, sess->curr_message_map);
+		if (sess->curr_message_has_since) {
+			rc = send_changes(sess, sess->curr_message_map,
+				sess->curr_message_since);
+		} else if (map_get_n_keys(sess->curr_message_map) == 0 &&
+			sess->bin_parser == NULL) {
+			rc = send_full_status(sess);
+		} else {
+			unsigned long seen_ignored;
+			rc = send_status(sess, sess->curr_message_map,
+				0, &seen_ignored, 1);
+		}
 		if (rc != ok) {
 			return rc;
 		}
@@ -274,6 +738,21 @@ static return_code on_end_message(void *target_object)
 			"sending status");
 		break;
 
+	case message_type_subscribe :
+
+		rc = subscribe(sess, sess->curr_message_map);
+		if (rc != ok) {
+			return rc;
+		}
+
+		lprintf(info, "session %s %d <-> %s %d: %s\n",
+			connection_local_ip(sess->conn),
+			connection_local_port(sess->conn),
+			connection_remote_ip(sess->conn),
+			connection_remote_port(sess->conn),
+			"subscribed");
+		break;
+
 	default :
 		 
 		assert(0);
@@ -281,31 +760,77 @@ static return_code on_end_message(void *target_object)
 	}
 
 	map_clear(sess->curr_message_map);
+	sess->n_slot_values = 0;
+	sess->slot_data_size = 0;
 	sess->curr_message_type = message_type_none;
+	sess->curr_message_has_since = 0;
 
 	return ok;
 }
 
-static const push_parser_vtbl parser_vtbl = {
+static const push_parser_view_vtbl parser_vtbl = {
 	&on_begin_message,
 	&on_message_data,
-	&on_end_message
+	&on_end_message,
+	&on_typed_message_data
 };
 
+static return_code push_input(data_session *sess,
+	const char *data, int length)
+{
+	if (! sess->format_known) {
+
+		sess->format_known = 1;
+
+		if (*data == binary_protocol_magic) {
+
+			return_code rc = binary_parser_create_view(
+				&sess->bin_parser, sess, &parser_vtbl);
+			if (rc != ok) {
+				return rc;
+			}
+			message_buffer_set_binary(sess->output_buffer);
+
+			++data;
+			--length;
+		}
+	}
+
+	return sess->bin_parser != NULL ?
+		binary_parser_push(sess->bin_parser, data, length) :
+		push_parser_push(sess->parser, data, length);
+}
+
 static void data_session_dispose(data_session *sess)
 {
+	if (sess->stall_alarm != NULL) {
+		dispatcher_destroy_alarm_slot(sess->disp, sess->stall_alarm);
+	}
+	if (sess->subscription != NULL) {
+		map_destroy(sess->subscription);
+	}
 	if (sess->output_buffer != NULL) {
 		message_buffer_destroy(sess->output_buffer);
 	}
 	if (sess->output_slot != NULL) {
 		dispatcher_destroy_io_slot(sess->disp, sess->output_slot);
 	}
+	free(sess->slot_data);
+	free(sess->slot_value_offsets);
+	free(sess->slot_values);
+	free(sess->key_slots);
 	if (sess->curr_message_map != NULL) {
 		map_destroy(sess->curr_message_map);
 	}
+	if (sess->bin_parser != NULL) {
+		binary_parser_destroy(sess->bin_parser);
+	}
 	if (sess->parser != NULL) {
 		push_parser_destroy(sess->parser);
 	}
+	if (sess->receive_buf != NULL) {
+		receive_buffer_destroy(sess->receive_buf);
+	}
 	if (sess->input_slot != NULL) {
 		dispatcher_destroy_io_slot(sess->disp, sess->input_slot);
 	}
@@ -317,8 +842,11 @@ static void data_session_dispose(data_session *sess)
 }
 
 return_code data_session_create(data_session **result,
-	dispatcher *disp, data_store *store, acceptor *acc)
+	dispatcher *disp, data_store *store, acceptor *acc,
+	const session_limits *limits)
 {
+	assert(limits->low_watermark <= limits->high_watermark);
+
 	data_session *sess = malloc(sizeof *sess);
 	if (sess == NULL) {
 		return out_of_memory;
@@ -328,11 +856,32 @@ return_code data_session_create(data_session **result,
 	sess->store = store;
 	sess->conn = NULL;
 	sess->input_slot = NULL;
+	sess->receive_buf = NULL;
+	sess->format_known = 0;
 	sess->parser = NULL;
+	sess->bin_parser = NULL;
 	sess->curr_message_type = message_type_none;
 	sess->curr_message_map = NULL;
+	sess->key_slots = NULL;
+	sess->n_key_slots = 0;
+	sess->slot_values = NULL;
+	sess->slot_value_offsets = NULL;
+	sess->n_slot_values = 0;
+	sess->n_slot_values_alloc = 0;
+	sess->slot_data = NULL;
+	sess->slot_data_size = 0;
+	sess->slot_data_alloc = 0;
+	sess->curr_message_has_since = 0;
+	sess->curr_message_since = 0;
 	sess->output_slot = NULL;
 	sess->output_buffer = NULL;
+	sess->limits = *limits;
+	sess->throttled = 0;
+	sess->ever_throttled = 0;
+	sess->stall_alarm = NULL;
+	sess->subscription = NULL;
+	sess->seen_seq = 0;
+	sess->notify_deferred = 0;
 
 	return_code rc = acceptor_accept_nonblocking(acc, &sess->conn);
 	if (rc != ok) {
@@ -346,13 +895,20 @@ return_code data_session_create(data_session **result,
 		return rc;
 	}
 
-	rc = push_parser_create(&sess->parser, sess, &parser_vtbl);
+	rc = receive_buffer_create(&sess->receive_buf,
+		limits->max_receive_size, limits->receive_budget);
+	if (rc != ok) {
+		data_session_dispose(sess);
+		return rc;
+	}
+
+	rc = push_parser_create_view(&sess->parser, sess, &parser_vtbl);
 	if (rc != ok) {
 		data_session_dispose(sess);
 		return rc;
 	} 
 
-	rc = map_create(&sess->curr_message_map);
+	rc = map_create_arena(&sess->curr_message_map);
 	if (rc != ok) {
 		data_session_dispose(sess);
 		return rc;
@@ -364,7 +920,13 @@ return_code data_session_create(data_session **result,
 		return rc;
 	}
 
-	rc = message_buffer_create(&sess->output_buffer);
+	rc = message_buffer_create_gather(&sess->output_buffer);
+	if (rc != ok) {
+		data_session_dispose(sess);
+		return rc;
+	}
+
+	rc = dispatcher_create_alarm_slot(sess->disp, &sess->stall_alarm);
 	if (rc != ok) {
 		data_session_dispose(sess);
 		return rc;
@@ -384,6 +946,13 @@ return_code data_session_create(data_session **result,
 	return ok;
 }
 
+void data_session_notify(data_session *sess)
+{
+	assert(sess->subscription != NULL);
+
+	push_changes(sess);
+}
+
 void data_session_destroy(data_session *sess)
 {
 	lprintf(info, "closing session %s %d <-> %s %d\n",
@@ -5,7 +5,11 @@
 #include "data_store.h"
 
 return_code data_session_create(data_session **result,
-	dispatcher *disp, data_store *store, acceptor *acc);
+	dispatcher *disp, data_store *store, acceptor *acc,
+	const session_limits *limits);
+
+/* tells a subscribed session that the store changed; it may stop */
+void data_session_notify(data_session *sess);
 
 void data_session_destroy(data_session *sess);
 
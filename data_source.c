@@ -2,70 +2,267 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "connection.h"
 #include "data_source.h"
 #include "lprintf.h"
 #include "map.h"
 #include "message_buffer.h"
+#include "socket_utils.h"
 
-enum { send_interval = 15000 };
+enum {
+	send_interval = 15000,
+	min_reconnect_delay = 100,
+	max_reconnect_delay = 30000,
+	max_pipelined_bytes = 65536
+};
+
+/*
+ * Updates only carry the keys that changed since the last update that
+ * was sent completely. Every change gets a sequence number; an update
+ * includes the keys changed after built_seq, and once the output
+ * buffer drains, everything up to built_seq has been sent. When
+ * sending fails, built_seq falls back to acked_seq, so the lost
+ * changes go out again.
+ *
+ * A persistent data source keeps its connection between updates, and
+ * queues updates on it while earlier ones are still being sent, up to
+ * max_pipelined_bytes. Each new connection starts with a full
+ * snapshot.
+ *
+ * A binary data source starts each connection with
+ * binary_protocol_magic, and sends binary messages after it.
+ *
+ * By default, updates go out every send_interval. With a flush policy,
+ * they go out coalesce_delay after the last change instead, but no
+ * later than max_latency after the first unsent one; a source without
+ * changes sends an empty update every heartbeat_interval. Changes that
+ * were lost or skipped go out with the next update, either for a new
+ * change or a heartbeat.
+ */
+typedef enum {
+	disconnected,
+	connecting,
+	connected
+} connection_state;
 
 struct data_source {
 	dispatcher *disp;
 	char *target_host;
+	char target_ip[ip_buf_size]; /* persistent only */
 	int target_port;
+	int persistent;
+	int binary;
 	map *data;
 	message_buffer *buffer;
-	alarm_slot *alarm; 
+	alarm_slot *alarm;
+	alarm_slot *reconnect_alarm;
+	io_slot *input_slot;
 	io_slot *output_slot;
-	connection *conn; /* NULL when sleeping, non-NULL when sending */
+	connection *conn; /* per send: NULL when sleeping */
+	connection_state state; /* persistent only */
+	int sending; /* persistent only */
+	unsigned int reconnect_delay;
+	unsigned long *key_changes; /* per key, by map index */
+	int n_key_changes_alloc;
+	unsigned long change_seq;
+	unsigned long built_seq;
+	unsigned long acked_seq;
+	int snapshot_interval; /* 0: never send a full snapshot */
+	int n_intervals; /* since the last snapshot */
+	int change_driven;
+	unsigned int coalesce_delay;
+	unsigned int max_latency;
+	unsigned int heartbeat_interval; /* 0: no heartbeats */
+	int changes_pending; /* since the last flush */
+	unsigned long long first_change_time; /* msecs */
 };
 
+static return_code on_alarm(void *user_data);
 static return_code on_output(void *user_data);
+static return_code on_persistent_alarm(void *user_data);
+static return_code on_persistent_output(void *user_data);
+static return_code on_reconnect_alarm(void *user_data);
 
-static return_code on_alarm(void *user_data)
+static unsigned long long now_msecs()
 {
-	data_source *src = user_data;
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (unsigned long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void schedule_next_flush(data_source *src)
+{
+	return_code (*callback)(void *) = src->persistent ?
+		&on_persistent_alarm : &on_alarm;
+
+	if (! src->change_driven) {
+		dispatcher_activate_alarm_slot(src->disp, src->alarm,
+			send_interval, callback, src);
+	} else if (src->changes_pending) {
+		unsigned long long now = now_msecs();
+		unsigned long long deadline = now + src->coalesce_delay;
+		if (deadline > src->first_change_time + src->max_latency) {
+			deadline = src->first_change_time + src->max_latency;
+		}
+		dispatcher_activate_alarm_slot(src->disp, src->alarm,
+			deadline > now ? deadline - now : 0, callback, src);
+	} else if (src->heartbeat_interval != 0) {
+		dispatcher_activate_alarm_slot(src->disp, src->alarm,
+			src->heartbeat_interval, callback, src);
+	} else {
+		dispatcher_deactivate_alarm_slot(src->disp, src->alarm);
+	}
+}
+
+static void note_change(data_source *src)
+{
+	if (! src->change_driven) {
+		return;
+	}
+
+	if (! src->changes_pending) {
+		src->changes_pending = 1;
+		src->first_change_time = now_msecs();
+	}
+
+	/* a per-send source reschedules once its connection is done */
+	if (src->persistent || src->conn == NULL) {
+		schedule_next_flush(src);
+	}
+}
+
+/* adds nothing if no keys changed and no snapshot is due */
+static return_code add_update(data_source *src, int snapshot)
+{
+	unsigned long since = snapshot ? 0 : src->built_seq;
+
+	int n_data_keys = map_get_n_keys(src->data);
+	int n_changed_keys = 0;
+	int i;
+	for (i = 0; i != n_data_keys; ++i) {
+		if (src->key_changes[i] > since) {
+			++n_changed_keys;
+		}
+	}
+
+	if (n_changed_keys == 0) {
+		return ok;
+	}
 
-	assert(message_buffer_size(src->buffer) == 0);
-	
 	return_code rc = message_buffer_add_begin_message(
 		src->buffer, "update");
 	if (rc != ok) {
 		return rc;
 	}
 
-	int n_data_keys = map_get_n_keys(src->data);
-	int i;
 	for (i = 0; i != n_data_keys; ++i) {
-		rc = message_buffer_add_string_value(src->buffer,
-			map_get_key(src->data, i),
-			map_get_value(src->data, i));
+		if (src->key_changes[i] > since) {
+			rc = message_buffer_add_typed_value(src->buffer,
+				map_get_key(src->data, i),
+				map_get_typed_value(src->data, i));
+			if (rc != ok) {
+				return rc;
+			}
+		}
+	}
+
+	rc = message_buffer_add_end_message(src->buffer, "update");
+	if (rc != ok) {
+		return rc;
+	}
+
+	src->built_seq = src->change_seq;
+	return ok;
+}
+
+static return_code add_flush_update(data_source *src)
+{
+	int heartbeat = src->change_driven && ! src->changes_pending;
+	src->changes_pending = 0;
+	int size_before = message_buffer_size(src->buffer);
+
+	int snapshot = 0;
+	if (src->snapshot_interval != 0) {
+		++src->n_intervals;
+		if (src->n_intervals >= src->snapshot_interval) {
+			src->n_intervals = 0;
+			snapshot = 1;
+		}
+	}
+
+	return_code rc = add_update(src, snapshot);
+	if (rc != ok) {
+		return rc;
+	}
+
+	if (heartbeat && message_buffer_size(src->buffer) == size_before) {
+		rc = message_buffer_add_begin_message(src->buffer, "update");
 		if (rc != ok) {
 			return rc;
 		}
+		rc = message_buffer_add_end_message(src->buffer, "update");
 	}
 
-	rc = message_buffer_add_end_message(src->buffer, "update");
+	return rc;
+}
+
+static void updates_sent(data_source *src)
+{
+	assert(message_buffer_size(src->buffer) == 0);
+
+	src->acked_seq = src->built_seq;
+}
+
+static void updates_lost(data_source *src)
+{
+	message_buffer_discard(src->buffer, message_buffer_size(src->buffer));
+
+	src->built_seq = src->acked_seq;
+}
+
+static return_code on_alarm(void *user_data)
+{
+	data_source *src = user_data;
+
+	assert(message_buffer_size(src->buffer) == 0);
+
+	/* each connection starts with it */
+	int preamble_size = 0;
+	return_code rc;
+	if (src->binary) {
+		rc = message_buffer_add_binary_magic(src->buffer);
+		if (rc != ok) {
+			return rc;
+		}
+		preamble_size = message_buffer_size(src->buffer);
+	}
+
+	rc = add_flush_update(src);
 	if (rc != ok) {
 		return rc;
 	}
 
+	if (message_buffer_size(src->buffer) == preamble_size) {
+		message_buffer_discard(src->buffer, preamble_size);
+	}
+
 	assert(src->conn == NULL);
-	rc = connection_create(&src->conn,
-		src->target_host, src->target_port);
-	if (rc != ok) {
-		lprintf(warning, "data source for %s %d: %s\n",
-			src->target_host, src->target_port, 
-			return_code_string(rc));
-		message_buffer_discard(src->buffer,
-			message_buffer_size(src->buffer));
+	if (message_buffer_size(src->buffer) != 0) {
+		rc = connection_create(&src->conn,
+			src->target_host, src->target_port);
+		if (rc != ok) {
+			lprintf(warning, "data source for %s %d: %s\n",
+				src->target_host, src->target_port,
+				return_code_string(rc));
+			updates_lost(src);
+		}
 	}
 
 	if (message_buffer_size(src->buffer) == 0) {
-		dispatcher_activate_alarm_slot(src->disp,
-			src->alarm, send_interval, &on_alarm, src);
+		schedule_next_flush(src);
 	} else {
 		connection_activate_io_slot(src->conn, src->disp,
 			src->output_slot, output, &on_output, src);
@@ -77,7 +274,7 @@ static return_code on_alarm(void *user_data)
 static return_code on_output(void *user_data)
 {
 	data_source *src = user_data;
-	
+
 	assert(src->conn != NULL);
 	int size = message_buffer_size(src->buffer);
 	assert(size != 0);
@@ -95,22 +292,24 @@ static return_code on_output(void *user_data)
 		break;
 	default :
 		lprintf(warning, "data source for %s %d: %s\n",
-			src->target_host, src->target_port, 
+			src->target_host, src->target_port,
 			return_code_string(rc));
-		message_buffer_discard(src->buffer, size);
+		updates_lost(src);
 		break;
 	}
 
 	if (message_buffer_size(src->buffer) == 0) {
 
-		lprintf(info, "data source for %s %d: %s\n",
-			src->target_host, src->target_port, 
-			"updates sent");
+		if (rc == ok) {
+			lprintf(info, "data source for %s %d: %s\n",
+				src->target_host, src->target_port,
+				"updates sent");
+			updates_sent(src);
+		}
 
 		connection_destroy(src->conn);
 		src->conn = NULL;
-		dispatcher_activate_alarm_slot(src->disp,
-			src->alarm, send_interval, &on_alarm, src);
+		schedule_next_flush(src);
 
 	} else {
 
@@ -120,40 +319,346 @@ static return_code on_output(void *user_data)
 
 	return ok;
 }
-		
+
+static void schedule_reconnect(data_source *src)
+{
+	lprintf(info, "data source for %s %d: reconnecting in %u ms\n",
+		src->target_host, src->target_port, src->reconnect_delay);
+
+	dispatcher_activate_alarm_slot(src->disp, src->reconnect_alarm,
+		src->reconnect_delay, &on_reconnect_alarm, src);
+
+	src->reconnect_delay *= 2;
+	if (src->reconnect_delay > max_reconnect_delay) {
+		src->reconnect_delay = max_reconnect_delay;
+	}
+}
+
+static void drop_connection(data_source *src, const char *reason)
+{
+	lprintf(warning, "data source for %s %d: %s\n",
+		src->target_host, src->target_port, reason);
+
+	dispatcher_deactivate_io_slot(src->disp, src->input_slot);
+	dispatcher_deactivate_io_slot(src->disp, src->output_slot);
+	connection_destroy(src->conn);
+	src->conn = NULL;
+	src->state = disconnected;
+	src->sending = 0;
+
+	/* a partly sent message can't be finished on a new connection */
+	updates_lost(src);
+
+	schedule_reconnect(src);
+}
+
+static void start_sending(data_source *src)
+{
+	if (src->state == connected && ! src->sending &&
+		message_buffer_size(src->buffer) != 0) {
+
+		src->sending = 1;
+		connection_activate_io_slot(src->conn, src->disp,
+			src->output_slot, output, &on_persistent_output, src);
+	}
+}
+
+static return_code on_persistent_alarm(void *user_data)
+{
+	data_source *src = user_data;
+
+	if (src->state != connected) {
+		/* changes are kept for the snapshot on connecting */
+		src->changes_pending = 0;
+	} else if (message_buffer_size(src->buffer) > max_pipelined_bytes) {
+		lprintf(warning, "data source for %s %d: %s\n",
+			src->target_host, src->target_port,
+			"too many updates queued; skipping one");
+		/* the skipped changes go out with the next update */
+		src->changes_pending = 0;
+	} else {
+		return_code rc = add_flush_update(src);
+		if (rc != ok) {
+			return rc;
+		}
+		start_sending(src);
+	}
+
+	schedule_next_flush(src);
+
+	return ok;
+}
+
+static return_code on_persistent_output(void *user_data)
+{
+	data_source *src = user_data;
+
+	assert(src->state == connected);
+	assert(src->sending);
+
+	int bytes_sent;
+	return_code rc = connection_send_nonblocking(src->conn,
+		&bytes_sent, message_buffer_data(src->buffer),
+		message_buffer_size(src->buffer));
+
+	switch (rc) {
+	case ok :
+		message_buffer_discard(src->buffer, bytes_sent);
+		break;
+	case would_block :
+		break;
+	default :
+		drop_connection(src, return_code_string(rc));
+		return ok;
+	}
+
+	src->sending = 0;
+	if (message_buffer_size(src->buffer) == 0) {
+		lprintf(info, "data source for %s %d: %s\n",
+			src->target_host, src->target_port,
+			"updates sent");
+		updates_sent(src);
+	} else {
+		start_sending(src);
+	}
+
+	return ok;
+}
+
+/* the server doesn't talk to data sources; this notices disconnects */
+static return_code on_input(void *user_data)
+{
+	data_source *src = user_data;
+
+	char buf[256];
+	int bytes_received;
+	return_code rc = connection_receive_nonblocking(src->conn,
+		&bytes_received, buf, sizeof buf);
+
+	switch (rc) {
+	case ok :
+		if (bytes_received == 0) {
+			drop_connection(src, "disconnected by peer");
+			return ok;
+		}
+		break;
+	case would_block :
+		break;
+	default :
+		drop_connection(src, return_code_string(rc));
+		return ok;
+	}
+
+	connection_activate_io_slot(src->conn, src->disp,
+		src->input_slot, input, &on_input, src);
+
+	return ok;
+}
+
+static return_code on_connect(void *user_data)
+{
+	data_source *src = user_data;
+
+	assert(src->state == connecting);
+
+	return_code rc = connection_finish_connect(src->conn);
+	if (rc != ok) {
+		drop_connection(src, return_code_string(rc));
+		return ok;
+	}
+
+	lprintf(info, "data source for %s %d: connected\n",
+		src->target_host, src->target_port);
+
+	src->state = connected;
+	src->reconnect_delay = min_reconnect_delay;
+
+	/* the server may have lost everything */
+	assert(message_buffer_size(src->buffer) == 0);
+	if (src->binary) {
+		rc = message_buffer_add_binary_magic(src->buffer);
+		if (rc != ok) {
+			return rc;
+		}
+	}
+	rc = add_update(src, 1);
+	if (rc != ok) {
+		return rc;
+	}
+
+	connection_activate_io_slot(src->conn, src->disp,
+		src->input_slot, input, &on_input, src);
+	start_sending(src);
+
+	return ok;
+}
+
+static return_code on_reconnect_alarm(void *user_data)
+{
+	data_source *src = user_data;
+
+	assert(src->state == disconnected);
+
+	return_code rc = connection_start_connect(&src->conn,
+		src->target_ip, src->target_port);
+	if (rc != ok) {
+		lprintf(warning, "data source for %s %d: %s\n",
+			src->target_host, src->target_port,
+			return_code_string(rc));
+		schedule_reconnect(src);
+		return ok;
+	}
+
+	src->state = connecting;
+	connection_activate_io_slot(src->conn, src->disp,
+		src->output_slot, output, &on_connect, src);
+
+	return ok;
+}
+
+static return_code set_value(data_source *src,
+	const char *key, const typed_value *value)
+{
+	int idx = map_find_index(src->data, key);
+	if (idx != -1 &&
+		typed_value_equal(map_get_typed_value(src->data, idx), value)) {
+		return ok;
+	}
+
+	/* a new key goes last */
+	int new_idx = idx == -1 ? map_get_n_keys(src->data) : idx;
+	if (new_idx == src->n_key_changes_alloc) {
+
+		int new_alloc = src->n_key_changes_alloc +
+			src->n_key_changes_alloc / 2 + 1;
+		unsigned long *new_key_changes = src->key_changes == NULL ?
+			malloc(sizeof *new_key_changes * new_alloc) :
+			realloc(src->key_changes,
+				sizeof *new_key_changes * new_alloc);
+		if (new_key_changes == NULL) {
+			return out_of_memory;
+		}
+
+		src->key_changes = new_key_changes;
+		src->n_key_changes_alloc = new_alloc;
+	}
+
+	return_code rc = idx == -1 ?
+		map_set_typed_value(src->data, key, value) :
+		map_set_index_value(src->data, idx, value);
+	if (rc != ok) {
+		return rc;
+	}
+
+	++src->change_seq;
+	src->key_changes[new_idx] = src->change_seq;
+	note_change(src);
+
+	return ok;
+}
+
 return_code data_source_set_string_value(data_source *src,
 	const char *key, const char *value)
 {
-	return map_set_value(src->data, key, value);
+	typed_value string;
+	string.type = string_value;
+	string.u.string = value;
+
+	return set_value(src, key, &string);
 }
 
 return_code data_source_set_integer_value(data_source *src,
+	const char *key, long long value)
+{
+	typed_value integer;
+	integer.type = integer_value;
+	integer.u.integer = value;
+
+	return set_value(src, key, &integer);
+}
+
+return_code data_source_set_double_value(data_source *src,
+	const char *key, double value)
+{
+	typed_value real;
+	real.type = double_value;
+	real.u.real = value;
+
+	return set_value(src, key, &real);
+}
+
+return_code data_source_set_bool_value(data_source *src,
 	const char *key, int value)
 {
-	char buf[22]; // fits for 64 bits
-	sprintf(buf, "%d", value);
+	typed_value boolean;
+	boolean.type = bool_value;
+	boolean.u.boolean = value != 0;
 
-	return map_set_value(src->data, key, buf);
-}	
-	
-return_code data_source_create(data_source **result,
-	dispatcher *disp, const char *target_host, int target_port)
+	return set_value(src, key, &boolean);
+}
+
+void data_source_set_flush_policy(data_source *src,
+	unsigned int coalesce_delay, unsigned int max_latency,
+	unsigned int heartbeat_interval)
 {
+	src->change_driven = 1;
+	src->coalesce_delay = coalesce_delay;
+	src->max_latency = max_latency;
+	src->heartbeat_interval = heartbeat_interval;
+
+	if (src->persistent || src->conn == NULL) {
+		schedule_next_flush(src);
+	}
+}
+
+void data_source_set_binary(data_source *src)
+{
+	assert(src->state == disconnected && src->conn == NULL);
+
+	src->binary = 1;
+	message_buffer_set_binary(src->buffer);
+}
+
+void data_source_set_snapshot_interval(data_source *src, int n_intervals)
+{
+	assert(n_intervals >= 0);
+
+	src->snapshot_interval = n_intervals;
+	src->n_intervals = 0;
+}
+
+static return_code create_data_source(data_source **result,
+	dispatcher *disp, const char *target_host, int target_port,
+	int persistent)
+{
+	/* reconnecting mustn't wait for name lookups */
+	char target_ip[ip_buf_size] = "";
+	if (persistent) {
+		return_code rc = connection_resolve_host(target_ip,
+			target_host);
+		if (rc != ok) {
+			return rc;
+		}
+	}
+
 	data_source *src = malloc(sizeof *src);
 	if (src == NULL) {
 		return out_of_memory;
 	}
 
 	src->disp = disp;
-	
+
 	src->target_host = malloc(strlen(target_host) + 1);
 	if (src->target_host == NULL) {
 		free(src);
 		return out_of_memory;
 	}
 	strcpy(src->target_host, target_host);
+	strcpy(src->target_ip, target_ip);
 
 	src->target_port = target_port;
+	src->persistent = persistent;
+	src->binary = 0;
 
 	return_code rc = map_create(&src->data);
 	if (rc != ok) {
@@ -177,11 +682,35 @@ return_code data_source_create(data_source **result,
 		free(src->target_host);
 		free(src);
 		return rc;
-	}		
+	}
+
+	rc = dispatcher_create_alarm_slot(disp, &src->reconnect_alarm);
+	if (rc != ok) {
+		dispatcher_destroy_alarm_slot(disp, src->alarm);
+		message_buffer_destroy(src->buffer);
+		map_destroy(src->data);
+		free(src->target_host);
+		free(src);
+		return rc;
+	}
+
+	rc = dispatcher_create_io_slot(disp, &src->input_slot);
+	if (rc != ok) {
+		dispatcher_destroy_alarm_slot(disp, src->reconnect_alarm);
+		dispatcher_destroy_alarm_slot(disp, src->alarm);
+		message_buffer_destroy(src->buffer);
+		map_destroy(src->data);
+		free(src->target_host);
+		free(src);
+		return rc;
+	}
 
 	rc = dispatcher_create_io_slot(disp, &src->output_slot);
 	if (rc != ok) {
+		dispatcher_destroy_io_slot(disp, src->input_slot);
+		dispatcher_destroy_alarm_slot(disp, src->reconnect_alarm);
 		dispatcher_destroy_alarm_slot(disp, src->alarm);
+		message_buffer_destroy(src->buffer);
 		map_destroy(src->data);
 		free(src->target_host);
 		free(src);
@@ -189,32 +718,67 @@ return_code data_source_create(data_source **result,
 	}
 
 	src->conn = NULL;
-		
-	dispatcher_activate_alarm_slot(src->disp,
-		src->alarm, send_interval,
-		&on_alarm, src);
+	src->state = disconnected;
+	src->sending = 0;
+	src->reconnect_delay = min_reconnect_delay;
+	src->key_changes = NULL;
+	src->n_key_changes_alloc = 0;
+	src->change_seq = 0;
+	src->built_seq = 0;
+	src->acked_seq = 0;
+	src->snapshot_interval = 0;
+	src->n_intervals = 0;
+	src->change_driven = 0;
+	src->coalesce_delay = 0;
+	src->max_latency = 0;
+	src->heartbeat_interval = 0;
+	src->changes_pending = 0;
+	src->first_change_time = 0;
+
+	if (persistent) {
+		dispatcher_activate_alarm_slot(src->disp,
+			src->reconnect_alarm, 0, &on_reconnect_alarm, src);
+	}
+	schedule_next_flush(src);
 
-	lprintf(info, "created data source for %s %d\n",
+	lprintf(info, "created %sdata source for %s %d\n",
+		persistent ? "persistent " : "",
 		src->target_host, src->target_port);
 
 	*result = src;
 	return ok;
 }
 
+return_code data_source_create(data_source **result,
+	dispatcher *disp, const char *target_host, int target_port)
+{
+	return create_data_source(result, disp, target_host, target_port, 0);
+}
+
+return_code data_source_create_persistent(data_source **result,
+	dispatcher *disp, const char *target_host, int target_port)
+{
+	return create_data_source(result, disp, target_host, target_port, 1);
+}
+
 void data_source_destroy(data_source *src)
 {
 	lprintf(info, "destroying data source for %s %d\n",
 		src->target_host, src->target_port);
 
+	/* the slots go first: the connection's fd must outlive them */
+	dispatcher_destroy_io_slot(src->disp, src->output_slot);
+	dispatcher_destroy_io_slot(src->disp, src->input_slot);
+
 	if (src->conn != NULL) {
 		connection_destroy(src->conn);
 	}
 
-	dispatcher_destroy_io_slot(src->disp, src->output_slot);
+	dispatcher_destroy_alarm_slot(src->disp, src->reconnect_alarm);
 	dispatcher_destroy_alarm_slot(src->disp, src->alarm);
 	message_buffer_destroy(src->buffer);
+	free(src->key_changes);
 	map_destroy(src->data);
 	free(src->target_host);
 	free(src);
 }
-
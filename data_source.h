@@ -9,9 +9,42 @@ typedef struct data_source data_source;
 return_code data_source_create(data_source **result,
 	dispatcher *disp, const char *target_host, int target_port);
 
+/*
+ * A persistent data source keeps a single connection open, and
+ * reconnects with backoff when it is lost. It looks target_host up
+ * only once, here, so that it doesn't wait for that on reconnects.
+ */
+return_code data_source_create_persistent(data_source **result,
+	dispatcher *disp, const char *target_host, int target_port);
+
+/* sends binary messages; call before the dispatcher runs */
+void data_source_set_binary(data_source *src);
+
+/*
+ * Instead of every 15 seconds, sends updates coalesce_delay msecs
+ * after the last change, but no later than max_latency msecs after
+ * the first change that wasn't sent yet. Without changes, an empty
+ * update goes out every heartbeat_interval msecs (0: never).
+ */
+void data_source_set_flush_policy(data_source *src,
+	unsigned int coalesce_delay, unsigned int max_latency,
+	unsigned int heartbeat_interval);
+
+/*
+ * Updates only carry changed keys. With n_intervals > 0, every
+ * n_intervals-th update is a full snapshot, so that a server that lost
+ * its data catches up; 0 (the default) turns snapshots off.
+ */
+void data_source_set_snapshot_interval(data_source *src, int n_intervals);
+
 return_code data_source_set_string_value(data_source *src,
 	const char *key, const char *value);
+/* binary sources send values with their types; text ones as text */
 return_code data_source_set_integer_value(data_source *src,
+	const char *key, long long value);
+return_code data_source_set_double_value(data_source *src,
+	const char *key, double value);
+return_code data_source_set_bool_value(data_source *src,
 	const char *key, int value);
 
 void data_source_destroy(data_source *src);
@@ -0,0 +1,350 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "acceptor.h"
+#include "connection.h"
+#include "data_source.h"
+#include "data_store.h"
+#include "dispatcher.h"
+
+#undef NDEBUG
+#include <assert.h>
+
+/*
+ * The data sources send to an in-process data store on the same
+ * dispatcher, which is run for a while at a time.
+ */
+static return_code on_stop_alarm(void *user_data)
+{
+	dispatcher_stop(user_data);
+	return ok;
+}
+
+static void run_for(dispatcher *disp, unsigned int msecs)
+{
+	alarm_slot *alarm;
+	return_code rc = dispatcher_create_alarm_slot(disp, &alarm);
+	assert(rc == ok);
+
+	dispatcher_activate_alarm_slot(disp, alarm, msecs,
+		&on_stop_alarm, disp);
+	rc = dispatcher_run(disp);
+	assert(rc == ok);
+
+	dispatcher_destroy_alarm_slot(disp, alarm);
+}
+
+/* whether the store's status holds element */
+static int has(data_store *store, const char *element)
+{
+	const char *data;
+	int size;
+	void *handle;
+	return_code rc = data_store_acquire_status(store,
+		&data, &size, &handle);
+	assert(rc == ok);
+
+	char *status = malloc(size + 1);
+	assert(status != NULL);
+	memcpy(status, data, size);
+	status[size] = '\0';
+	data_store_release_status(handle);
+
+	int result = strstr(status, element) != NULL;
+	free(status);
+
+	return result;
+}
+
+/* a persistent source keeps one connection, and reconnects */
+static void persistent_test()
+{
+	dispatcher *disp;
+	return_code rc = dispatcher_create(&disp);
+	assert(rc == ok);
+
+	data_store *store;
+	rc = data_store_create(&store, disp, "127.0.0.1", 0);
+	assert(rc == ok);
+	int port = data_store_port(store);
+
+	data_source *src;
+	rc = data_source_create_persistent(&src, disp, "127.0.0.1", port);
+	assert(rc == ok);
+
+	rc = data_source_set_string_value(src, "a", "1");
+	assert(rc == ok);
+	rc = data_source_set_string_value(src, "b", "2");
+	assert(rc == ok);
+
+	/* the connection starts with everything */
+	run_for(disp, 200);
+	assert(has(store, "<a>1</a>"));
+	assert(has(store, "<b>2</b>"));
+	assert(data_store_n_sessions(store) == 1);
+
+	run_for(disp, 200);
+	assert(data_store_n_sessions(store) == 1);
+
+	/* a restarted server gets everything again */
+	data_store_destroy(store);
+	rc = data_store_create(&store, disp, "127.0.0.1", port);
+	assert(rc == ok);
+	assert(! has(store, "<a>"));
+
+	run_for(disp, 500);
+	assert(has(store, "<a>1</a>"));
+	assert(has(store, "<b>2</b>"));
+	assert(data_store_n_sessions(store) == 1);
+
+	data_source_destroy(src);
+	data_store_destroy(store);
+	dispatcher_destroy(disp);
+}
+
+/* updates only carry changed keys, and those that were lost */
+static void delta_test()
+{
+	dispatcher *disp;
+	return_code rc = dispatcher_create(&disp);
+	assert(rc == ok);
+
+	data_store *store;
+	rc = data_store_create(&store, disp, "127.0.0.1", 0);
+	assert(rc == ok);
+	int port = data_store_port(store);
+
+	data_source *src;
+	rc = data_source_create(&src, disp, "127.0.0.1", port);
+	assert(rc == ok);
+	data_source_set_flush_policy(src, 20, 100, 0);
+
+	rc = data_source_set_string_value(src, "a", "1");
+	assert(rc == ok);
+	rc = data_source_set_string_value(src, "b", "2");
+	assert(rc == ok);
+
+	run_for(disp, 200);
+	assert(has(store, "<a>1</a>"));
+	assert(has(store, "<b>2</b>"));
+
+	/* resending a would count as an unchanged value */
+	rc = data_source_set_string_value(src, "a", "1");
+	assert(rc == ok);
+	rc = data_source_set_string_value(src, "b", "3");
+	assert(rc == ok);
+
+	run_for(disp, 200);
+	assert(has(store, "<b>3</b>"));
+	assert(data_store_n_unchanged_values(store) == 0);
+
+	/* without a server, c is lost */
+	data_store_destroy(store);
+	rc = data_source_set_string_value(src, "c", "4");
+	assert(rc == ok);
+	run_for(disp, 200);
+
+	rc = data_store_create(&store, disp, "127.0.0.1", port);
+	assert(rc == ok);
+	rc = data_source_set_string_value(src, "d", "5");
+	assert(rc == ok);
+
+	run_for(disp, 200);
+	assert(has(store, "<c>4</c>"));
+	assert(has(store, "<d>5</d>"));
+	assert(! has(store, "<a>"));
+
+	data_source_destroy(src);
+	data_store_destroy(store);
+	dispatcher_destroy(disp);
+}
+
+/* a persistent source only sends everything on connecting */
+static void persistent_delta_test()
+{
+	dispatcher *disp;
+	return_code rc = dispatcher_create(&disp);
+	assert(rc == ok);
+
+	data_store *store;
+	rc = data_store_create(&store, disp, "127.0.0.1", 0);
+	assert(rc == ok);
+	int port = data_store_port(store);
+
+	data_source *src;
+	rc = data_source_create_persistent(&src, disp, "127.0.0.1", port);
+	assert(rc == ok);
+	data_source_set_flush_policy(src, 20, 100, 0);
+
+	rc = data_source_set_string_value(src, "a", "1");
+	assert(rc == ok);
+	rc = data_source_set_string_value(src, "b", "2");
+	assert(rc == ok);
+
+	run_for(disp, 200);
+	assert(has(store, "<a>1</a>"));
+
+	rc = data_source_set_string_value(src, "b", "3");
+	assert(rc == ok);
+
+	run_for(disp, 200);
+	assert(has(store, "<b>3</b>"));
+	assert(data_store_n_unchanged_values(store) == 0);
+
+	/* a new connection gets a as well, though it didn't change */
+	data_store_destroy(store);
+	rc = data_store_create(&store, disp, "127.0.0.1", port);
+	assert(rc == ok);
+
+	run_for(disp, 500);
+	assert(has(store, "<a>1</a>"));
+	assert(has(store, "<b>3</b>"));
+
+	data_source_destroy(src);
+	data_store_destroy(store);
+	dispatcher_destroy(disp);
+}
+
+/* changes a's value every ticker_interval msecs */
+enum { ticker_interval = 50 };
+
+typedef struct {
+	dispatcher *disp;
+	data_source *src;
+	alarm_slot *alarm;
+	int n_ticks;
+} ticker;
+
+static return_code on_tick(void *user_data)
+{
+	ticker *t = user_data;
+
+	char value[16];
+	sprintf(value, "%d", ++t->n_ticks);
+	return_code rc = data_source_set_string_value(t->src, "a", value);
+	if (rc != ok) {
+		return rc;
+	}
+
+	dispatcher_activate_alarm_slot(t->disp, t->alarm,
+		ticker_interval, &on_tick, t);
+	return ok;
+}
+
+/* updates wait for changes to settle, but only so long */
+static void flush_test()
+{
+	dispatcher *disp;
+	return_code rc = dispatcher_create(&disp);
+	assert(rc == ok);
+
+	data_store *store;
+	rc = data_store_create(&store, disp, "127.0.0.1", 0);
+	assert(rc == ok);
+
+	data_source *src;
+	rc = data_source_create_persistent(&src, disp,
+		"127.0.0.1", data_store_port(store));
+	assert(rc == ok);
+	data_source_set_flush_policy(src, 200, 400, 0);
+
+	/* connected, without anything to send */
+	run_for(disp, 100);
+	assert(data_store_n_sessions(store) == 1);
+
+	/* a single change goes out after the coalesce delay */
+	rc = data_source_set_string_value(src, "b", "1");
+	assert(rc == ok);
+	run_for(disp, 50);
+	assert(! has(store, "<b>"));
+	run_for(disp, 350);
+	assert(has(store, "<b>1</b>"));
+
+	/* changes that never settle go out after the maximum latency */
+	ticker t;
+	t.disp = disp;
+	t.src = src;
+	t.n_ticks = 0;
+	rc = dispatcher_create_alarm_slot(disp, &t.alarm);
+	assert(rc == ok);
+	dispatcher_activate_alarm_slot(disp, t.alarm, 0, &on_tick, &t);
+
+	run_for(disp, 200);
+	assert(! has(store, "<a>"));
+	run_for(disp, 400);
+	assert(has(store, "<a>"));
+
+	dispatcher_destroy_alarm_slot(disp, t.alarm);
+	data_source_destroy(src);
+	data_store_destroy(store);
+	dispatcher_destroy(disp);
+}
+
+/* counts the updates a server that doesn't run received */
+static int count_updates(acceptor *acc)
+{
+	connection *conn;
+	return_code rc = acceptor_accept_nonblocking(acc, &conn);
+	assert(rc == ok);
+
+	char buf[4096];
+	int length = 0;
+	int received;
+	do {
+		received = 0;
+		rc = connection_receive_nonblocking(conn, &received,
+			buf + length, sizeof buf - 1 - length);
+		assert(rc == ok || rc == would_block);
+		length += received;
+	} while (rc == ok && received != 0);
+	buf[length] = '\0';
+	connection_destroy(conn);
+
+	int n_updates = 0;
+	const char *p;
+	for (p = strstr(buf, "<update>"); p != NULL;
+		p = strstr(p + 1, "<update>")) {
+		++n_updates;
+	}
+
+	return n_updates;
+}
+
+/* without changes, empty updates go out every heartbeat interval */
+static void heartbeat_test()
+{
+	dispatcher *disp;
+	return_code rc = dispatcher_create(&disp);
+	assert(rc == ok);
+
+	/* the kernel completes the connection; nobody needs to accept */
+	acceptor *acc;
+	rc = acceptor_create(&acc, "127.0.0.1", 0);
+	assert(rc == ok);
+
+	data_source *src;
+	rc = data_source_create_persistent(&src, disp,
+		"127.0.0.1", acceptor_port(acc));
+	assert(rc == ok);
+	data_source_set_flush_policy(src, 20, 100, 100);
+
+	run_for(disp, 550);
+	int n_updates = count_updates(acc);
+	assert(n_updates >= 3 && n_updates <= 5);
+
+	data_source_destroy(src);
+	acceptor_destroy(acc);
+	dispatcher_destroy(disp);
+}
+
+int main()
+{
+	persistent_test();
+	delta_test();
+	persistent_delta_test();
+	flush_test();
+	heartbeat_test();
+
+	return 0;
+}
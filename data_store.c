@@ -1,26 +1,180 @@
 #include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "data_session.h"
 #include "data_store.h"
 #include "lprintf.h"
+#include "message_buffer.h"
+#include "reclaimer.h"
+#include "socket_utils.h"
 
-struct data_store {
+/*
+ * Each listener accepts sessions for one dispatcher, which may run on
+ * its own thread. The data and the session registry are shared, and
+ * guarded by their own locks.
+ *
+ * The data is split into shards by key, each with its own map and
+ * lock, so that updates of different keys don't wait for each other.
+ * Readers don't take those locks at all. Each shard publishes its keys
+ * in a directory of entries, by map index; a changed key gets a new
+ * entry that points to the one it replaces, so an update only touches
+ * the keys it changes, however many there are.
+ *
+ * An update write-locks all the shards it changes, in index order, so
+ * that updates wait for each other, not in a circle. Once it has the
+ * new entries of all of them, it takes one range of change sequence
+ * numbers from next_seq, without a lock. change_seq is how far the
+ * changes are published: after its entries are in place, a writer
+ * unlocks its shards, waits until change_seq reaches the numbers
+ * before its own, and then advances it past them, at once for all its
+ * shards. So once a reader has read change_seq, the reads it starts
+ * next have every change up to that version, and each update whole or
+ * not at all. The wait is only for writers that already have their
+ * numbers, which only have to unlock and wait in turn; nobody waits
+ * for it with a shard lock held.
+ *
+ * A read takes change_seq as its version, and finds each key's value
+ * as of that version by following the entries back from the newest,
+ * so all shards are read as of the same version. Once change_seq is
+ * past its replacement, nothing that starts later gets to an entry,
+ * and it is retired to the store's reclaimer, which frees it after the
+ * reads going on are done; so are directories that were replaced, and
+ * the cached status. Both writers and reads that end collect what can
+ * be freed, so it doesn't wait for the next update. An update's
+ * entries are allocated in one batch, which is freed with the last of
+ * them.
+ *
+ * A listener also keeps the subscribed sessions on its dispatcher.
+ * After an update, a byte on its wake pipe makes that dispatcher
+ * notify them; until it gets around to that, later updates don't
+ * write again, so the notifications for them are batched. Updates
+ * only take the sessions lock for this if anyone is subscribed at all,
+ * which n_subscribers tells them without a lock.
+ */
+static const session_limits default_session_limits = {
+	default_high_watermark,
+	default_low_watermark,
+	default_stall_timeout,
+	default_max_receive_size,
+	default_receive_budget
+};
+
+typedef struct {
+	data_store *store;
 	dispatcher *disp;
 	acceptor *acc;
 	io_slot *acc_slot;
+	int wake_fds[2]; /* read end, write end */
+	io_slot *wake_slot;
+	int wake_pending;
+	data_session **subscribers;
+	int n_subscribers;
+	int n_subscribers_alloc;
+} listener;
+
+/*
+ * A status message with all keys, as of version; sessions send it as
+ * is while the data stays unchanged. It lives until the last session
+ * that holds it has sent it, and the store lets go of it.
+ */
+typedef struct {
+	retired r;
+	int n_refs; /* atomic */
+	unsigned long version;
+	int size;
+	char data[];
+} status;
+
+/*
+ * A key's value as of version. Entries never change: a change to the
+ * key makes a new one, which points to the one it replaces.
+ */
+typedef struct entry entry;
+typedef struct batch batch;
+
+struct entry {
+	retired r;
+	batch *b;
+	const char *key; /* the shard's, which lives as long as the store */
+	unsigned long version;
+	entry *prev; /* NULL for the key's first */
+	typed_value value; /* a string value's characters are in b */
+};
+
+/*
+ * The entries of an update, followed by the characters of their string
+ * values. It lives until the last of them is reclaimed, and its writer
+ * is done publishing it.
+ */
+struct batch {
+	int n_refs; /* atomic */
+	int n_entries;
+	entry entries[];
+};
+
+enum { chunk_size = 64 };
+
+/*
+ * A shard's current entries by map index, in chunks of chunk_size,
+ * which stay where they are: a directory that is too small is
+ * replaced by a bigger one with the same chunks and some new ones.
+ */
+typedef struct {
+	retired r;
+	int n_chunks;
+	entry **chunks[];
+} directory;
+
+/*
+ * The map, guarded by lock, is the writers' copy of the data; they
+ * publish their changes in the directory, which readers share. A key
+ * is only in changes once; pending tells if it is.
+ */
+typedef struct {
+	pthread_rwlock_t lock;
 	map *data;
+	int *changes; /* map indexes not published yet */
+	int n_changes;
+	int n_changes_alloc;
+	char *pending; /* by map index */
+	int n_pending_alloc;
+	unsigned long n_unchanged_values; /* updates that were no-ops */
+	directory *dir; /* atomic */
+	int n_keys; /* published ones; atomic */
+} shard;
+
+struct data_store {
+	listener *listeners;
+	int n_listeners;
+	shard *shards;
+	int n_shards;
+	unsigned long next_seq; /* atomic */
+	unsigned long change_seq; /* atomic */
+	reclaimer *rec;
+	status *cached_status; /* NULL if none; atomic */
+	pthread_mutex_t sessions_lock; /* also guards the subscribers */
 	data_session **sessions;
 	int n_sessions;
 	int n_sessions_alloc;
+	int n_subscribers; /* over all listeners; atomic */
+	session_limits limits;
+	unsigned long n_throttled_sessions;
+	unsigned long n_evicted_sessions;
 };
 
-static return_code on_accept(void *user_data)
+static return_code add_session(data_store *store, data_session *sess)
 {
-	data_store *store = user_data;
+	return_code rc = ok;
+
+	pthread_mutex_lock(&store->sessions_lock);
 
 	if (store->n_sessions == store->n_sessions_alloc) {
-		
+
 		int new_alloc = store->n_sessions_alloc +
 			store->n_sessions_alloc / 2 + 1;
 		data_session **new_sessions = store->sessions == NULL ?
@@ -29,20 +183,123 @@ static return_code on_accept(void *user_data)
 				sizeof *new_sessions * new_alloc);
 
 		if (new_sessions == NULL) {
-			return out_of_memory;
+			rc = out_of_memory;
+		} else {
+			store->n_sessions_alloc = new_alloc;
+			store->sessions = new_sessions;
 		}
+	}
+
+	if (rc == ok) {
+		store->sessions[store->n_sessions] = sess;
+		++store->n_sessions;
+	}
 
-		store->n_sessions_alloc = new_alloc;
-		store->sessions = new_sessions;
+	pthread_mutex_unlock(&store->sessions_lock);
+
+	return rc;
+}
+
+/* the subscribers only change on their listener's thread */
+static return_code on_wake(void *user_data)
+{
+	listener *lst = user_data;
+
+	char buf[64];
+	while (read(lst->wake_fds[0], buf, sizeof buf) > 0) {
+		;
 	}
-			
-	return_code rc = data_session_create(
-		&store->sessions[store->n_sessions],
-		store->disp, store, store->acc);
+
+	pthread_mutex_lock(&lst->store->sessions_lock);
+	lst->wake_pending = 0;
+	pthread_mutex_unlock(&lst->store->sessions_lock);
+
+	/* a notified session may stop, dropping out of the list */
+	int i = lst->n_subscribers;
+	while (i != 0) {
+		--i;
+		if (i < lst->n_subscribers) {
+			data_session_notify(lst->subscribers[i]);
+		}
+	}
+
+	dispatcher_activate_io_slot(lst->disp, lst->wake_slot,
+		lst->wake_fds[0], input, &on_wake, lst);
+
+	return ok;
+}
+
+static void wake_listeners(data_store *store)
+{
+	/*
+	 * Either a new subscriber sees the data just updated in its
+	 * first status, or this sees the subscriber.
+	 */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&store->n_subscribers, __ATOMIC_RELAXED) == 0) {
+		return;
+	}
+
+	pthread_mutex_lock(&store->sessions_lock);
+
+	int i;
+	for (i = 0; i != store->n_listeners; ++i) {
+		listener *lst = &store->listeners[i];
+		if (lst->n_subscribers != 0 && ! lst->wake_pending) {
+			char c = 0;
+			ssize_t r;
+			do {
+				r = write(lst->wake_fds[1], &c, sizeof c);
+			} while (r == -1 && errno == EINTR);
+			lst->wake_pending = 1;
+		}
+	}
+
+	pthread_mutex_unlock(&store->sessions_lock);
+}
+
+static void remove_subscriber(data_store *store, data_session *sess)
+{
+	int i;
+	for (i = 0; i != store->n_listeners; ++i) {
+
+		listener *lst = &store->listeners[i];
+
+		int j;
+		for (j = 0; j != lst->n_subscribers; ++j) {
+			if (lst->subscribers[j] == sess) {
+				break;
+			}
+		}
+
+		if (j != lst->n_subscribers) {
+			__atomic_sub_fetch(&store->n_subscribers, 1,
+				__ATOMIC_SEQ_CST);
+			--lst->n_subscribers;
+			for (; j != lst->n_subscribers; ++j) {
+				lst->subscribers[j] = lst->subscribers[j + 1];
+			}
+			return;
+		}
+	}
+}
+
+static return_code on_accept(void *user_data)
+{
+	listener *lst = user_data;
+	data_store *store = lst->store;
+
+	data_session *sess;
+	return_code rc = data_session_create(&sess,
+		lst->disp, store, lst->acc, &store->limits);
 
 	switch (rc) {
 	case ok :
-		++store->n_sessions;
+		rc = add_session(store, sess);
+		if (rc != ok) {
+			data_session_destroy(sess);
+			return rc;
+		}
 		break;
 	case would_block :
 		/* just my luck */
@@ -51,93 +308,970 @@ static return_code on_accept(void *user_data)
 		return rc;
 		break;
 	}
-		
-	acceptor_activate_io_slot(store->acc, store->disp,
-		store->acc_slot, &on_accept, store);
+
+	acceptor_activate_io_slot(lst->acc, lst->disp,
+		lst->acc_slot, &on_accept, lst);
 
 	return ok;
 }
 
+static void release_batch(batch *b)
+{
+	if (__atomic_sub_fetch(&b->n_refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		free(b);
+	}
+}
+
+static void free_entry(retired *item)
+{
+	release_batch(((entry *) item)->b);
+}
+
+/* for directories, which start with their retired */
+static void free_retired(retired *item)
+{
+	free(item);
+}
+
+static entry **directory_slot(directory *dir, int idx)
+{
+	assert(idx >= 0 && idx < dir->n_chunks * chunk_size);
+
+	return &dir->chunks[idx / chunk_size][idx % chunk_size];
+}
+
+static void destroy_shards(data_store *store)
+{
+	int i;
+	for (i = 0; i != store->n_shards; ++i) {
+		shard *sh = &store->shards[i];
+
+		/* the older entries are retired */
+		directory *dir = sh->dir;
+		int j;
+		for (j = 0; j != sh->n_keys; ++j) {
+			free_entry(&(*directory_slot(dir, j))->r);
+		}
+		for (j = 0; j != dir->n_chunks; ++j) {
+			free(dir->chunks[j]);
+		}
+		free(dir);
+
+		free(sh->pending);
+		free(sh->changes);
+		map_destroy(sh->data);
+		pthread_rwlock_destroy(&sh->lock);
+	}
+
+	free(store->shards);
+	store->shards = NULL;
+	store->n_shards = 0;
+}
+
+static return_code create_shards(data_store *store, int n_shards)
+{
+	assert(store->n_shards == 0);
+
+	store->shards = malloc(sizeof *store->shards * n_shards);
+	if (store->shards == NULL) {
+		return out_of_memory;
+	}
+
+	for (; store->n_shards != n_shards; ++store->n_shards) {
+
+		shard *sh = &store->shards[store->n_shards];
+
+		directory *dir = malloc(sizeof *dir);
+		if (dir == NULL) {
+			destroy_shards(store);
+			return out_of_memory;
+		}
+
+		return_code rc = map_create(&sh->data);
+		if (rc != ok) {
+			free(dir);
+			destroy_shards(store);
+			return rc;
+		}
+
+		dir->n_chunks = 0;
+
+		pthread_rwlock_init(&sh->lock, NULL);
+		sh->changes = NULL;
+		sh->n_changes = 0;
+		sh->n_changes_alloc = 0;
+		sh->pending = NULL;
+		sh->n_pending_alloc = 0;
+		sh->n_unchanged_values = 0;
+		sh->dir = dir;
+		sh->n_keys = 0;
+	}
+
+	return ok;
+}
+
+static void data_store_dispose(data_store *store)
+{
+	int i;
+	for (i = 0; i != store->n_listeners; ++i) {
+		listener *lst = &store->listeners[i];
+		dispatcher_destroy_io_slot(lst->disp, lst->wake_slot);
+		close(lst->wake_fds[1]);
+		close(lst->wake_fds[0]);
+		free(lst->subscribers);
+		dispatcher_destroy_io_slot(lst->disp, lst->acc_slot);
+		acceptor_destroy(lst->acc);
+	}
+
+	if (store->cached_status != NULL) {
+		data_store_release_status(store->cached_status);
+	}
+
+	destroy_shards(store);
+	if (store->rec != NULL) {
+		reclaimer_destroy(store->rec);
+	}
+
+	pthread_mutex_destroy(&store->sessions_lock);
+	free(store->listeners);
+	free(store);
+}
+
 return_code data_store_create(data_store **result,
 	dispatcher *disp, const char *ip_address, int port)
 {
+	return data_store_create_multi(result, &disp, 1, ip_address, port);
+}
+
+return_code data_store_create_multi(data_store **result,
+	dispatcher **disps, int n_disps, const char *ip_address, int port)
+{
+	assert(n_disps > 0);
+
 	data_store *store = malloc(sizeof *store);
 	if (store == NULL) {
 		return out_of_memory;
 	}
 
-	store->disp = disp;
-
-	return_code rc = acceptor_create(&store->acc, ip_address, port);
-	if (rc != ok) {
+	store->listeners = malloc(sizeof *store->listeners * n_disps);
+	if (store->listeners == NULL) {
 		free(store);
-		return rc;
+		return out_of_memory;
 	}
+	store->n_listeners = 0;
 
-	rc = dispatcher_create_io_slot(store->disp, &store->acc_slot);
+	store->shards = NULL;
+	store->n_shards = 0;
+	store->next_seq = 0;
+	store->change_seq = 0;
+	store->rec = NULL;
+	store->cached_status = NULL;
+	pthread_mutex_init(&store->sessions_lock, NULL);
+	store->sessions = NULL;
+	store->n_sessions = 0;
+	store->n_sessions_alloc = 0;
+	store->n_subscribers = 0;
+	store->limits = default_session_limits;
+	store->n_throttled_sessions = 0;
+	store->n_evicted_sessions = 0;
+
+	return_code rc = reclaimer_create(&store->rec);
 	if (rc != ok) {
-		acceptor_destroy(store->acc);
-		free(store);
+		data_store_dispose(store);
 		return rc;
 	}
 
-	rc = map_create(&store->data);
+	rc = create_shards(store, 1);
 	if (rc != ok) {
-		dispatcher_destroy_io_slot(store->disp, store->acc_slot);
-		acceptor_destroy(store->acc);
-		free(store);
+		data_store_dispose(store);
 		return rc;
 	}
 
-	store->sessions = NULL;
-	store->n_sessions = 0;
-	store->n_sessions_alloc = 0;
+	int i;
+	for (i = 0; i != n_disps; ++i) {
 
-	acceptor_activate_io_slot(store->acc, store->disp,
-		store->acc_slot, &on_accept, store);
+		listener *lst = &store->listeners[i];
+		lst->store = store;
+		lst->disp = disps[i];
 
-	lprintf(info, "data store listening at %s port %d\n",
-		acceptor_ip(store->acc), acceptor_port(store->acc));
+		/* later listeners join the first one's (ephemeral) port */
+		int lst_port = i == 0 ? port :
+			acceptor_port(store->listeners[0].acc);
+
+		rc = n_disps == 1 ?
+			acceptor_create(&lst->acc, ip_address, lst_port) :
+			acceptor_create_shared(&lst->acc,
+				ip_address, lst_port);
+		if (rc != ok) {
+			data_store_dispose(store);
+			return rc;
+		}
+
+		rc = dispatcher_create_io_slot(lst->disp, &lst->acc_slot);
+		if (rc != ok) {
+			acceptor_destroy(lst->acc);
+			data_store_dispose(store);
+			return rc;
+		}
+
+		if (pipe(lst->wake_fds) == -1) {
+			dispatcher_destroy_io_slot(lst->disp, lst->acc_slot);
+			acceptor_destroy(lst->acc);
+			data_store_dispose(store);
+			return cant_create_pipe;
+		}
+		set_nonblocking(lst->wake_fds[0]);
+		set_nonblocking(lst->wake_fds[1]);
+
+		rc = dispatcher_create_io_slot(lst->disp, &lst->wake_slot);
+		if (rc != ok) {
+			close(lst->wake_fds[1]);
+			close(lst->wake_fds[0]);
+			dispatcher_destroy_io_slot(lst->disp, lst->acc_slot);
+			acceptor_destroy(lst->acc);
+			data_store_dispose(store);
+			return rc;
+		}
+
+		lst->wake_pending = 0;
+		lst->subscribers = NULL;
+		lst->n_subscribers = 0;
+		lst->n_subscribers_alloc = 0;
+
+		++store->n_listeners;
+	}
+
+	for (i = 0; i != store->n_listeners; ++i) {
+		listener *lst = &store->listeners[i];
+		acceptor_activate_io_slot(lst->acc, lst->disp,
+			lst->acc_slot, &on_accept, lst);
+		dispatcher_activate_io_slot(lst->disp, lst->wake_slot,
+			lst->wake_fds[0], input, &on_wake, lst);
+	}
+
+	lprintf(info, "data store listening at %s port %d (%d listeners)\n",
+		data_store_ip(store), data_store_port(store),
+		store->n_listeners);
 
 	*result = store;
 	return ok;
 }
 
+void data_store_set_session_limits(data_store *store,
+	const session_limits *limits)
+{
+	assert(limits->low_watermark <= limits->high_watermark);
+
+	store->limits = *limits;
+}
+
+return_code data_store_set_n_shards(data_store *store, int n_shards)
+{
+	assert(n_shards > 0);
+	assert(data_store_change_seq(store) == 0);
+
+	destroy_shards(store);
+	return create_shards(store, n_shards);
+}
+
 const char *data_store_ip(const data_store *store)
 {
-	return acceptor_ip(store->acc);
+	return acceptor_ip(store->listeners[0].acc);
 }
 
 int data_store_port(const data_store *store)
 {
-	return acceptor_port(store->acc);
+	return acceptor_port(store->listeners[0].acc);
 }
 
-const map *data_store_data(const data_store *store)
+int data_store_n_shards(const data_store *store)
 {
-	return store->data;
+	return store->n_shards;
 }
 
-return_code data_store_update(data_store *store, const map *src)
+void data_store_begin_read(data_store *store, data_read *read)
 {
-	int n_src_keys = map_get_n_keys(src);
+	read->epoch = reclaimer_enter(store->rec);
+
+	/* after entering, so nothing it needs is reclaimed */
+	read->version = __atomic_load_n(&store->change_seq, __ATOMIC_SEQ_CST);
+}
+
+void data_store_end_read(data_store *store, const data_read *read)
+{
+	reclaimer_leave(store->rec, read->epoch);
+
+	/* what this read held up, if the others are done too */
+	reclaimer_collect(store->rec);
+}
+
+int data_store_n_keys(data_store *store, int shard_idx)
+{
+	assert(shard_idx >= 0 && shard_idx < store->n_shards);
+
+	return __atomic_load_n(&store->shards[shard_idx].n_keys,
+		__ATOMIC_ACQUIRE);
+}
+
+const char *data_store_read_key(data_store *store, const data_read *read,
+	int shard_idx, int idx, const typed_value **value,
+	unsigned long *version)
+{
+	assert(shard_idx >= 0 && shard_idx < store->n_shards);
+	shard *sh = &store->shards[shard_idx];
+
+	/* it has room for the keys counted before */
+	directory *dir = __atomic_load_n(&sh->dir, __ATOMIC_SEQ_CST);
+	entry *e = __atomic_load_n(directory_slot(dir, idx),
+		__ATOMIC_ACQUIRE);
+	while (e != NULL && e->version > read->version) {
+		e = e->prev;
+	}
+
+	if (e == NULL) {
+		return NULL;
+	}
+
+	*value = &e->value;
+	*version = e->version;
+	return e->key;
+}
+
+/* the status is as of read's version */
+static return_code build_status(data_store *store,
+	const data_read *read, status **result)
+{
+	message_buffer *buf;
+	return_code rc = message_buffer_create(&buf);
+	if (rc != ok) {
+		return rc;
+	}
+
+	rc = message_buffer_add_begin_message(buf, "status");
+
 	int i;
-	for (i = 0; i != n_src_keys; ++i) {
+	for (i = 0; rc == ok && i != store->n_shards; ++i) {
+		int n_keys = data_store_n_keys(store, i);
+		int j;
+		for (j = 0; rc == ok && j != n_keys; ++j) {
+			const typed_value *value;
+			unsigned long version;
+			const char *key = data_store_read_key(store, read,
+				i, j, &value, &version);
+			if (key != NULL) {
+				rc = message_buffer_add_typed_value(buf,
+					key, value);
+			}
+		}
+	}
 
-		return_code rc = map_set_value(store->data,
-			map_get_key(src, i), 
-			map_get_value(src, i)
-		);
-		if (rc != ok) {
-			return rc;
+	if (rc == ok) {
+		rc = message_buffer_add_end_message(buf, "status");
+	}
+
+	if (rc != ok) {
+		message_buffer_destroy(buf);
+		return rc;
+	}
+
+	int size = message_buffer_size(buf);
+	status *st = malloc(sizeof *st + size);
+	if (st == NULL) {
+		message_buffer_destroy(buf);
+		return out_of_memory;
+	}
+
+	st->n_refs = 1;
+	st->version = read->version;
+	st->size = size;
+	memcpy(st->data, message_buffer_data(buf), size);
+
+	message_buffer_destroy(buf);
+
+	*result = st;
+	return ok;
+}
+
+/* drops the store's reference */
+static void uncache_status(retired *item)
+{
+	data_store_release_status(item);
+}
+
+/*
+ * Whoever first finds the cached status out of date builds a new one;
+ * several may, but only one of them replaces it. The store's
+ * reference to the one replaced goes when the reads are done that may
+ * still take one of their own.
+ */
+return_code data_store_acquire_status(data_store *store,
+	const char **data, int *size, void **handle)
+{
+	data_read read;
+	data_store_begin_read(store, &read);
+
+	status *built = NULL;
+	status *st = __atomic_load_n(&store->cached_status, __ATOMIC_SEQ_CST);
+	while (st == NULL || st->version < read.version) {
+
+		if (built == NULL) {
+			return_code rc = build_status(store, &read, &built);
+			if (rc != ok) {
+				data_store_end_read(store, &read);
+				return rc;
+			}
+		}
+
+		if (__atomic_compare_exchange_n(&store->cached_status,
+			&st, built, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+			if (st != NULL) {
+				reclaimer_retire(store->rec, &st->r,
+					&uncache_status);
+			}
+			st = built;
+			built = NULL;
+		}
+	}
+
+	/* another one got there first */
+	free(built);
+
+	__atomic_add_fetch(&st->n_refs, 1, __ATOMIC_RELAXED);
+	data_store_end_read(store, &read);
+
+	*data = st->data;
+	*size = st->size;
+	*handle = st;
+	return ok;
+}
+
+void data_store_release_status(void *handle)
+{
+	status *st = handle;
+
+	if (__atomic_sub_fetch(&st->n_refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		free(st);
+	}
+}
+
+unsigned long data_store_n_unchanged_values(data_store *store)
+{
+	unsigned long result = 0;
+
+	int i;
+	for (i = 0; i != store->n_shards; ++i) {
+		shard *sh = &store->shards[i];
+		pthread_rwlock_rdlock(&sh->lock);
+		result += sh->n_unchanged_values;
+		pthread_rwlock_unlock(&sh->lock);
+	}
+
+	return result;
+}
+
+int data_store_n_retired(data_store *store)
+{
+	return reclaimer_n_pending(store->rec);
+}
+
+unsigned long data_store_change_seq(data_store *store)
+{
+	return __atomic_load_n(&store->change_seq, __ATOMIC_ACQUIRE);
+}
+
+
+/*
+ * Not the map's hash: its index uses that hash's low bits, which
+ * would all be the same within a shard.
+ */
+static int shard_of(const data_store *store, const char *key)
+{
+	unsigned int hash = 5381;
+	for (; *key != '\0'; ++key) {
+		hash = hash * 33 ^ (unsigned char) *key;
+	}
+
+	return hash % store->n_shards;
+}
+
+int data_store_find_slot(data_store *store, const char *key)
+{
+	int shard_idx = shard_of(store, key);
+	shard *sh = &store->shards[shard_idx];
+
+	pthread_rwlock_rdlock(&sh->lock);
+	int idx = map_find_index(sh->data, key);
+	pthread_rwlock_unlock(&sh->lock);
+
+	return idx == -1 ? -1 : idx * store->n_shards + shard_idx;
+}
+
+/* makes room to record a change to the key at idx */
+static return_code reserve_change(shard *sh, int idx)
+{
+	if (idx >= sh->n_pending_alloc) {
+
+		int new_alloc = sh->n_pending_alloc +
+			sh->n_pending_alloc / 2 + 1;
+		if (new_alloc <= idx) {
+			new_alloc = idx + 1;
+		}
+		char *new_pending = sh->pending == NULL ?
+			malloc(new_alloc) : realloc(sh->pending, new_alloc);
+		if (new_pending == NULL) {
+			return out_of_memory;
+		}
+
+		memset(new_pending + sh->n_pending_alloc, 0,
+			new_alloc - sh->n_pending_alloc);
+		sh->pending = new_pending;
+		sh->n_pending_alloc = new_alloc;
+	}
+
+	if (sh->n_changes != sh->n_changes_alloc) {
+		return ok;
+	}
+
+	int new_alloc = sh->n_changes_alloc + sh->n_changes_alloc / 2 + 1;
+	int *new_changes = sh->changes == NULL ?
+		malloc(sizeof *new_changes * new_alloc) :
+		realloc(sh->changes, sizeof *new_changes * new_alloc);
+	if (new_changes == NULL) {
+		return out_of_memory;
+	}
+	sh->changes = new_changes;
+	sh->n_changes_alloc = new_alloc;
+
+	return ok;
+}
+
+static void record_change(shard *sh, int idx)
+{
+	if (! sh->pending[idx]) {
+		sh->pending[idx] = 1;
+		sh->changes[sh->n_changes++] = idx;
+	}
+}
+
+/*
+ * Makes room in sh's directory for n_keys; sh's lock must be held for
+ * writing. Reads that start later find the new directory; the old one
+ * is only retired, not its chunks.
+ */
+static return_code reserve_directory(data_store *store, shard *sh,
+	int n_keys)
+{
+	/* only writers replace it, with the lock held */
+	directory *dir = sh->dir;
+
+	int n_chunks = (n_keys + chunk_size - 1) / chunk_size;
+	if (n_chunks <= dir->n_chunks) {
+		return ok;
+	}
+
+	int new_n_chunks = dir->n_chunks * 2;
+	if (new_n_chunks < n_chunks) {
+		new_n_chunks = n_chunks;
+	}
+
+	directory *new_dir = malloc(sizeof *new_dir +
+		sizeof *new_dir->chunks * new_n_chunks);
+	if (new_dir == NULL) {
+		return out_of_memory;
+	}
+
+	int i;
+	for (i = 0; i != new_n_chunks; ++i) {
+		new_dir->chunks[i] = i < dir->n_chunks ? dir->chunks[i] :
+			calloc(chunk_size, sizeof *new_dir->chunks[i]);
+		if (new_dir->chunks[i] == NULL) {
+			while (i > dir->n_chunks) {
+				free(new_dir->chunks[--i]);
+			}
+			free(new_dir);
+			return out_of_memory;
 		}
 	}
+	new_dir->n_chunks = new_n_chunks;
+
+	__atomic_store_n(&sh->dir, new_dir, __ATOMIC_SEQ_CST);
+	reclaimer_retire(store->rec, &dir->r, &free_retired);
 
 	return ok;
 }
-		
+
+/* a value of an update, by the shard it goes to */
+typedef struct {
+	int shard_idx;
+	int i; /* in src, then in the slot values */
+} update_item;
+
+/* by shard, and in the order they were given within one */
+static int compare_update_items(const void *a, const void *b)
+{
+	const update_item *item_a = a;
+	const update_item *item_b = b;
+
+	if (item_a->shard_idx != item_b->shard_idx) {
+		return item_a->shard_idx < item_b->shard_idx ? -1 : 1;
+	}
+	return item_a->i < item_b->i ? -1 : item_a->i > item_b->i;
+}
+
+/* whether items[i] is the first of its shard's, once they are sorted */
+static int first_of_shard(const update_item *items, int i)
+{
+	return i == 0 || items[i].shard_idx != items[i - 1].shard_idx;
+}
+
+/*
+ * Makes the new entries of the n_changes changes to the shards of
+ * items, in one batch, in the order of the shards and their changes;
+ * they are numbered later.
+ */
+static return_code create_entries(data_store *store,
+	const update_item *items, int n_items, int n_changes,
+	batch **result)
+{
+	batch *b;
+	int size = sizeof *b + sizeof *b->entries * n_changes;
+
+	int i;
+	for (i = 0; i != n_items; ++i) {
+		if (first_of_shard(items, i)) {
+			shard *sh = &store->shards[items[i].shard_idx];
+			int j;
+			for (j = 0; j != sh->n_changes; ++j) {
+				const typed_value *value = map_get_typed_value(
+					sh->data, sh->changes[j]);
+				if (value->type == string_value) {
+					size += strlen(value->u.string) + 1;
+				}
+			}
+		}
+	}
+
+	b = malloc(size);
+	if (b == NULL) {
+		return out_of_memory;
+	}
+	b->n_refs = n_changes + 1;
+	b->n_entries = n_changes;
+
+	entry *e = b->entries;
+	char *string = (char *) (b->entries + n_changes);
+	for (i = 0; i != n_items; ++i) {
+		if (! first_of_shard(items, i)) {
+			continue;
+		}
+		shard *sh = &store->shards[items[i].shard_idx];
+		int j;
+		for (j = 0; j != sh->n_changes; ++j) {
+			int idx = sh->changes[j];
+			e->b = b;
+			e->key = map_get_key(sh->data, idx);
+			e->version = 0;
+			e->prev = NULL;
+			e->value = *map_get_typed_value(sh->data, idx);
+			if (e->value.type == string_value) {
+				int length = strlen(e->value.u.string) + 1;
+				memcpy(string, e->value.u.string, length);
+				e->value.u.string = string;
+				string += length;
+			}
+			++e;
+		}
+	}
+
+	*result = b;
+	return ok;
+}
+
+/*
+ * Puts the changes to the shards of items since the last call in place
+ * for readers, and sets *result to their batch, or NULL if there were
+ * none; their locks must be held for writing. Each changed key gets a
+ * new entry with the next change sequence number. Readers skip them
+ * until finish_publishing() has advanced change_seq past them. On
+ * failure, the changes stay pending for the next call.
+ */
+static return_code publish_changes(data_store *store,
+	const update_item *items, int n_items, batch **result)
+{
+	*result = NULL;
+
+	int n_changes = 0;
+	int i;
+	for (i = 0; i != n_items; ++i) {
+		if (first_of_shard(items, i)) {
+			shard *sh = &store->shards[items[i].shard_idx];
+			return_code rc = reserve_directory(store, sh,
+				map_get_n_keys(sh->data));
+			if (rc != ok) {
+				return rc;
+			}
+			n_changes += sh->n_changes;
+		}
+	}
+
+	if (n_changes == 0) {
+		return ok;
+	}
+
+	batch *b;
+	return_code rc = create_entries(store, items, n_items, n_changes, &b);
+	if (rc != ok) {
+		return rc;
+	}
+
+	unsigned long base = __atomic_fetch_add(&store->next_seq,
+		n_changes, __ATOMIC_RELAXED);
+
+	entry *e = b->entries;
+	for (i = 0; i != n_items; ++i) {
+		if (! first_of_shard(items, i)) {
+			continue;
+		}
+		shard *sh = &store->shards[items[i].shard_idx];
+		directory *dir = sh->dir;
+		int j;
+		for (j = 0; j != sh->n_changes; ++j) {
+			int idx = sh->changes[j];
+			entry **slot = directory_slot(dir, idx);
+			e->version = base + 1 + (e - b->entries);
+			e->prev = *slot;
+			__atomic_store_n(slot, e, __ATOMIC_RELEASE);
+			sh->pending[idx] = 0;
+			++e;
+		}
+		sh->n_changes = 0;
+
+		/* after the entries of its new keys */
+		__atomic_store_n(&sh->n_keys, map_get_n_keys(sh->data),
+			__ATOMIC_RELEASE);
+	}
+
+	*result = b;
+	return ok;
+}
+
+/*
+ * Makes b visible to readers that start later, and retires the entries
+ * it replaces; call it without shard locks. Writers that replace its
+ * entries in the meantime have higher numbers, so they wait for this.
+ */
+static void finish_publishing(data_store *store, batch *b)
+{
+	unsigned long base = b->entries[0].version - 1;
+
+	/* the writers with lower numbers are finishing too */
+	while (__atomic_load_n(&store->change_seq, __ATOMIC_ACQUIRE) != base) {
+		sched_yield();
+	}
+	__atomic_store_n(&store->change_seq, base + b->n_entries,
+		__ATOMIC_SEQ_CST);
+
+	int i;
+	for (i = 0; i != b->n_entries; ++i) {
+		entry *old = b->entries[i].prev;
+		if (old != NULL) {
+			reclaimer_retire(store->rec, &old->r, &free_entry);
+		}
+	}
+	release_batch(b);
+
+	reclaimer_collect(store->rec);
+}
+
+/* sets *changed to 0 if the key at idx already had value */
+static return_code set_index_value(data_store *store, shard *sh,
+	int idx, const typed_value *value, int *changed)
+{
+	assert(idx >= 0 && idx < map_get_n_keys(sh->data));
+
+	*changed = 0;
+	if (typed_value_equal(map_get_typed_value(sh->data, idx), value)) {
+		++sh->n_unchanged_values;
+		return ok;
+	}
+
+	return_code rc = reserve_change(sh, idx);
+	if (rc != ok) {
+		return rc;
+	}
+
+	rc = map_set_index_value(sh->data, idx, value);
+	if (rc != ok) {
+		return rc;
+	}
+	*changed = 1;
+
+	record_change(sh, idx);
+
+	return ok;
+}
+
+/* sets *changed to 0 if the key already had value */
+static return_code set_value(data_store *store, shard *sh,
+	const char *key, const typed_value *value, int *changed)
+{
+	int idx = map_find_index(sh->data, key);
+	if (idx != -1) {
+		return set_index_value(store, sh, idx, value, changed);
+	}
+	*changed = 0;
+
+	/* a new key goes last */
+	idx = map_get_n_keys(sh->data);
+	return_code rc = reserve_change(sh, idx);
+	if (rc != ok) {
+		return rc;
+	}
+
+	rc = map_set_typed_value(sh->data, key, value);
+	if (rc != ok) {
+		return rc;
+	}
+	*changed = 1;
+
+	record_change(sh, idx);
+
+	return ok;
+}
+
+return_code data_store_update(data_store *store, const map *src)
+{
+	return data_store_update_slots(store, src, NULL, 0);
+}
+
+return_code data_store_update_slots(data_store *store, const map *src,
+	const slot_value *values, int n_values)
+{
+	int n_src_keys = src == NULL ? 0 : map_get_n_keys(src);
+	int n_items = n_src_keys + n_values;
+	if (n_items == 0) {
+		return ok;
+	}
+
+	/* most updates are small */
+	update_item local_items[32];
+	update_item *items = n_items <= 32 ? local_items :
+		malloc(sizeof *items * n_items);
+	if (items == NULL) {
+		return out_of_memory;
+	}
+
+	int i;
+	for (i = 0; i != n_items; ++i) {
+		items[i].shard_idx = i < n_src_keys ?
+			shard_of(store, map_get_key(src, i)) :
+			values[i - n_src_keys].slot % store->n_shards;
+		items[i].i = i;
+	}
+	if (store->n_shards != 1) {
+		qsort(items, n_items, sizeof *items, &compare_update_items);
+	}
+
+	return_code rc = ok;
+	int n_changed = 0;
+	for (i = 0; rc == ok && i != n_items; ++i) {
+
+		shard *sh = &store->shards[items[i].shard_idx];
+		if (first_of_shard(items, i)) {
+			pthread_rwlock_wrlock(&sh->lock);
+		}
+
+		int j = items[i].i;
+		int changed;
+		rc = j < n_src_keys ?
+			set_value(store, sh, map_get_key(src, j),
+				map_get_typed_value(src, j), &changed) :
+			set_index_value(store, sh,
+				values[j - n_src_keys].slot / store->n_shards,
+				&values[j - n_src_keys].value, &changed);
+		n_changed += changed;
+	}
+
+	/* what changed before a failure is published all the same */
+	int n_locked_items = i;
+	batch *published;
+	return_code publish_rc = publish_changes(store, items, n_locked_items,
+		&published);
+	if (rc == ok) {
+		rc = publish_rc;
+	}
+
+	for (i = 0; i != n_locked_items; ++i) {
+		if (first_of_shard(items, i)) {
+			pthread_rwlock_unlock(
+				&store->shards[items[i].shard_idx].lock);
+		}
+	}
+
+	if (published != NULL) {
+		finish_publishing(store, published);
+	}
+
+	if (items != local_items) {
+		free(items);
+	}
+
+	if (n_changed != 0) {
+		wake_listeners(store);
+	}
+
+	return rc;
+}
+
+return_code data_store_subscribe(data_store *store,
+	dispatcher *disp, data_session *sess)
+{
+	int i;
+	for (i = 0; i != store->n_listeners; ++i) {
+		if (store->listeners[i].disp == disp) {
+			break;
+		}
+	}
+
+	assert(i != store->n_listeners);
+	listener *lst = &store->listeners[i];
+
+	return_code rc = ok;
+
+	pthread_mutex_lock(&store->sessions_lock);
+
+	if (lst->n_subscribers == lst->n_subscribers_alloc) {
+
+		int new_alloc = lst->n_subscribers_alloc +
+			lst->n_subscribers_alloc / 2 + 1;
+		data_session **new_subscribers = lst->subscribers == NULL ?
+			malloc(sizeof *new_subscribers * new_alloc) :
+			realloc(lst->subscribers,
+				sizeof *new_subscribers * new_alloc);
+
+		if (new_subscribers == NULL) {
+			rc = out_of_memory;
+		} else {
+			lst->n_subscribers_alloc = new_alloc;
+			lst->subscribers = new_subscribers;
+		}
+	}
+
+	if (rc == ok) {
+		lst->subscribers[lst->n_subscribers] = sess;
+		++lst->n_subscribers;
+		__atomic_add_fetch(&store->n_subscribers, 1, __ATOMIC_SEQ_CST);
+	}
+
+	pthread_mutex_unlock(&store->sessions_lock);
+
+	return rc;
+}
+
 void data_store_stop_session(data_store *store, data_session *sess)
 {
+	pthread_mutex_lock(&store->sessions_lock);
+
 	int i;
 	for (i = 0; i != store->n_sessions; ++i) {
 		if (store->sessions[i] == sess) {
@@ -146,27 +1280,79 @@ void data_store_stop_session(data_store *store, data_session *sess)
 	}
 
 	assert(i != store->n_sessions);
-	data_session_destroy(sess);
 
 	--store->n_sessions;
 	for (; i != store->n_sessions; ++i) {
 		store->sessions[i] = store->sessions[i + 1];
 	}
+
+	remove_subscriber(store, sess);
+
+	pthread_mutex_unlock(&store->sessions_lock);
+
+	data_session_destroy(sess);
+}
+
+int data_store_n_sessions(data_store *store)
+{
+	pthread_mutex_lock(&store->sessions_lock);
+	int result = store->n_sessions;
+	pthread_mutex_unlock(&store->sessions_lock);
+
+	return result;
+}
+
+int data_store_n_subscribers(data_store *store)
+{
+	return __atomic_load_n(&store->n_subscribers, __ATOMIC_RELAXED);
+}
+
+void data_store_record_throttle(data_store *store)
+{
+	pthread_mutex_lock(&store->sessions_lock);
+	++store->n_throttled_sessions;
+	pthread_mutex_unlock(&store->sessions_lock);
+}
+
+void data_store_record_eviction(data_store *store)
+{
+	pthread_mutex_lock(&store->sessions_lock);
+	++store->n_evicted_sessions;
+	pthread_mutex_unlock(&store->sessions_lock);
+}
+
+unsigned long data_store_n_throttled_sessions(data_store *store)
+{
+	pthread_mutex_lock(&store->sessions_lock);
+	unsigned long result = store->n_throttled_sessions;
+	pthread_mutex_unlock(&store->sessions_lock);
+
+	return result;
 }
-		
+
+unsigned long data_store_n_evicted_sessions(data_store *store)
+{
+	pthread_mutex_lock(&store->sessions_lock);
+	unsigned long result = store->n_evicted_sessions;
+	pthread_mutex_unlock(&store->sessions_lock);
+
+	return result;
+}
+
 void data_store_destroy(data_store *store)
 {
-	lprintf(info, "closing data store at %s port %d\n",
-		acceptor_ip(store->acc), acceptor_port(store->acc));
+	lprintf(info, "closing data store at %s port %d "
+		"(%lu unchanged values skipped, "
+		"%lu sessions throttled, %lu evicted)\n",
+		data_store_ip(store), data_store_port(store),
+		data_store_n_unchanged_values(store), store->n_throttled_sessions,
+		store->n_evicted_sessions);
 
 	int i;
 	for (i = 0; i != store->n_sessions; ++i) {
 		data_session_destroy(store->sessions[i]);
 	}
-	free(store->sessions);	
+	free(store->sessions);
 
-	map_destroy(store->data);
-	dispatcher_destroy_io_slot(store->disp, store->acc_slot);
-	acceptor_destroy(store->acc);
-	free(store);
+	data_store_dispose(store);
 }
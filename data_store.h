@@ -8,16 +8,141 @@
 typedef struct data_store data_store;
 typedef struct data_session data_session;
 
+enum {
+	default_high_watermark = 65536,
+	default_low_watermark = 16384,
+	default_stall_timeout = 30000,
+	default_max_receive_size = 65536,
+	default_receive_budget = 262144
+};
+
+/* bounds on a session's unsent output */
+typedef struct {
+	int high_watermark; /* bytes; stops reading input above this */
+	int low_watermark; /* bytes; resumes reading at or below this */
+	unsigned int stall_timeout; /* msecs without progress; 0: never */
+	int max_receive_size; /* bytes; the receive buffer grows up to this */
+	int receive_budget; /* bytes received per input event, at least */
+} session_limits;
+
 return_code data_store_create(data_store **result,
 	dispatcher *disp, const char *ip_address, int port);
 
+/*
+ * Accepts sessions on each of n_disps dispatchers, which may be run
+ * by different threads.
+ */
+return_code data_store_create_multi(data_store **result,
+	dispatcher **disps, int n_disps, const char *ip_address, int port);
+
+/* for sessions accepted later; set before running the dispatchers */
+void data_store_set_session_limits(data_store *store,
+	const session_limits *limits);
+
 const char *data_store_ip(const data_store *store);
 int data_store_port(const data_store *store);
 
-const map *data_store_data(const data_store *store);
+/*
+ * The data is split into shards by key, each with its own lock for
+ * writers; 1 by default. Only set before anything is stored.
+ */
+return_code data_store_set_n_shards(data_store *store, int n_shards);
+int data_store_n_shards(const data_store *store);
+
+/*
+ * A read sees the data as of a version, the same in all shards,
+ * without waiting for updates. What it finds stays valid until it
+ * ends; nothing replaced during a read is freed before, so keep reads
+ * short.
+ */
+typedef struct {
+	unsigned long version; /* the store's change_seq at the start */
+	unsigned long epoch;
+} data_read;
+
+void data_store_begin_read(data_store *store, data_read *read);
+
+/* also frees what the read held up, unless other reads still do */
+void data_store_end_read(data_store *store, const data_read *read);
+
+/* during a read: the keys in a shard, some maybe newer than the read */
+int data_store_n_keys(data_store *store, int shard_idx);
+
+/*
+ * Returns the key at idx in a shard, and sets *value and *version (its
+ * change sequence number) as of the read's version; returns NULL if
+ * the key didn't exist yet. Keys live as long as the store; values as
+ * long as the read.
+ */
+const char *data_store_read_key(data_store *store, const data_read *read,
+	int shard_idx, int idx, const typed_value **value,
+	unsigned long *version);
+
+/*
+ * Values equal to the stored ones are skipped: they are no change.
+ * Reads see an update whole or not at all, over all shards.
+ */
 return_code data_store_update(data_store *store, const map *src);
 
+/*
+ * A key's slot is its shard and its index in the shard, which never
+ * change once the key exists; returns -1 if key doesn't exist yet.
+ */
+int data_store_find_slot(data_store *store, const char *key);
+
+typedef struct {
+	int slot;
+	typed_value value;
+} slot_value;
+
+/*
+ * Like data_store_update(), but values are also set by slot, without
+ * looking their keys up, after the ones in src, which may be NULL.
+ */
+return_code data_store_update_slots(data_store *store, const map *src,
+	const slot_value *values, int n_values);
+
+/*
+ * Provides a status message with all keys, which is only rebuilt
+ * after the data changed; until then, all callers share it. The data
+ * stays valid until the handle is passed to data_store_release_status().
+ */
+return_code data_store_acquire_status(data_store *store,
+	const char **data, int *size, void **handle);
+void data_store_release_status(void *handle);
+
+/* the number of values skipped by data_store_update() */
+unsigned long data_store_n_unchanged_values(data_store *store);
+
+/* replaced data that waits for reads to end before it is freed */
+int data_store_n_retired(data_store *store);
+
+/*
+ * Every change to a key gets a sequence number higher than all
+ * before it, which serves as the store's version after the change
+ * and as the key's version. Reads begun after reading the store's
+ * version have all changes up to it.
+ */
+unsigned long data_store_change_seq(data_store *store);
+
+/*
+ * After an update, calls data_session_notify() for sess from disp,
+ * which must be sess's dispatcher. Updates that happen before disp
+ * gets around to it share a single notification. The session is
+ * unsubscribed when it stops.
+ */
+return_code data_store_subscribe(data_store *store,
+	dispatcher *disp, data_session *sess);
+
 void data_store_stop_session(data_store *store, data_session *sess);
+int data_store_n_sessions(data_store *store);
+int data_store_n_subscribers(data_store *store);
+
+/* sessions count themselves when first throttled, and when evicted */
+void data_store_record_throttle(data_store *store);
+void data_store_record_eviction(data_store *store);
+unsigned long data_store_n_throttled_sessions(data_store *store);
+unsigned long data_store_n_evicted_sessions(data_store *store);
 
 void data_store_destroy(data_store *store);
 
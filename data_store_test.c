@@ -0,0 +1,1114 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "connection.h"
+#include "data_store.h"
+#include "dispatcher.h"
+#include "message_buffer.h"
+
+#undef NDEBUG
+#include <assert.h>
+
+static void send_all(connection *conn, const char *data, int size)
+{
+	while (size != 0) {
+		int sent = 0;
+		return_code rc = connection_send_blocking(conn,
+			&sent, data, size);
+		assert(rc == ok);
+		assert(sent != 0);
+		data += sent;
+		size -= sent;
+	}
+}
+
+static void send_text(connection *conn, const char *text)
+{
+	send_all(conn, text, strlen(text));
+}
+
+/* receives into buf until it holds terminator; returns the length */
+static int receive_until(connection *conn, char *buf, int bufsize,
+	const char *terminator)
+{
+	int length = 0;
+	buf[0] = '\0';
+
+	while (strstr(buf, terminator) == NULL) {
+		int received = 0;
+		return_code rc = connection_receive_blocking(conn,
+			&received, buf + length, bufsize - 1 - length);
+		assert(rc == ok);
+		assert(received != 0);
+		length += received;
+		buf[length] = '\0';
+	}
+
+	return length;
+}
+
+/* receives what has arrived so far; returns the length */
+static int receive_available(connection *conn, char *buf, int bufsize)
+{
+	int length = 0;
+	return_code rc;
+	do {
+		int received = 0;
+		rc = connection_receive_nonblocking(conn,
+			&received, buf + length, bufsize - 1 - length);
+		assert(rc == ok || rc == would_block);
+		length += received;
+	} while (rc == ok && length != bufsize - 1);
+	buf[length] = '\0';
+
+	return length;
+}
+
+static int count(const char *text, const char *pattern)
+{
+	int n = 0;
+	const char *p;
+	for (p = strstr(text, pattern); p != NULL;
+		p = strstr(p + 1, pattern)) {
+		++n;
+	}
+
+	return n;
+}
+
+static void update_value(data_store *store,
+	const char *key, const char *value)
+{
+	map *src;
+	return_code rc = map_create(&src);
+	assert(rc == ok);
+	rc = map_set_value(src, key, value);
+	assert(rc == ok);
+
+	rc = data_store_update(store, src);
+	assert(rc == ok);
+	map_destroy(src);
+}
+
+static return_code on_stop_alarm(void *user_data)
+{
+	dispatcher_stop(user_data);
+	return ok;
+}
+
+/* runs disp on this thread for a while */
+static void run_for(dispatcher *disp, unsigned int msecs)
+{
+	alarm_slot *alarm;
+	return_code rc = dispatcher_create_alarm_slot(disp, &alarm);
+	assert(rc == ok);
+
+	dispatcher_activate_alarm_slot(disp, alarm, msecs,
+		&on_stop_alarm, disp);
+	rc = dispatcher_run(disp);
+	assert(rc == ok);
+
+	dispatcher_destroy_alarm_slot(disp, alarm);
+}
+
+/* runs a dispatcher on its own thread until stop_worker() */
+typedef struct {
+	dispatcher *disp;
+	int stop_fds[2]; /* read end, write end */
+	io_slot *stop_slot;
+	pthread_t thread;
+	return_code rc;
+} worker;
+
+static return_code on_stop(void *user_data)
+{
+	worker *w = user_data;
+	dispatcher_stop(w->disp);
+	return ok;
+}
+
+static void *run_worker(void *arg)
+{
+	worker *w = arg;
+	w->rc = dispatcher_run(w->disp);
+	return NULL;
+}
+
+static void create_worker(worker *w)
+{
+	return_code rc = dispatcher_create(&w->disp);
+	assert(rc == ok);
+
+	int r = pipe(w->stop_fds);
+	assert(r == 0);
+
+	rc = dispatcher_create_io_slot(w->disp, &w->stop_slot);
+	assert(rc == ok);
+	dispatcher_activate_io_slot(w->disp, w->stop_slot,
+		w->stop_fds[0], input, &on_stop, w);
+}
+
+static void start_worker(worker *w)
+{
+	int r = pthread_create(&w->thread, NULL, &run_worker, w);
+	assert(r == 0);
+}
+
+static void stop_worker(worker *w)
+{
+	char c = 0;
+	ssize_t r = write(w->stop_fds[1], &c, sizeof c);
+	assert(r == sizeof c);
+
+	pthread_join(w->thread, NULL);
+	assert(w->rc == ok);
+}
+
+static void destroy_worker(worker *w)
+{
+	dispatcher_destroy_io_slot(w->disp, w->stop_slot);
+	close(w->stop_fds[1]);
+	close(w->stop_fds[0]);
+	dispatcher_destroy(w->disp);
+}
+
+/* sessions on different dispatcher threads share the data */
+static void threads_test()
+{
+	enum { n_workers = 2, n_clients = 8, bufsize = 4096 };
+
+	worker workers[n_workers];
+	dispatcher *disps[n_workers];
+	int i;
+	for (i = 0; i != n_workers; ++i) {
+		create_worker(&workers[i]);
+		disps[i] = workers[i].disp;
+	}
+
+	data_store *store;
+	return_code rc = data_store_create_multi(&store,
+		disps, n_workers, "127.0.0.1", 0);
+	assert(rc == ok);
+
+	for (i = 0; i != n_workers; ++i) {
+		start_worker(&workers[i]);
+	}
+
+	/* the kernel spreads them over the listeners */
+	connection *clients[n_clients];
+	for (i = 0; i != n_clients; ++i) {
+		rc = connection_create(&clients[i],
+			"127.0.0.1", data_store_port(store));
+		assert(rc == ok);
+	}
+
+	/* once the retrieve is answered, the update is done */
+	char buf[bufsize];
+	send_text(clients[0],
+		"<update><temp>21</temp></update><retrieve></retrieve>");
+	receive_until(clients[0], buf, bufsize, "</status>");
+	assert(strstr(buf, "<temp>21</temp>") != NULL);
+
+	for (i = 1; i != n_clients; ++i) {
+		send_text(clients[i], "<retrieve></retrieve>");
+		receive_until(clients[i], buf, bufsize, "</status>");
+		assert(strstr(buf, "<temp>21</temp>") != NULL);
+	}
+
+	for (i = 0; i != n_clients; ++i) {
+		connection_destroy(clients[i]);
+	}
+
+	for (i = 0; i != n_workers; ++i) {
+		stop_worker(&workers[i]);
+	}
+
+	data_store_destroy(store);
+
+	for (i = 0; i != n_workers; ++i) {
+		destroy_worker(&workers[i]);
+	}
+}
+
+/* updates before the dispatcher gets around to it share a status */
+static void subscribe_test()
+{
+	enum { bufsize = 4096 };
+
+	dispatcher *disp;
+	return_code rc = dispatcher_create(&disp);
+	assert(rc == ok);
+
+	data_store *store;
+	rc = data_store_create(&store, disp, "127.0.0.1", 0);
+	assert(rc == ok);
+
+	/* nobody to wake */
+	update_value(store, "w", "0");
+
+	connection *client;
+	rc = connection_create(&client, "127.0.0.1", data_store_port(store));
+	assert(rc == ok);
+	send_text(client, "<subscribe></subscribe>");
+
+	char buf[bufsize];
+	run_for(disp, 100);
+	receive_until(client, buf, bufsize, "</status>");
+	assert(strstr(buf, "<w>0</w>") != NULL);
+	assert(data_store_n_subscribers(store) == 1);
+
+	update_value(store, "x", "1");
+	update_value(store, "y", "2");
+
+	run_for(disp, 100);
+	receive_available(client, buf, bufsize);
+	assert(count(buf, "<status>") == 1);
+	assert(strstr(buf, "<x>1</x>") != NULL);
+	assert(strstr(buf, "<y>2</y>") != NULL);
+	assert(strstr(buf, "<w>") == NULL);
+
+	/* nothing changed, so nothing is sent */
+	update_value(store, "y", "2");
+	run_for(disp, 100);
+	assert(receive_available(client, buf, bufsize) == 0);
+
+	/* a session is unsubscribed when it stops */
+	connection_destroy(client);
+	run_for(disp, 100);
+	assert(data_store_n_sessions(store) == 0);
+	assert(data_store_n_subscribers(store) == 0);
+
+	update_value(store, "z", "3");
+
+	data_store_destroy(store);
+	dispatcher_destroy(disp);
+}
+
+/* sends a retrieve and receives its status and version */
+static void retrieve_since(connection *client, dispatcher *disp,
+	const char *request, char *buf, int bufsize)
+{
+	send_text(client, request);
+	run_for(disp, 50);
+	receive_until(client, buf, bufsize, "</version>");
+	assert(count(buf, "<status>") == 1);
+}
+
+/* a retrieve since a version only gets the keys changed after it */
+static void since_test()
+{
+	enum { bufsize = 4096 };
+
+	dispatcher *disp;
+	return_code rc = dispatcher_create(&disp);
+	assert(rc == ok);
+
+	data_store *store;
+	rc = data_store_create(&store, disp, "127.0.0.1", 0);
+	assert(rc == ok);
+	assert(data_store_change_seq(store) == 0);
+
+	update_value(store, "a", "1");
+	update_value(store, "b", "2");
+	assert(data_store_change_seq(store) == 2);
+
+	connection *client;
+	rc = connection_create(&client, "127.0.0.1", data_store_port(store));
+	assert(rc == ok);
+
+	char buf[bufsize];
+	retrieve_since(client, disp,
+		"<retrieve><since>0</since></retrieve>", buf, bufsize);
+	assert(strstr(buf, "<a>1</a>") != NULL);
+	assert(strstr(buf, "<b>2</b>") != NULL);
+	assert(strstr(buf, "<value>2</value>") != NULL);
+
+	update_value(store, "a", "3");
+
+	retrieve_since(client, disp,
+		"<retrieve><since>2</since></retrieve>", buf, bufsize);
+	assert(strstr(buf, "<a>3</a>") != NULL);
+	assert(strstr(buf, "<b>") == NULL);
+	assert(strstr(buf, "<value>3</value>") != NULL);
+
+	/* only the requested keys */
+	retrieve_since(client, disp,
+		"<retrieve><key>b</key><since>1</since></retrieve>", buf, bufsize);
+	assert(strstr(buf, "<a>") == NULL);
+	assert(strstr(buf, "<b>2</b>") != NULL);
+	assert(strstr(buf, "<value>3</value>") != NULL);
+
+	/* up to date */
+	retrieve_since(client, disp,
+		"<retrieve><since>3</since></retrieve>", buf, bufsize);
+	assert(strstr(buf, "<a>") == NULL);
+	assert(strstr(buf, "<b>") == NULL);
+	assert(strstr(buf, "<value>3</value>") != NULL);
+
+	connection_destroy(client);
+	data_store_destroy(store);
+	dispatcher_destroy(disp);
+}
+
+/* values that are already stored are no changes */
+static void unchanged_test()
+{
+	dispatcher *disp;
+	return_code rc = dispatcher_create(&disp);
+	assert(rc == ok);
+
+	data_store *store;
+	rc = data_store_create(&store, disp, "127.0.0.1", 0);
+	assert(rc == ok);
+
+	map *src;
+	rc = map_create(&src);
+	assert(rc == ok);
+	rc = map_set_value(src, "a", "1");
+	assert(rc == ok);
+	rc = map_set_value(src, "b", "2");
+	assert(rc == ok);
+
+	rc = data_store_update(store, src);
+	assert(rc == ok);
+	assert(data_store_change_seq(store) == 2);
+	assert(data_store_n_unchanged_values(store) == 0);
+
+	rc = data_store_update(store, src);
+	assert(rc == ok);
+	assert(data_store_change_seq(store) == 2);
+	assert(data_store_n_unchanged_values(store) == 2);
+
+	/* only b changes */
+	rc = map_set_value(src, "b", "3");
+	assert(rc == ok);
+	rc = data_store_update(store, src);
+	assert(rc == ok);
+	assert(data_store_change_seq(store) == 3);
+	assert(data_store_n_unchanged_values(store) == 3);
+
+	/* the same, by slot */
+	slot_value value;
+	value.slot = data_store_find_slot(store, "a");
+	assert(value.slot != -1);
+	value.value.type = string_value;
+	value.value.u.string = "1";
+	rc = data_store_update_slots(store, NULL, &value, 1);
+	assert(rc == ok);
+	assert(data_store_change_seq(store) == 3);
+	assert(data_store_n_unchanged_values(store) == 4);
+
+	map_destroy(src);
+	data_store_destroy(store);
+	dispatcher_destroy(disp);
+}
+
+/* the status is shared until the data changes, and outlives that */
+static void cached_status_test()
+{
+	dispatcher *disp;
+	return_code rc = dispatcher_create(&disp);
+	assert(rc == ok);
+
+	data_store *store;
+	rc = data_store_create(&store, disp, "127.0.0.1", 0);
+	assert(rc == ok);
+
+	update_value(store, "a", "1");
+
+	const char *old_data;
+	int old_size;
+	void *old_handle;
+	rc = data_store_acquire_status(store,
+		&old_data, &old_size, &old_handle);
+	assert(rc == ok);
+
+	char copy[256];
+	assert(old_size < sizeof copy);
+	memcpy(copy, old_data, old_size);
+
+	/* unchanged: the same one */
+	const char *data;
+	int size;
+	void *handle;
+	rc = data_store_acquire_status(store, &data, &size, &handle);
+	assert(rc == ok);
+	assert(handle == old_handle);
+	assert(data == old_data);
+	data_store_release_status(handle);
+
+	update_value(store, "a", "2");
+
+	rc = data_store_acquire_status(store, &data, &size, &handle);
+	assert(rc == ok);
+	assert(handle != old_handle);
+	char text[256];
+	assert(size < sizeof text);
+	memcpy(text, data, size);
+	text[size] = '\0';
+	assert(strstr(text, "<a>2</a>") != NULL);
+
+	/* the old one still holds what it did */
+	assert(memcmp(old_data, copy, old_size) == 0);
+	data_store_release_status(old_handle);
+
+	data_store_release_status(handle);
+	data_store_destroy(store);
+	dispatcher_destroy(disp);
+}
+
+/* sessions with much unsent output stop reading, or get evicted */
+static void throttle_test()
+{
+	enum { value_size = 16384, n_retrieves = 2000, bufsize = 65536 };
+
+	static const session_limits limits = {
+		4096, /* high_watermark */
+		1024, /* low_watermark */
+		300, /* stall_timeout */
+		default_max_receive_size,
+		default_receive_budget
+	};
+
+	static char value[value_size + 1];
+	memset(value, 'x', value_size);
+
+	char request[] = "<retrieve></retrieve>";
+	static char requests[n_retrieves * (sizeof request - 1) + 1];
+	int i;
+	for (i = 0; i != n_retrieves; ++i) {
+		strcpy(requests + i * (sizeof request - 1), request);
+	}
+
+	/* a client that never reads stalls its session */
+	dispatcher *disp;
+	return_code rc = dispatcher_create(&disp);
+	assert(rc == ok);
+
+	data_store *store;
+	rc = data_store_create(&store, disp, "127.0.0.1", 0);
+	assert(rc == ok);
+	data_store_set_session_limits(store, &limits);
+	update_value(store, "v", value);
+
+	connection *client;
+	rc = connection_create(&client, "127.0.0.1", data_store_port(store));
+	assert(rc == ok);
+	send_text(client, requests);
+
+	run_for(disp, 200);
+	assert(data_store_n_throttled_sessions(store) == 1);
+	assert(data_store_n_evicted_sessions(store) == 0);
+	assert(data_store_n_sessions(store) == 1);
+
+	run_for(disp, 1000);
+	assert(data_store_n_evicted_sessions(store) == 1);
+	assert(data_store_n_sessions(store) == 0);
+
+	connection_destroy(client);
+	data_store_destroy(store);
+
+	/* one that reads gets all its statuses, though it was throttled */
+	worker w;
+	create_worker(&w);
+
+	rc = data_store_create_multi(&store, &w.disp, 1, "127.0.0.1", 0);
+	assert(rc == ok);
+	data_store_set_session_limits(store, &limits);
+	update_value(store, "v", value);
+
+	const char *data;
+	int status_size;
+	void *handle;
+	rc = data_store_acquire_status(store, &data, &status_size, &handle);
+	assert(rc == ok);
+	data_store_release_status(handle);
+
+	start_worker(&w);
+
+	rc = connection_create(&client, "127.0.0.1", data_store_port(store));
+	assert(rc == ok);
+	send_text(client, requests);
+
+	static char buf[bufsize];
+	long long expected = (long long) n_retrieves * status_size;
+	long long total = 0;
+	while (total != expected) {
+		int received = 0;
+		rc = connection_receive_blocking(client,
+			&received, buf, sizeof buf);
+		assert(rc == ok);
+		assert(received != 0);
+		total += received;
+		assert(total <= expected);
+	}
+
+	connection_destroy(client);
+	stop_worker(&w);
+
+	assert(data_store_n_throttled_sessions(store) == 1);
+	assert(data_store_n_evicted_sessions(store) == 0);
+
+	data_store_destroy(store);
+	destroy_worker(&w);
+	dispatcher_destroy(disp);
+}
+
+/* whether the store's status holds element */
+static int has(data_store *store, const char *element)
+{
+	const char *data;
+	int size;
+	void *handle;
+	return_code rc = data_store_acquire_status(store,
+		&data, &size, &handle);
+	assert(rc == ok);
+
+	char text[4096];
+	assert(size < sizeof text);
+	memcpy(text, data, size);
+	text[size] = '\0';
+	data_store_release_status(handle);
+
+	return strstr(text, element) != NULL;
+}
+
+static void send_buffer(connection *conn, message_buffer *buf)
+{
+	send_all(conn, message_buffer_data(buf), message_buffer_size(buf));
+	message_buffer_discard(buf, message_buffer_size(buf));
+}
+
+/* keys in binary retrieves and subscribes are numbered as well */
+static void binary_test()
+{
+	enum { bufsize = 4096 };
+
+	dispatcher *disp;
+	return_code rc = dispatcher_create(&disp);
+	assert(rc == ok);
+
+	data_store *store;
+	rc = data_store_create(&store, disp, "127.0.0.1", 0);
+	assert(rc == ok);
+
+	connection *client;
+	rc = connection_create(&client, "127.0.0.1", data_store_port(store));
+	assert(rc == ok);
+
+	message_buffer *buf;
+	rc = message_buffer_create(&buf);
+	assert(rc == ok);
+	message_buffer_set_binary(buf);
+	rc = message_buffer_add_binary_magic(buf);
+	assert(rc == ok);
+
+	/* since and key get the first numbers */
+	rc = message_buffer_add_begin_message(buf, "retrieve");
+	assert(rc == ok);
+	rc = message_buffer_add_string_value(buf, "since", "0");
+	assert(rc == ok);
+	rc = message_buffer_add_string_value(buf, "key", "a");
+	assert(rc == ok);
+	rc = message_buffer_add_end_message(buf, "retrieve");
+	assert(rc == ok);
+
+	rc = message_buffer_add_begin_message(buf, "subscribe");
+	assert(rc == ok);
+	rc = message_buffer_add_string_value(buf, "key", "x");
+	assert(rc == ok);
+	rc = message_buffer_add_end_message(buf, "subscribe");
+	assert(rc == ok);
+
+	rc = message_buffer_add_begin_message(buf, "update");
+	assert(rc == ok);
+	rc = message_buffer_add_string_value(buf, "x", "1");
+	assert(rc == ok);
+	rc = message_buffer_add_string_value(buf, "y", "2");
+	assert(rc == ok);
+	rc = message_buffer_add_end_message(buf, "update");
+	assert(rc == ok);
+
+	send_buffer(client, buf);
+	run_for(disp, 100);
+	assert(has(store, "<x>1</x>"));
+	assert(has(store, "<y>2</y>"));
+	assert(data_store_n_sessions(store) == 1);
+
+	char received[bufsize];
+	assert(receive_available(client, received, bufsize) != 0);
+
+	/* x and y by number now, after another retrieve */
+	rc = message_buffer_add_begin_message(buf, "retrieve");
+	assert(rc == ok);
+	rc = message_buffer_add_string_value(buf, "key", "y");
+	assert(rc == ok);
+	rc = message_buffer_add_end_message(buf, "retrieve");
+	assert(rc == ok);
+
+	rc = message_buffer_add_begin_message(buf, "update");
+	assert(rc == ok);
+	rc = message_buffer_add_string_value(buf, "x", "3");
+	assert(rc == ok);
+	rc = message_buffer_add_string_value(buf, "z", "4");
+	assert(rc == ok);
+	rc = message_buffer_add_string_value(buf, "y", "5");
+	assert(rc == ok);
+	rc = message_buffer_add_end_message(buf, "update");
+	assert(rc == ok);
+
+	send_buffer(client, buf);
+	run_for(disp, 100);
+	assert(has(store, "<x>3</x>"));
+	assert(has(store, "<y>5</y>"));
+	assert(has(store, "<z>4</z>"));
+	assert(data_store_n_sessions(store) == 1);
+	assert(receive_available(client, received, bufsize) != 0);
+
+	message_buffer_destroy(buf);
+	connection_destroy(client);
+	data_store_destroy(store);
+	dispatcher_destroy(disp);
+}
+
+/* returns the version of key as of read, or 0 */
+static unsigned long read_version(data_store *store, const data_read *read,
+	const char *key)
+{
+	int slot = data_store_find_slot(store, key);
+	if (slot == -1) {
+		return 0;
+	}
+
+	int n_shards = data_store_n_shards(store);
+	int shard_idx = slot % n_shards;
+	int idx = slot / n_shards;
+	assert(idx < data_store_n_keys(store, shard_idx));
+
+	const typed_value *value;
+	unsigned long version;
+	const char *read_key = data_store_read_key(store, read,
+		shard_idx, idx, &value, &version);
+	if (read_key == NULL) {
+		return 0;
+	}
+	assert(strcmp(read_key, key) == 0);
+
+	return version;
+}
+
+static unsigned long key_version(data_store *store, const char *key)
+{
+	data_read read;
+	data_store_begin_read(store, &read);
+	unsigned long version = read_version(store, &read, key);
+	data_store_end_read(store, &read);
+
+	return version;
+}
+
+/* slots lead to their keys' shards, and every change is numbered */
+static void shards_test()
+{
+	enum { n_shards = 4, n_keys = 16 };
+
+	dispatcher *disp;
+	return_code rc = dispatcher_create(&disp);
+	assert(rc == ok);
+
+	data_store *store;
+	rc = data_store_create(&store, disp, "127.0.0.1", 0);
+	assert(rc == ok);
+	rc = data_store_set_n_shards(store, n_shards);
+	assert(rc == ok);
+	assert(data_store_n_shards(store) == n_shards);
+	assert(data_store_find_slot(store, "k0") == -1);
+
+	/* all in one update, over all shards */
+	map *src;
+	rc = map_create(&src);
+	assert(rc == ok);
+	char key[16];
+	int i;
+	for (i = 0; i != n_keys; ++i) {
+		sprintf(key, "k%d", i);
+		rc = map_set_value(src, key, "0");
+		assert(rc == ok);
+	}
+	rc = data_store_update(store, src);
+	assert(rc == ok);
+	assert(data_store_change_seq(store) == n_keys);
+
+	int shard_used[n_shards] = { 0 };
+	int version_used[n_keys + 1] = { 0 };
+	for (i = 0; i != n_keys; ++i) {
+		sprintf(key, "k%d", i);
+		int slot = data_store_find_slot(store, key);
+		assert(slot != -1);
+		shard_used[slot % n_shards] = 1;
+
+		unsigned long version = key_version(store, key);
+		assert(version >= 1 && version <= n_keys);
+		assert(! version_used[version]);
+		version_used[version] = 1;
+	}
+	for (i = 0; i != n_shards; ++i) {
+		assert(shard_used[i]);
+	}
+
+	/* by slot, in two shards at once */
+	slot_value values[2];
+	values[0].slot = data_store_find_slot(store, "k3");
+	values[0].value.type = integer_value;
+	values[0].value.u.integer = 3;
+	values[1].slot = data_store_find_slot(store, "k7");
+	values[1].value.type = integer_value;
+	values[1].value.u.integer = 7;
+	unsigned long k5_version = key_version(store, "k5");
+
+	rc = data_store_update_slots(store, NULL, values, 2);
+	assert(rc == ok);
+	assert(data_store_change_seq(store) == n_keys + 2);
+	/* numbered by shard, not in the order given */
+	unsigned long k3_version = key_version(store, "k3");
+	unsigned long k7_version = key_version(store, "k7");
+	assert(k3_version == n_keys + 1 || k3_version == n_keys + 2);
+	assert(k7_version == n_keys + 1 || k7_version == n_keys + 2);
+	assert(k3_version != k7_version);
+	assert(key_version(store, "k5") == k5_version);
+	assert(has(store, "<k3>3</k3>"));
+	assert(has(store, "<k7>7</k7>"));
+
+	map_destroy(src);
+	data_store_destroy(store);
+	dispatcher_destroy(disp);
+}
+
+/* adds keys of its own, one per update */
+typedef struct {
+	data_store *store;
+	int id;
+	pthread_t thread;
+} writer;
+
+enum { n_writers = 4, n_writes = 2000 };
+
+static void *run_writer(void *arg)
+{
+	writer *w = arg;
+
+	int i;
+	for (i = 0; i != n_writes; ++i) {
+		char key[32];
+		sprintf(key, "w%d_%d", w->id, i);
+		update_value(w->store, key, "x");
+	}
+
+	return NULL;
+}
+
+/* the keys a read finds in a shard */
+static int n_keys_read(data_store *store, const data_read *read,
+	int shard_idx)
+{
+	int n_keys = data_store_n_keys(store, shard_idx);
+
+	int n = 0;
+	int i;
+	for (i = 0; i != n_keys; ++i) {
+		const typed_value *value;
+		unsigned long version;
+		if (data_store_read_key(store, read, shard_idx, i,
+			&value, &version) != NULL) {
+			assert(version <= read->version);
+			++n;
+		}
+	}
+
+	return n;
+}
+
+/* a read finds every change up to its version, and none after */
+static void concurrent_writers_test()
+{
+	enum { n_shards = 4 };
+
+	dispatcher *disp;
+	return_code rc = dispatcher_create(&disp);
+	assert(rc == ok);
+
+	data_store *store;
+	rc = data_store_create(&store, disp, "127.0.0.1", 0);
+	assert(rc == ok);
+	rc = data_store_set_n_shards(store, n_shards);
+	assert(rc == ok);
+
+	writer writers[n_writers];
+	int i;
+	for (i = 0; i != n_writers; ++i) {
+		writers[i].store = store;
+		writers[i].id = i;
+		int r = pthread_create(&writers[i].thread, NULL,
+			&run_writer, &writers[i]);
+		assert(r == 0);
+	}
+
+	/* each change adds a key, so a read finds as many as its version */
+	unsigned long total = n_writers * n_writes;
+	unsigned long prev_version = 0;
+	while (prev_version != total) {
+		data_read read;
+		data_store_begin_read(store, &read);
+		assert(read.version >= prev_version);
+
+		int n = 0;
+		for (i = 0; i != n_shards; ++i) {
+			n += n_keys_read(store, &read, i);
+		}
+		assert(n == read.version);
+
+		prev_version = read.version;
+		data_store_end_read(store, &read);
+	}
+
+	for (i = 0; i != n_writers; ++i) {
+		pthread_join(writers[i].thread, NULL);
+	}
+
+	data_store_destroy(store);
+	dispatcher_destroy(disp);
+}
+
+/* sets the same value for keys in all shards, one update at a time */
+typedef struct {
+	data_store *store;
+	char keys[n_writers][16];
+	pthread_t thread;
+} spanning_writer;
+
+static void *run_spanning_writer(void *arg)
+{
+	spanning_writer *w = arg;
+
+	map *src;
+	return_code rc = map_create(&src);
+	assert(rc == ok);
+
+	int i;
+	for (i = 1; i <= n_writes; ++i) {
+		char value[16];
+		sprintf(value, "%d", i);
+		int j;
+		for (j = 0; j != n_writers; ++j) {
+			rc = map_set_value(src, w->keys[j], value);
+			assert(rc == ok);
+		}
+		rc = data_store_update(w->store, src);
+		assert(rc == ok);
+	}
+
+	map_destroy(src);
+	return NULL;
+}
+
+/* the values at slots, one per shard, agree as of read */
+static int read_agrees(data_store *store, const data_read *read,
+	const int *slots, int n_shards)
+{
+	const char *first = NULL;
+
+	int i;
+	for (i = 0; i != n_shards; ++i) {
+		const typed_value *value;
+		unsigned long version;
+		const char *key = data_store_read_key(store, read,
+			slots[i] % n_shards, slots[i] / n_shards,
+			&value, &version);
+		assert(key != NULL);
+		assert(value->type == string_value);
+		if (first == NULL) {
+			first = value->u.string;
+		} else if (strcmp(value->u.string, first) != 0) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* a read sees an update over several shards whole, or not at all */
+static void spanning_update_test()
+{
+	enum { n_shards = n_writers };
+
+	dispatcher *disp;
+	return_code rc = dispatcher_create(&disp);
+	assert(rc == ok);
+
+	data_store *store;
+	rc = data_store_create(&store, disp, "127.0.0.1", 0);
+	assert(rc == ok);
+	rc = data_store_set_n_shards(store, n_shards);
+	assert(rc == ok);
+
+	/* a key in each shard */
+	spanning_writer w;
+	w.store = store;
+	int n_found = 0;
+	int i;
+	for (i = 0; n_found != n_shards; ++i) {
+		char key[16];
+		sprintf(key, "k%d", i);
+		update_value(store, key, "0");
+		int shard_idx = data_store_find_slot(store, key) % n_shards;
+		int j;
+		for (j = 0; j != n_found; ++j) {
+			if (data_store_find_slot(store, w.keys[j]) % n_shards ==
+				shard_idx) {
+				break;
+			}
+		}
+		if (j == n_found) {
+			strcpy(w.keys[n_found++], key);
+		}
+	}
+
+	/* slots don't change once their keys exist */
+	int slots[n_shards];
+	for (i = 0; i != n_shards; ++i) {
+		slots[i] = data_store_find_slot(store, w.keys[i]);
+	}
+
+	unsigned long last = data_store_change_seq(store) +
+		(unsigned long) n_writes * n_shards;
+
+	int r = pthread_create(&w.thread, NULL, &run_spanning_writer, &w);
+	assert(r == 0);
+
+	unsigned long version = 0;
+	while (version != last) {
+		data_read read;
+		data_store_begin_read(store, &read);
+		assert(read_agrees(store, &read, slots, n_shards));
+		version = read.version;
+		data_store_end_read(store, &read);
+	}
+
+	pthread_join(w.thread, NULL);
+
+	data_store_destroy(store);
+	dispatcher_destroy(disp);
+}
+
+/* the value of key as of read, or NULL */
+static const char *read_value(data_store *store, const data_read *read,
+	const char *key)
+{
+	int slot = data_store_find_slot(store, key);
+	assert(slot != -1);
+
+	int n_shards = data_store_n_shards(store);
+	const typed_value *value;
+	unsigned long version;
+	if (data_store_read_key(store, read, slot % n_shards,
+		slot / n_shards, &value, &version) == NULL) {
+		return NULL;
+	}
+
+	assert(value->type == string_value);
+	return value->u.string;
+}
+
+/* a read keeps what it found while updates go on, until it ends */
+static void held_read_test()
+{
+	enum { n_shards = 2, n_new_keys = 200 };
+
+	dispatcher *disp;
+	return_code rc = dispatcher_create(&disp);
+	assert(rc == ok);
+
+	data_store *store;
+	rc = data_store_create(&store, disp, "127.0.0.1", 0);
+	assert(rc == ok);
+	rc = data_store_set_n_shards(store, n_shards);
+	assert(rc == ok);
+
+	/* two keys in different shards */
+	char a[16];
+	char b[16];
+	strcpy(a, "k0");
+	update_value(store, a, "1");
+	int i;
+	for (i = 1; ; ++i) {
+		sprintf(b, "k%d", i);
+		update_value(store, b, "1");
+		if (data_store_find_slot(store, b) % n_shards !=
+			data_store_find_slot(store, a) % n_shards) {
+			break;
+		}
+	}
+	assert(data_store_n_retired(store) == 0);
+
+	data_read read;
+	data_store_begin_read(store, &read);
+	unsigned long a_version = read_version(store, &read, a);
+	unsigned long b_version = read_version(store, &read, b);
+
+	/* replaced entries, and directories that grow */
+	for (i = 2; i != 100; ++i) {
+		char value[16];
+		sprintf(value, "%d", i);
+		update_value(store, a, value);
+		update_value(store, b, value);
+	}
+	for (i = 0; i != n_new_keys; ++i) {
+		char key[16];
+		sprintf(key, "new%d", i);
+		update_value(store, key, "1");
+	}
+	assert(data_store_n_retired(store) != 0);
+
+	/* as of its version, in both shards */
+	assert(strcmp(read_value(store, &read, a), "1") == 0);
+	assert(strcmp(read_value(store, &read, b), "1") == 0);
+	assert(read_version(store, &read, a) == a_version);
+	assert(read_version(store, &read, b) == b_version);
+	assert(read_value(store, &read, "new0") == NULL);
+	assert(read_value(store, &read, "new199") == NULL);
+
+	/* later reads see the rest */
+	data_read later;
+	data_store_begin_read(store, &later);
+	assert(strcmp(read_value(store, &later, a), "99") == 0);
+	assert(strcmp(read_value(store, &later, b), "99") == 0);
+	assert(strcmp(read_value(store, &later, "new199"), "1") == 0);
+	data_store_end_read(store, &later);
+	assert(has(store, "<k0>99</k0>"));
+
+	/* ending it frees the rest, without waiting for an update */
+	data_store_end_read(store, &read);
+	assert(data_store_n_retired(store) == 0);
+
+	data_store_destroy(store);
+	dispatcher_destroy(disp);
+}
+
+int main()
+{
+	threads_test();
+	subscribe_test();
+	since_test();
+	unchanged_test();
+	cached_status_test();
+	throttle_test();
+	binary_test();
+	shards_test();
+	concurrent_writers_test();
+	spanning_update_test();
+	held_read_test();
+
+	return 0;
+}
@@ -1,17 +1,45 @@
+/* for ppoll() */
+#define _GNU_SOURCE
+
 #include <assert.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <time.h>
 
 #include <poll.h>
-#include <sys/time.h>
+#include <sys/epoll.h>
+#include <unistd.h>
 
 #include "dispatcher.h"
 
-typedef struct {
-	time_t secs;
-	unsigned int msecs;
-} timepoint;
+/* nsecs on CLOCK_MONOTONIC, immune to wall clock adjustments */
+typedef unsigned long long timepoint;
+
+enum { max_timeout_secs = 30 };
+
+/* epoll_pwait2() appeared in glibc 2.35 */
+#if defined(__GLIBC__) && \
+	(__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 35))
+#define HAVE_EPOLL_PWAIT2 1
+#else
+#define HAVE_EPOLL_PWAIT2 0
+#endif
+
+/*
+ * Active alarms live in a hierarchical timer wheel: level n has
+ * wheel_size slots, each covering wheel_size^n nsecs. An alarm is
+ * kept at the lowest level where its deadline and the wheel's current
+ * time differ only in that level's digit, and is cascaded to lower
+ * levels as time catches up with it. Level 0 slots are sorted by
+ * deadline and activation order; higher level slots are unordered.
+ */
+enum {
+	wheel_bits = 6,
+	wheel_size = 1 << wheel_bits,
+	wheel_levels = 11 /* wheel_bits * wheel_levels >= 64 */
+};
+
+typedef struct alarm_list alarm_list;
 
 struct io_slot {
 	int fd;
@@ -24,81 +52,81 @@ struct io_slot {
 
 struct alarm_slot {
 	timepoint tp;
+	unsigned long long seq; /* activation order */
 	return_code (*callback)(void *);
 	void *callback_arg;
+	alarm_list *list; /* NULL when inactive */
 	alarm_slot *prev;
 	alarm_slot *next;
 };
 
+struct alarm_list {
+	alarm_slot *first;
+	alarm_slot *last;
+};
+
+/*
+ * The epoll backend registers each fd once, with EPOLLONESHOT, for the
+ * union of the modes its active io slots are waiting for.
+ */
+typedef struct {
+	io_slot *slots[2]; /* indexed by io_mode; NULL if not armed */
+	int registered;
+} fd_entry;
+
 struct dispatcher {
 
+	dispatcher_backend backend;
+	int n_ios;
+
+	/* poll backend */
 	struct pollfd *pfds;
 	int n_pfds;
-	int n_ios;
+
+	/* epoll backend */
+	int epoll_fd;
+	struct epoll_event *events;
+	int n_events;
+	fd_entry *fd_entries;
+	int n_fd_entries;
+
+	int have_epoll_pwait2; /* cleared if the kernel lacks it */
+
+	/* error from a void function, reported by dispatcher_run() */
+	return_code pending_rc;
 
 	io_slot *first_io;
 	io_slot *last_io;
 	io_slot *first_active_io;
 	io_slot *first_inactive_io;
 
-	alarm_slot *first_alarm;
-	alarm_slot *last_alarm;
-	alarm_slot *first_active_alarm;
-	alarm_slot *first_inactive_alarm;
+	int n_alarms;
+	int n_active_alarms;
+	unsigned long long next_alarm_seq;
+	alarm_list expired_alarms; /* in firing order */
+	alarm_list wheel[wheel_levels][wheel_size];
+	unsigned long long wheel_occupied[wheel_levels]; /* slot bitmaps */
+	timepoint wheel_time; /* no deadline before this is pending */
 
 	int stopping;
 };
 
-static void timepoint_zero(timepoint *tp)
-{
-	tp->secs = 0;
-	tp->msecs = 0;
-}
-
-static void timepoint_now(timepoint *tp)
+static timepoint timepoint_now()
 {
-	struct timeval tv;
+	struct timespec ts;
 
-	int r = gettimeofday(&tv, NULL);
+	int r = clock_gettime(CLOCK_MONOTONIC, &ts);
 	(void) r;
 	assert(r == 0);
 
-	tp->secs = tv.tv_sec;
-	tp->msecs = tv.tv_usec / 1000;
+	return (timepoint) ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
-static void timepoint_add(timepoint *tp, unsigned int msecs)
+static void timepoint_to_timespec(struct timespec *ts, timepoint nsecs)
 {
-	tp->msecs += msecs % 1000;
-	if (tp->msecs >= 1000) {
-		tp->secs += 1;
-		tp->msecs -= 1000;
-	}
-	tp->secs += msecs / 1000;
+	ts->tv_sec = nsecs / 1000000000;
+	ts->tv_nsec = nsecs % 1000000000;
 }
-		
-static int timepoint_less(const timepoint *lhs, const timepoint *rhs)
-{
-	return lhs->secs < rhs->secs ? 1 :
-		rhs->secs < lhs->secs ? 0 :
-		lhs->msecs < rhs->msecs;
-}
-
-static unsigned int timepoint_subtract(const timepoint *lhs,
-	const timepoint *rhs)
-{
-	assert(! timepoint_less(lhs, rhs));
-	
-	unsigned int secs = lhs->secs - rhs->secs;
-	unsigned int msecs = lhs->msecs;
-	if (msecs < rhs->msecs) {
-		secs -= 1;
-		msecs += 1000;
-	}
-	msecs -= rhs->msecs;
-
-	return 1000 * secs + msecs;
-}			
 
 static void insert_io_slot(io_slot *slot, dispatcher *disp, io_slot *before)
 {
@@ -145,70 +173,284 @@ static void remove_io_slot(dispatcher *disp, io_slot *slot)
 }
 
 static void insert_alarm_slot(
-	alarm_slot *slot, dispatcher *disp, alarm_slot *before)
+	alarm_slot *slot, alarm_list *list, alarm_slot *before)
 {
 	if (before == NULL) {
-		slot->prev = disp->last_alarm;
+		slot->prev = list->last;
 	} else {
 		slot->prev = before->prev;
 	}
 	slot->next = before;
 
 	if (slot->prev == NULL) {
-		disp->first_alarm = slot;
+		list->first = slot;
 	} else {
 		slot->prev->next = slot;
 	}
 
 	if (slot->next == NULL) {
-		disp->last_alarm = slot;
+		list->last = slot;
 	} else {
 		slot->next->prev = slot;
 	}
+
+	slot->list = list;
 }
 
 static void remove_alarm_slot(dispatcher *disp, alarm_slot *slot)
 {
-	if (slot == disp->first_active_alarm) {
-		disp->first_active_alarm = slot->next;
-	}
-	if (slot == disp->first_inactive_alarm) {
-		disp->first_inactive_alarm = slot->next;
-	}
+	alarm_list *list = slot->list;
+	assert(list != NULL);
 
 	if (slot->prev == NULL) {
-		disp->first_alarm = slot->next;
+		list->first = slot->next;
 	} else {
 		slot->prev->next = slot->next;
 	}
 
 	if (slot->next == NULL) {
-		disp->last_alarm = slot->prev;
+		list->last = slot->prev;
 	} else {
 		slot->next->prev = slot->prev;
 	}
+
+	slot->list = NULL;
+
+	if (list->first == NULL && list != &disp->expired_alarms) {
+		int pos = list - &disp->wheel[0][0];
+		disp->wheel_occupied[pos / wheel_size] &=
+			~(1ULL << (pos % wheel_size));
+	}
 }
-	
-static return_code await_events(dispatcher *disp)
+
+static int alarm_slot_less(const alarm_slot *lhs, const alarm_slot *rhs)
+{
+	return lhs->tp < rhs->tp ? 1 :
+		rhs->tp < lhs->tp ? 0 :
+		lhs->seq < rhs->seq;
+}
+
+static void schedule_alarm_slot(dispatcher *disp, alarm_slot *slot)
+{
+	/* overdue alarms go into the wheel's current slot */
+	timepoint tp = slot->tp < disp->wheel_time ?
+		disp->wheel_time : slot->tp;
+
+	int level = 0;
+	while (level != wheel_levels - 1 &&
+		tp >> (wheel_bits * (level + 1)) !=
+		disp->wheel_time >> (wheel_bits * (level + 1))) {
+		++level;
+	}
+
+	int idx = (tp >> (wheel_bits * level)) & (wheel_size - 1);
+	alarm_list *list = &disp->wheel[level][idx];
+
+	alarm_slot *before = NULL;
+	if (level == 0) {
+		/* usually a no-op: later activations tend to go last */
+		alarm_slot *prev;
+		for (prev = list->last; prev != NULL &&
+			alarm_slot_less(slot, prev); prev = prev->prev) {
+			before = prev;
+		}
+	}
+
+	insert_alarm_slot(slot, list, before);
+	disp->wheel_occupied[level] |= 1ULL << idx;
+}
+
+/*
+ * Finds the earliest time at which some wheel slot needs attention:
+ * either expiring a level 0 slot or cascading a higher level slot.
+ * Returns 0 if the wheel is empty.
+ */
+static int next_wheel_event(const dispatcher *disp,
+	timepoint *when, int *level_result, int *idx_result)
 {
-	timepoint now;
-	timepoint_now(&now);
+	int found = 0;
 
-	timepoint deadline = now;
-	timepoint_add(&deadline, 30000);
+	int level;
+	for (level = 0; level != wheel_levels; ++level) {
 
-	if (disp->first_active_alarm != disp->first_inactive_alarm &&
-		timepoint_less(&disp->first_active_alarm->tp, &deadline)) {
+		unsigned long long occupied = disp->wheel_occupied[level];
+		if (occupied == 0) {
+			continue;
+		}
 
-		if (timepoint_less(&disp->first_active_alarm->tp, &now)) {
-			deadline = now;
-		} else {
-			deadline = disp->first_active_alarm->tp; 
+		int shift = wheel_bits * level;
+		int digit = (disp->wheel_time >> shift) & (wheel_size - 1);
+
+		/* pending slots never lag behind the wheel's time */
+		occupied &= ~0ULL << digit;
+		assert(occupied != 0);
+
+		int idx = __builtin_ctzll(occupied);
+
+		timepoint base = level == wheel_levels - 1 ? 0 :
+			disp->wheel_time >> (shift + wheel_bits)
+				<< (shift + wheel_bits);
+		timepoint candidate = base | (timepoint) idx << shift;
+
+		/* on a tie, cascade before expiring */
+		if (! found || candidate <= *when) {
+			*when = candidate;
+			*level_result = level;
+			*idx_result = idx;
+			found = 1;
 		}
 	}
 
-	unsigned int timeout = timepoint_subtract(&deadline, &now);
+	return found;
+}
+
+static void expire_alarm_slots(dispatcher *disp, timepoint now)
+{
+	timepoint when;
+	int level;
+	int idx;
+
+	while (next_wheel_event(disp, &when, &level, &idx) && when <= now) {
+
+		if (disp->wheel_time < when) {
+			disp->wheel_time = when;
+		}
+
+		alarm_list *list = &disp->wheel[level][idx];
+		alarm_slot *slot;
+		while ((slot = list->first) != NULL) {
+			remove_alarm_slot(disp, slot);
+			if (level == 0) {
+				insert_alarm_slot(slot,
+					&disp->expired_alarms, NULL);
+			} else {
+				schedule_alarm_slot(disp, slot);
+			}
+		}
+	}
+
+	if (disp->wheel_time < now) {
+		disp->wheel_time = now;
+	}
+}
+
+static void record_error(dispatcher *disp, return_code rc)
+{
+	if (disp->pending_rc == ok) {
+		disp->pending_rc = rc;
+	}
+}
+
+static void mark_io_slot_ready(dispatcher *disp, io_slot *slot)
+{
+	remove_io_slot(disp, slot);
+	insert_io_slot(slot, disp, disp->first_active_io);
+}
+
+static return_code update_epoll_registration(dispatcher *disp, int fd)
+{
+	fd_entry *entry = &disp->fd_entries[fd];
+
+	struct epoll_event ev;
+	ev.events = 0;
+	ev.data.fd = fd;
+
+	if (entry->slots[input] != NULL) {
+		ev.events |= EPOLLIN;
+	}
+	if (entry->slots[output] != NULL) {
+		ev.events |= EPOLLOUT;
+	}
+
+	if (ev.events == 0) {
+		if (entry->registered) {
+			/* may fail harmlessly if fd was already closed */
+			epoll_ctl(disp->epoll_fd, EPOLL_CTL_DEL, fd, &ev);
+			entry->registered = 0;
+		}
+		return ok;
+	}
+
+	ev.events |= EPOLLONESHOT;
+
+	/*
+	 * Our idea of whether fd is registered may be stale: a closed
+	 * fd is dropped by the kernel, and its number may be reused.
+	 */
+	int r;
+	if (entry->registered) {
+		r = epoll_ctl(disp->epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+		if (r == -1 && errno == ENOENT) {
+			r = epoll_ctl(disp->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+		}
+	} else {
+		r = epoll_ctl(disp->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+		if (r == -1 && errno == EEXIST) {
+			r = epoll_ctl(disp->epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+		}
+	}
+
+	if (r == -1) {
+		entry->registered = 0;
+		return cant_await_events;
+	}
+
+	entry->registered = 1;
+	return ok;
+}
+
+static return_code arm_epoll_slot(dispatcher *disp, io_slot *slot)
+{
+	if (slot->fd >= disp->n_fd_entries) {
+
+		int new_n_fd_entries = disp->n_fd_entries +
+			disp->n_fd_entries / 2 + 1;
+		if (new_n_fd_entries <= slot->fd) {
+			new_n_fd_entries = slot->fd + 1;
+		}
+
+		fd_entry *new_fd_entries = disp->fd_entries == NULL ?
+			malloc(sizeof *new_fd_entries * new_n_fd_entries) :
+			realloc(disp->fd_entries,
+				sizeof *new_fd_entries * new_n_fd_entries);
+
+		if (new_fd_entries == NULL) {
+			return out_of_memory;
+		}
+
+		int fd;
+		for (fd = disp->n_fd_entries; fd != new_n_fd_entries; ++fd) {
+			new_fd_entries[fd].slots[input] = NULL;
+			new_fd_entries[fd].slots[output] = NULL;
+			new_fd_entries[fd].registered = 0;
+		}
+
+		disp->fd_entries = new_fd_entries;
+		disp->n_fd_entries = new_n_fd_entries;
+	}
+
+	fd_entry *entry = &disp->fd_entries[slot->fd];
+	assert(entry->slots[slot->mode] == NULL ||
+		entry->slots[slot->mode] == slot);
+	entry->slots[slot->mode] = slot;
 
+	return update_epoll_registration(disp, slot->fd);
+}
+
+static return_code disarm_epoll_slot(dispatcher *disp, io_slot *slot)
+{
+	if (slot->fd < 0 || slot->fd >= disp->n_fd_entries ||
+		disp->fd_entries[slot->fd].slots[slot->mode] != slot) {
+		/* not armed */
+		return ok;
+	}
+
+	disp->fd_entries[slot->fd].slots[slot->mode] = NULL;
+	return update_epoll_registration(disp, slot->fd);
+}
+
+static return_code await_poll_events(dispatcher *disp, timepoint timeout)
+{
 	int n_pfds = 0;
 	io_slot *io;
 	for (io = disp->first_active_io; io != disp->first_inactive_io;
@@ -224,7 +466,10 @@ static return_code await_events(dispatcher *disp)
 		++n_pfds;
 	}
 
-	int r = poll(disp->pfds, n_pfds, timeout);
+	struct timespec ts;
+	timepoint_to_timespec(&ts, timeout);
+
+	int r = ppoll(disp->pfds, n_pfds, &ts, NULL);
 	if (r < 0) {
 		if (errno == EINTR) {
 			r = 0;
@@ -242,8 +487,7 @@ static return_code await_events(dispatcher *disp)
 
 		io_slot *next = io->next;
 		if (disp->pfds[idx].revents != 0) {
-			remove_io_slot(disp, io);
-			insert_io_slot(io, disp, disp->first_active_io);
+			mark_io_slot_ready(disp, io);
 			--r;
 		}
 
@@ -251,36 +495,188 @@ static return_code await_events(dispatcher *disp)
 		++idx;
 	}
 
-	timepoint_now(&now);
+	return ok;
+}
+
+static int wait_for_epoll_events(dispatcher *disp,
+	struct epoll_event *events, int n_events, timepoint timeout)
+{
+#if HAVE_EPOLL_PWAIT2
+	if (disp->have_epoll_pwait2) {
+
+		struct timespec ts;
+		timepoint_to_timespec(&ts, timeout);
+
+		int r = epoll_pwait2(disp->epoll_fd, events, n_events,
+			&ts, NULL);
+		if (r != -1 || errno != ENOSYS) {
+			return r;
+		}
+
+		disp->have_epoll_pwait2 = 0;
+	}
+#endif
+
+	/* round up, so we don't spin until a sub-msec deadline */
+	int msecs = (timeout + 999999) / 1000000;
+	return epoll_wait(disp->epoll_fd, events, n_events, msecs);
+}
+
+static return_code await_epoll_events(dispatcher *disp, timepoint timeout)
+{
+	/* epoll_wait() insists on room for at least one event */
+	struct epoll_event spare_event;
+	struct epoll_event *events = disp->n_events != 0 ?
+		disp->events : &spare_event;
+	int n_events = disp->n_events != 0 ? disp->n_events : 1;
+
+	int r = wait_for_epoll_events(disp, events, n_events, timeout);
+	if (r < 0) {
+		if (errno == EINTR) {
+			r = 0;
+		} else {
+			return cant_await_events;
+		}
+	}
+
+	int idx;
+	for (idx = 0; idx != r; ++idx) {
+
+		int fd = events[idx].data.fd;
+		unsigned int revents = events[idx].events;
+
+		assert(fd >= 0 && fd < disp->n_fd_entries);
+		fd_entry *entry = &disp->fd_entries[fd];
+
+		io_slot *in = entry->slots[input];
+		if (in != NULL && (revents &
+			(EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) != 0) {
+			entry->slots[input] = NULL;
+			mark_io_slot_ready(disp, in);
+		}
+
+		io_slot *out = entry->slots[output];
+		if (out != NULL && (revents &
+			(EPOLLOUT | EPOLLHUP | EPOLLERR)) != 0) {
+			entry->slots[output] = NULL;
+			mark_io_slot_ready(disp, out);
+		}
+
+		/* EPOLLONESHOT disabled fd: rearm for what is left */
+		if (entry->slots[input] != NULL ||
+			entry->slots[output] != NULL) {
+			return_code rc = update_epoll_registration(disp, fd);
+			if (rc != ok) {
+				return rc;
+			}
+		}
+	}
+
+	return ok;
+}
 
-	while (disp->first_active_alarm != disp->first_inactive_alarm &&
-		! timepoint_less(&now, &disp->first_active_alarm->tp)) {
-		disp->first_active_alarm = disp->first_active_alarm->next;
+static return_code await_events(dispatcher *disp)
+{
+	timepoint now = timepoint_now();
+
+	timepoint timeout = (timepoint) max_timeout_secs * 1000000000;
+
+	timepoint when;
+	int level;
+	int idx;
+	if (disp->expired_alarms.first != NULL) {
+		timeout = 0;
+	} else if (next_wheel_event(disp, &when, &level, &idx)) {
+		if (when <= now) {
+			timeout = 0;
+		} else if (when - now < timeout) {
+			timeout = when - now;
+		}
 	}
 
+	return_code rc;
+	switch (disp->backend) {
+	case epoll_backend :
+		rc = await_epoll_events(disp, timeout);
+		break;
+	default :
+		rc = await_poll_events(disp, timeout);
+		break;
+	}
+
+	if (rc != ok) {
+		return rc;
+	}
+
+	expire_alarm_slots(disp, timepoint_now());
+
 	return ok;
 }
 
 return_code dispatcher_create(dispatcher **result)
 {
+	return dispatcher_create_with_backend(result, default_backend);
+}
+
+return_code dispatcher_create_with_backend(dispatcher **result,
+	dispatcher_backend backend)
+{
+	int epoll_fd = -1;
+	if (backend != poll_backend) {
+		epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		if (epoll_fd != -1) {
+			backend = epoll_backend;
+		} else if (backend == epoll_backend) {
+			return cant_create_epoll;
+		} else {
+			backend = poll_backend;
+		}
+	}
+
 	dispatcher *disp = malloc(sizeof *disp);
 	if (disp == NULL) {
+		if (epoll_fd != -1) {
+			close(epoll_fd);
+		}
 		return out_of_memory;
 	}
 
+	disp->backend = backend;
+	disp->n_ios = 0;
+
 	disp->pfds = NULL;
 	disp->n_pfds = 0;
-	disp->n_ios = 0;
+
+	disp->epoll_fd = epoll_fd;
+	disp->events = NULL;
+	disp->n_events = 0;
+	disp->fd_entries = NULL;
+	disp->n_fd_entries = 0;
+
+	disp->have_epoll_pwait2 = HAVE_EPOLL_PWAIT2;
+	disp->pending_rc = ok;
 
 	disp->first_io = NULL;
 	disp->last_io = NULL;
 	disp->first_active_io = NULL;
 	disp->first_inactive_io = NULL;
 
-	disp->first_alarm = NULL;
-	disp->last_alarm = NULL;
-	disp->first_active_alarm = NULL;
-	disp->first_inactive_alarm = NULL;
+	disp->n_alarms = 0;
+	disp->n_active_alarms = 0;
+	disp->next_alarm_seq = 0;
+	disp->expired_alarms.first = NULL;
+	disp->expired_alarms.last = NULL;
+
+	int level;
+	for (level = 0; level != wheel_levels; ++level) {
+		int idx;
+		for (idx = 0; idx != wheel_size; ++idx) {
+			disp->wheel[level][idx].first = NULL;
+			disp->wheel[level][idx].last = NULL;
+		}
+		disp->wheel_occupied[level] = 0;
+	}
+	disp->wheel_time = timepoint_now();
 
 	disp->stopping = 0;
 
@@ -288,9 +684,14 @@ return_code dispatcher_create(dispatcher **result)
 	return ok;
 }
 
+dispatcher_backend dispatcher_get_backend(const dispatcher *disp)
+{
+	return disp->backend;
+}
+
 return_code dispatcher_create_io_slot(dispatcher *disp, io_slot **result)
 {
-	if (disp->n_ios == disp->n_pfds) {
+	if (disp->backend == poll_backend && disp->n_ios == disp->n_pfds) {
 
 		int new_n_pfds = disp->n_pfds + disp->n_pfds / 2 + 1;
 		struct pollfd *new_pfds = disp->pfds == NULL ?
@@ -304,6 +705,22 @@ return_code dispatcher_create_io_slot(dispatcher *disp, io_slot **result)
 		disp->pfds = new_pfds;
 		disp->n_pfds = new_n_pfds;
 	}
+
+	if (disp->backend == epoll_backend && disp->n_ios == disp->n_events) {
+
+		int new_n_events = disp->n_events + disp->n_events / 2 + 1;
+		struct epoll_event *new_events = disp->events == NULL ?
+			malloc(sizeof *new_events * new_n_events) :
+			realloc(disp->events,
+				sizeof *new_events * new_n_events);
+
+		if (new_events == NULL) {
+			return out_of_memory;
+		}
+
+		disp->events = new_events;
+		disp->n_events = new_n_events;
+	}
 		
  	io_slot *slot = malloc(sizeof *slot);
 	if (slot == NULL) {
@@ -334,6 +751,10 @@ void dispatcher_activate_io_slot(dispatcher *disp,
 	io_slot *slot, int fd, io_mode mode,
 	return_code (*callback)(void *), void *callback_arg)
 {
+	if (disp->backend == epoll_backend) {
+		record_error(disp, disarm_epoll_slot(disp, slot));
+	}
+
 	remove_io_slot(disp, slot);
 
 	slot->fd = fd;
@@ -346,10 +767,18 @@ void dispatcher_activate_io_slot(dispatcher *disp,
 	if (disp->first_active_io == disp->first_inactive_io) {
 		disp->first_active_io = slot;
 	}
+
+	if (disp->backend == epoll_backend) {
+		record_error(disp, arm_epoll_slot(disp, slot));
+	}
 }
 
 void dispatcher_deactivate_io_slot(dispatcher *disp, io_slot *slot)
 {
+	if (disp->backend == epoll_backend) {
+		record_error(disp, disarm_epoll_slot(disp, slot));
+	}
+
 	remove_io_slot(disp, slot);
 	insert_io_slot(slot, disp, NULL);
 
@@ -366,6 +795,11 @@ void dispatcher_destroy_io_slot(dispatcher *disp, io_slot *slot)
 	assert(disp->n_ios > 0);
 	--disp->n_ios;
 
+	if (disp->backend == epoll_backend) {
+		/* nobody is left to report a failure to */
+		disarm_epoll_slot(disp, slot);
+	}
+
 	remove_io_slot(disp, slot);
 	free(slot);
 }
@@ -378,18 +812,15 @@ return_code dispatcher_create_alarm_slot(dispatcher *disp,
 		return out_of_memory;
 	}
 
-	timepoint_zero(&slot->tp);
+	slot->tp = 0;
+	slot->seq = 0;
 	slot->callback = NULL;
 	slot->callback_arg = NULL;
+	slot->list = NULL;
+	slot->prev = NULL;
+	slot->next = NULL;
 
-	insert_alarm_slot(slot, disp, NULL);
-
-	if (disp->first_inactive_alarm == NULL) {
-		if (disp->first_active_alarm == NULL) {
-			disp->first_active_alarm = slot;
-		}
-		disp->first_inactive_alarm = slot;
-	}
+	++disp->n_alarms;
 
 	*result = slot;
 	return ok;
@@ -399,44 +830,40 @@ void dispatcher_activate_alarm_slot(dispatcher *disp,
 	alarm_slot *slot, unsigned int msecs,
 	return_code (*callback)(void *), void *callback_arg)
 {
-	remove_alarm_slot(disp, slot);
+	dispatcher_activate_alarm_slot_ns(disp, slot,
+		(unsigned long long) msecs * 1000000,
+		callback, callback_arg);
+}
+
+void dispatcher_activate_alarm_slot_ns(dispatcher *disp,
+	alarm_slot *slot, unsigned long long nsecs,
+	return_code (*callback)(void *), void *callback_arg)
+{
+	dispatcher_deactivate_alarm_slot(disp, slot);
 
-	timepoint_now(&slot->tp);
-	timepoint_add(&slot->tp, msecs);
+	slot->tp = timepoint_now() + nsecs;
+	slot->seq = disp->next_alarm_seq++;
 	slot->callback = callback;
 	slot->callback_arg = callback_arg;
 
-	alarm_slot *next;
-	for (next = disp->first_active_alarm;
-		next != disp->first_inactive_alarm;
-		next = next->next) {
-		if (timepoint_less(&slot->tp, &next->tp)) {
-			break;
-		}
-	}
-
-	insert_alarm_slot(slot, disp, next);
-	if (disp->first_active_alarm == next) {
-		disp->first_active_alarm = slot;
-	}
+	schedule_alarm_slot(disp, slot);
+	++disp->n_active_alarms;
 }
 
 void dispatcher_deactivate_alarm_slot(dispatcher *disp, alarm_slot *slot)
 {
-	remove_alarm_slot(disp, slot);
-	insert_alarm_slot(slot, disp, NULL);
-
-	if (disp->first_inactive_alarm == NULL) {
-		if (disp->first_active_alarm == NULL) {
-			disp->first_active_alarm = slot;
-		}
-		disp->first_inactive_alarm = slot;
+	if (slot->list != NULL) {
+		remove_alarm_slot(disp, slot);
+		--disp->n_active_alarms;
 	}
 }
 	
 void dispatcher_destroy_alarm_slot(dispatcher *disp, alarm_slot *slot)
 {
-	remove_alarm_slot(disp, slot);
+	assert(disp->n_alarms > 0);
+	--disp->n_alarms;
+
+	dispatcher_deactivate_alarm_slot(disp, slot);
 	free(slot);
 }
 
@@ -446,7 +873,7 @@ return_code dispatcher_run(dispatcher *disp)
 
 	while (rc == ok && ! disp->stopping &&
 		(disp->first_io != disp->first_inactive_io ||
-		disp->first_alarm != disp->first_inactive_alarm)) {
+		disp->n_active_alarms != 0)) {
 		
 		io_slot *io;
 		alarm_slot *alarm;
@@ -456,8 +883,7 @@ return_code dispatcher_run(dispatcher *disp)
 			dispatcher_deactivate_io_slot(disp, io);
 			rc = (*io->callback)(io->callback_arg);
 
-		} else if ((alarm = disp->first_alarm) != 
-			disp->first_active_alarm) {
+		} else if ((alarm = disp->expired_alarms.first) != NULL) {
 
 			dispatcher_deactivate_alarm_slot(disp, alarm);
 			rc = (*alarm->callback)(alarm->callback_arg);
@@ -466,6 +892,11 @@ return_code dispatcher_run(dispatcher *disp)
 
 			rc = await_events(disp);
 		}
+
+		if (rc == ok && disp->pending_rc != ok) {
+			rc = disp->pending_rc;
+			disp->pending_rc = ok;
+		}
 	}
 
 	disp->stopping = 0;
@@ -480,11 +911,17 @@ void dispatcher_stop(dispatcher *disp)
 
 void dispatcher_destroy(dispatcher *disp)
 {
-	assert(disp->first_alarm == NULL);
+	assert(disp->n_alarms == 0);
 	assert(disp->first_io == NULL);
 	assert(disp->n_ios == 0);
 
+	free(disp->fd_entries);
+	free(disp->events);
 	free(disp->pfds);
 
+	if (disp->epoll_fd != -1) {
+		close(disp->epoll_fd);
+	}
+
 	free(disp);
 }
@@ -8,14 +8,28 @@ typedef enum {
 	output
 } io_mode;
 
+typedef enum {
+	default_backend, /* epoll if available, poll otherwise */
+	poll_backend,
+	epoll_backend
+} dispatcher_backend;
+
 typedef struct dispatcher dispatcher;
 typedef struct io_slot io_slot;
 typedef struct alarm_slot alarm_slot;
 
 return_code dispatcher_create(dispatcher **result);
+return_code dispatcher_create_with_backend(dispatcher **result,
+	dispatcher_backend backend);
+
+dispatcher_backend dispatcher_get_backend(const dispatcher *disp);
 
 return_code dispatcher_create_io_slot(dispatcher *disp, io_slot **result);
 
+/*
+ * With the epoll backend, an fd must not be closed while an io slot
+ * is active for it: the kernel silently drops the registration.
+ */
 void dispatcher_activate_io_slot(dispatcher *disp,
 	io_slot *slot, int fd, io_mode mode, 
 	return_code (*callback)(void *), void *callback_arg);
@@ -31,6 +45,10 @@ void dispatcher_activate_alarm_slot(dispatcher *disp,
 	alarm_slot *slot, unsigned int msecs,
 	return_code (*callback)(void *), void *callback_arg);
 
+void dispatcher_activate_alarm_slot_ns(dispatcher *disp,
+	alarm_slot *slot, unsigned long long nsecs,
+	return_code (*callback)(void *), void *callback_arg);
+
 void dispatcher_deactivate_alarm_slot(dispatcher *disp, alarm_slot *slot);
 
 void dispatcher_destroy_alarm_slot(dispatcher *disp, alarm_slot *slot);
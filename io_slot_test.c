@@ -0,0 +1,262 @@
+#include <stddef.h>
+
+#include "acceptor.h"
+#include "connection.h"
+#include "dispatcher.h"
+
+#undef NDEBUG
+#include <assert.h>
+
+static const dispatcher_backend backends[] = {
+	poll_backend, epoll_backend
+};
+enum { n_backends = sizeof backends / sizeof backends[0] };
+
+typedef struct {
+	acceptor *acc;
+	connection *client;
+	connection *server;
+} connection_pair;
+
+static void create_pair(connection_pair *pair)
+{
+	return_code rc = acceptor_create(&pair->acc, "127.0.0.1", 0);
+	assert(rc == ok);
+
+	rc = connection_create(&pair->client, "127.0.0.1",
+		acceptor_port(pair->acc));
+	assert(rc == ok);
+
+	rc = acceptor_accept_blocking(pair->acc, &pair->server);
+	assert(rc == ok);
+}
+
+static void destroy_pair(connection_pair *pair)
+{
+	connection_destroy(pair->server);
+	connection_destroy(pair->client);
+	acceptor_destroy(pair->acc);
+}
+
+static return_code increment_int(void *user_data)
+{
+	int *i = user_data;
+	++(*i);
+
+	return ok;
+}
+
+static return_code fail(void *user_data)
+{
+	assert(0);
+	return ok;
+}
+
+static void test_create_destroy(dispatcher_backend backend)
+{
+	dispatcher *disp = NULL;
+	return_code rc = dispatcher_create_with_backend(&disp, backend);
+	assert(rc == ok);
+	assert(disp != NULL);
+	assert(dispatcher_get_backend(disp) == backend);
+
+	io_slot *slot = NULL;
+	rc = dispatcher_create_io_slot(disp, &slot);
+	assert(rc == ok);
+	assert(slot != NULL);
+
+	rc = dispatcher_run(disp);
+	assert(rc == ok);
+
+	dispatcher_destroy_io_slot(disp, slot);
+	dispatcher_destroy(disp);
+}
+
+static void test_output(dispatcher_backend backend)
+{
+	dispatcher *disp;
+	return_code rc = dispatcher_create_with_backend(&disp, backend);
+	assert(rc == ok);
+
+	connection_pair pair;
+	create_pair(&pair);
+
+	io_slot *slot;
+	rc = dispatcher_create_io_slot(disp, &slot);
+	assert(rc == ok);
+
+	int counter = 0;
+	connection_activate_io_slot(pair.client, disp, slot, output,
+		&increment_int, &counter);
+
+	rc = dispatcher_run(disp);
+	assert(rc == ok);
+	assert(counter == 1);
+
+	dispatcher_destroy_io_slot(disp, slot);
+	destroy_pair(&pair);
+	dispatcher_destroy(disp);
+}
+
+typedef struct {
+	connection *peer;
+	int counter;
+} poke_data;
+
+static return_code poke_peer(void *user_data)
+{
+	poke_data *data = user_data;
+	++data->counter;
+
+	char c = 'x';
+	int sent;
+	return_code rc = connection_send_blocking(data->peer,
+		&sent, &c, sizeof c);
+	assert(rc == ok);
+
+	return ok;
+}
+
+static void test_input_and_output(dispatcher_backend backend)
+{
+	dispatcher *disp;
+	return_code rc = dispatcher_create_with_backend(&disp, backend);
+	assert(rc == ok);
+
+	connection_pair pair;
+	create_pair(&pair);
+
+	io_slot *input_slot;
+	rc = dispatcher_create_io_slot(disp, &input_slot);
+	assert(rc == ok);
+
+	io_slot *output_slot;
+	rc = dispatcher_create_io_slot(disp, &output_slot);
+	assert(rc == ok);
+
+	/*
+	 * Two slots on the same fd: output fires first, and makes
+	 * the client send something, so input must still be armed.
+	 */
+	int n_inputs = 0;
+	connection_activate_io_slot(pair.server, disp, input_slot, input,
+		&increment_int, &n_inputs);
+
+	poke_data data;
+	data.peer = pair.client;
+	data.counter = 0;
+	connection_activate_io_slot(pair.server, disp, output_slot, output,
+		&poke_peer, &data);
+
+	rc = dispatcher_run(disp);
+	assert(rc == ok);
+	assert(data.counter == 1);
+	assert(n_inputs == 1);
+
+	dispatcher_destroy_io_slot(disp, output_slot);
+	dispatcher_destroy_io_slot(disp, input_slot);
+	destroy_pair(&pair);
+	dispatcher_destroy(disp);
+}
+
+static void test_deactivate(dispatcher_backend backend)
+{
+	dispatcher *disp;
+	return_code rc = dispatcher_create_with_backend(&disp, backend);
+	assert(rc == ok);
+
+	connection_pair pair;
+	create_pair(&pair);
+
+	io_slot *slot;
+	rc = dispatcher_create_io_slot(disp, &slot);
+	assert(rc == ok);
+
+	connection_activate_io_slot(pair.client, disp, slot, output,
+		&fail, NULL);
+	dispatcher_deactivate_io_slot(disp, slot);
+
+	rc = dispatcher_run(disp);
+	assert(rc == ok);
+
+	dispatcher_destroy_io_slot(disp, slot);
+	destroy_pair(&pair);
+	dispatcher_destroy(disp);
+}
+
+typedef struct {
+	dispatcher *disp;
+	connection *conn;
+	io_slot *slot;
+	int counter;
+} reactivate_data;
+
+static return_code reactivate(void *user_data)
+{
+	reactivate_data *data = user_data;
+
+	--data->counter;
+	if (data->counter != 0) {
+		connection_activate_io_slot(data->conn, data->disp,
+			data->slot, output, &reactivate, data);
+	}
+
+	return ok;
+}
+
+static void test_reactivate(dispatcher_backend backend)
+{
+	dispatcher *disp;
+	return_code rc = dispatcher_create_with_backend(&disp, backend);
+	assert(rc == ok);
+
+	connection_pair pair;
+	create_pair(&pair);
+
+	io_slot *slot;
+	rc = dispatcher_create_io_slot(disp, &slot);
+	assert(rc == ok);
+
+	reactivate_data data;
+	data.disp = disp;
+	data.conn = pair.client;
+	data.slot = slot;
+	data.counter = 3;
+
+	connection_activate_io_slot(pair.client, disp, slot, output,
+		&reactivate, &data);
+
+	rc = dispatcher_run(disp);
+	assert(rc == ok);
+	assert(data.counter == 0);
+
+	dispatcher_destroy_io_slot(disp, slot);
+	destroy_pair(&pair);
+	dispatcher_destroy(disp);
+}
+
+static void test_default_backend()
+{
+	dispatcher *disp;
+	return_code rc = dispatcher_create(&disp);
+	assert(rc == ok);
+	assert(dispatcher_get_backend(disp) != default_backend);
+
+	dispatcher_destroy(disp);
+}
+
+int main()
+{
+	int i;
+	for (i = 0; i != n_backends; ++i) {
+		test_create_destroy(backends[i]);
+		test_output(backends[i]);
+		test_input_and_output(backends[i]);
+		test_deactivate(backends[i]);
+		test_reactivate(backends[i]);
+	}
+
+	test_default_backend();
+
+	return 0;
+}
@@ -0,0 +1,626 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/resource.h>
+
+#include "connection.h"
+#include "dispatcher.h"
+#include "lprintf.h"
+#include "message_buffer.h"
+#include "push_parser.h"
+#include "stop_handler.h"
+
+/*
+ * Opens many sessions to a server, and has each send a mix of update
+ * and retrieve messages at its share of the target rate. The latency
+ * of a retrieve runs from queueing the message until the end of the
+ * status message that answers it; the server answers in order.
+ */
+
+enum {
+	default_n_sessions = 1000,
+	default_rate = 10000,
+	default_duration = 10,
+	default_retrieve_percentage = 10,
+	default_n_keys = 10,
+	max_pending = 64 /* outstanding retrieves per session */
+};
+
+static int n_sessions = default_n_sessions;
+static int rate = default_rate;
+static int duration = default_duration;
+static int retrieve_percentage = default_retrieve_percentage;
+static int n_keys = default_n_keys;
+
+/*
+ * Latencies, in microseconds, are counted in log-linear buckets: 16
+ * buckets per power of two, so the relative error stays below 1/16.
+ */
+enum {
+	sub_bucket_bits = 4,
+	n_sub_buckets = 1 << sub_bucket_bits,
+	n_buckets = (40 - sub_bucket_bits + 1) * n_sub_buckets
+};
+
+typedef struct {
+	unsigned long counts[n_buckets];
+	unsigned long n_values;
+	unsigned long long max_value;
+} histogram;
+
+static int bucket_index(unsigned long long value)
+{
+	if (value < n_sub_buckets) {
+		return value;
+	}
+
+	int log2 = 63 - __builtin_clzll(value);
+	int shift = log2 - sub_bucket_bits;
+	int sub_bucket = (value >> shift) & (n_sub_buckets - 1);
+	int index = (shift + 1) * n_sub_buckets + sub_bucket;
+
+	return index < n_buckets ? index : n_buckets - 1;
+}
+
+static unsigned long long bucket_lower_bound(int index)
+{
+	if (index < n_sub_buckets) {
+		return index;
+	}
+
+	int shift = index / n_sub_buckets - 1;
+	int sub_bucket = index % n_sub_buckets;
+
+	return (unsigned long long) (n_sub_buckets + sub_bucket) << shift;
+}
+
+static void histogram_add(histogram *h, unsigned long long value)
+{
+	++h->counts[bucket_index(value)];
+	++h->n_values;
+	if (value > h->max_value) {
+		h->max_value = value;
+	}
+}
+
+static unsigned long long histogram_percentile(const histogram *h,
+	double percentile)
+{
+	unsigned long threshold = h->n_values * percentile / 100;
+	unsigned long seen = 0;
+
+	int i;
+	for (i = 0; i != n_buckets; ++i) {
+		seen += h->counts[i];
+		if (seen > threshold) {
+			return bucket_lower_bound(i);
+		}
+	}
+
+	return h->max_value;
+}
+
+typedef struct {
+	unsigned long n_updates;
+	unsigned long n_retrieves;
+	unsigned long n_statuses;
+	unsigned long n_skipped; /* retrieves not sent: too many pending */
+	unsigned long n_failed_sessions;
+	unsigned long long bytes_sent;
+	unsigned long long bytes_received;
+	histogram latencies;
+} statistics;
+
+static statistics stats;
+
+typedef struct {
+	dispatcher *disp;
+	int id;
+	connection *conn;
+	io_slot *input_slot;
+	io_slot *output_slot;
+	alarm_slot *alarm;
+	message_buffer *buffer;
+	push_parser *parser;
+	int sending;
+	int failed;
+	unsigned long n_messages;
+	unsigned long long interval; /* nsecs between messages */
+	unsigned long long next_send;
+	unsigned long long pending[max_pending]; /* retrieve send times */
+	int first_pending;
+	int n_pending;
+} session;
+
+static unsigned long long now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (unsigned long long) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void fail_session(session *sess, return_code rc)
+{
+	lprintf(warning, "session %d: %s\n", sess->id,
+		return_code_string(rc));
+
+	dispatcher_deactivate_alarm_slot(sess->disp, sess->alarm);
+	dispatcher_deactivate_io_slot(sess->disp, sess->input_slot);
+	dispatcher_deactivate_io_slot(sess->disp, sess->output_slot);
+	sess->failed = 1;
+	++stats.n_failed_sessions;
+}
+
+static return_code on_output(void *user_data)
+{
+	session *sess = user_data;
+
+	int bytes_sent;
+	return_code rc = connection_send_nonblocking(sess->conn, &bytes_sent,
+		message_buffer_data(sess->buffer),
+		message_buffer_size(sess->buffer));
+
+	switch (rc) {
+	case ok :
+		message_buffer_discard(sess->buffer, bytes_sent);
+		stats.bytes_sent += bytes_sent;
+		break;
+	case would_block :
+		break;
+	default :
+		fail_session(sess, rc);
+		return ok;
+	}
+
+	sess->sending = message_buffer_size(sess->buffer) != 0;
+	if (sess->sending) {
+		connection_activate_io_slot(sess->conn, sess->disp,
+			sess->output_slot, output, &on_output, sess);
+	}
+
+	return ok;
+}
+
+static return_code add_update(session *sess)
+{
+	return_code rc = message_buffer_add_begin_message(sess->buffer,
+		"update");
+	if (rc != ok) {
+		return rc;
+	}
+
+	int i;
+	for (i = 0; i != n_keys; ++i) {
+		char key[32];
+		sprintf(key, "key_%d", i);
+		char value[64];
+		sprintf(value, "%d_%lu", sess->id, sess->n_messages);
+		rc = message_buffer_add_string_value(sess->buffer,
+			key, value);
+		if (rc != ok) {
+			return rc;
+		}
+	}
+
+	rc = message_buffer_add_end_message(sess->buffer, "update");
+	if (rc != ok) {
+		return rc;
+	}
+
+	++stats.n_updates;
+	return ok;
+}
+
+static return_code add_retrieve(session *sess, unsigned long long t)
+{
+	if (sess->n_pending == max_pending) {
+		++stats.n_skipped;
+		return ok;
+	}
+
+	return_code rc = message_buffer_add_begin_message(sess->buffer,
+		"retrieve");
+	if (rc != ok) {
+		return rc;
+	}
+
+	rc = message_buffer_add_end_message(sess->buffer, "retrieve");
+	if (rc != ok) {
+		return rc;
+	}
+
+	sess->pending[(sess->first_pending + sess->n_pending) %
+		max_pending] = t;
+	++sess->n_pending;
+	++stats.n_retrieves;
+
+	return ok;
+}
+
+static return_code on_alarm(void *user_data)
+{
+	session *sess = user_data;
+	unsigned long long t = now();
+
+	return_code rc = rand() % 100 < retrieve_percentage ?
+		add_retrieve(sess, t) : add_update(sess);
+	if (rc != ok) {
+		return rc;
+	}
+	++sess->n_messages;
+
+	if (! sess->sending && message_buffer_size(sess->buffer) != 0) {
+		sess->sending = 1;
+		connection_activate_io_slot(sess->conn, sess->disp,
+			sess->output_slot, output, &on_output, sess);
+	}
+
+	/* keep to the schedule, but don't try to catch up in a burst */
+	sess->next_send += sess->interval;
+	if (sess->next_send < t) {
+		sess->next_send = t;
+	}
+
+	dispatcher_activate_alarm_slot_ns(sess->disp, sess->alarm,
+		sess->next_send - t, &on_alarm, sess);
+
+	return ok;
+}
+
+static return_code on_begin_message(void *target_object,
+	const char *type, int type_length)
+{
+	return ok;
+}
+
+static return_code on_message_data(void *target_object,
+	const char *key, int key_length, const char *data, int data_length)
+{
+	return ok;
+}
+
+static return_code on_end_message(void *target_object)
+{
+	session *sess = target_object;
+
+	if (sess->n_pending == 0) {
+		return ok;
+	}
+
+	unsigned long long latency = now() -
+		sess->pending[sess->first_pending];
+	sess->first_pending = (sess->first_pending + 1) % max_pending;
+	--sess->n_pending;
+
+	histogram_add(&stats.latencies, latency / 1000);
+	++stats.n_statuses;
+
+	return ok;
+}
+
+static const push_parser_view_vtbl parser_vtbl = {
+	&on_begin_message,
+	&on_message_data,
+	&on_end_message
+};
+
+static return_code on_input(void *user_data)
+{
+	session *sess = user_data;
+
+	char buf[4096];
+	int bytes_received;
+	return_code rc = connection_receive_nonblocking(sess->conn,
+		&bytes_received, buf, sizeof buf);
+
+	switch (rc) {
+	case ok :
+		if (bytes_received == 0) {
+			fail_session(sess, cant_receive);
+			return ok;
+		}
+		stats.bytes_received += bytes_received;
+		rc = push_parser_push(sess->parser, buf, bytes_received);
+		if (rc != ok) {
+			fail_session(sess, rc);
+			return ok;
+		}
+		break;
+	case would_block :
+		break;
+	default :
+		fail_session(sess, rc);
+		return ok;
+	}
+
+	connection_activate_io_slot(sess->conn, sess->disp,
+		sess->input_slot, input, &on_input, sess);
+
+	return ok;
+}
+
+static void destroy_session(session *sess)
+{
+	if (sess->parser != NULL) {
+		push_parser_destroy(sess->parser);
+	}
+	if (sess->buffer != NULL) {
+		message_buffer_destroy(sess->buffer);
+	}
+	if (sess->alarm != NULL) {
+		dispatcher_destroy_alarm_slot(sess->disp, sess->alarm);
+	}
+	if (sess->output_slot != NULL) {
+		dispatcher_destroy_io_slot(sess->disp, sess->output_slot);
+	}
+	if (sess->input_slot != NULL) {
+		dispatcher_destroy_io_slot(sess->disp, sess->input_slot);
+	}
+	if (sess->conn != NULL) {
+		connection_destroy(sess->conn);
+	}
+}
+
+static return_code create_session(session *sess, dispatcher *disp, int id,
+	const char *host, int port)
+{
+	memset(sess, '\0', sizeof *sess);
+	sess->disp = disp;
+	sess->id = id;
+
+	return_code rc = connection_create(&sess->conn, host, port);
+	if (rc == ok) {
+		rc = dispatcher_create_io_slot(disp, &sess->input_slot);
+	}
+	if (rc == ok) {
+		rc = dispatcher_create_io_slot(disp, &sess->output_slot);
+	}
+	if (rc == ok) {
+		rc = dispatcher_create_alarm_slot(disp, &sess->alarm);
+	}
+	if (rc == ok) {
+		rc = message_buffer_create(&sess->buffer);
+	}
+	if (rc == ok) {
+		rc = push_parser_create_view(&sess->parser,
+			sess, &parser_vtbl);
+	}
+	if (rc != ok) {
+		destroy_session(sess);
+		return rc;
+	}
+
+	/* spread the sessions' sends evenly */
+	sess->interval = 1000000000ULL * n_sessions / rate;
+	unsigned long long phase = sess->interval * id / n_sessions;
+	sess->next_send = now() + phase;
+
+	connection_activate_io_slot(sess->conn, disp,
+		sess->input_slot, input, &on_input, sess);
+	dispatcher_activate_alarm_slot_ns(disp, sess->alarm, phase,
+		&on_alarm, sess);
+
+	return ok;
+}
+
+static return_code on_end_of_run(void *user_data)
+{
+	dispatcher_stop(user_data);
+	return ok;
+}
+
+static void print_report(double seconds)
+{
+	printf("sessions: %d (%lu failed)\n",
+		n_sessions, stats.n_failed_sessions);
+	printf("duration: %.1f s\n", seconds);
+	printf("updates: %lu (%.0f/s)\n",
+		stats.n_updates, stats.n_updates / seconds);
+	printf("retrieves: %lu (%.0f/s), %lu skipped\n",
+		stats.n_retrieves, stats.n_retrieves / seconds,
+		stats.n_skipped);
+	printf("statuses: %lu (%.0f/s)\n",
+		stats.n_statuses, stats.n_statuses / seconds);
+	printf("sent: %.1f MB/s, received: %.1f MB/s\n",
+		stats.bytes_sent / seconds / 1e6,
+		stats.bytes_received / seconds / 1e6);
+
+	const histogram *h = &stats.latencies;
+	if (h->n_values == 0) {
+		return;
+	}
+
+	printf("retrieve latency (us): p50 %llu, p99 %llu, p999 %llu, "
+		"max %llu\n",
+		histogram_percentile(h, 50),
+		histogram_percentile(h, 99),
+		histogram_percentile(h, 99.9),
+		h->max_value);
+
+	/* printed with one line per power of two */
+	printf("retrieve latency histogram:\n");
+	unsigned long seen = 0;
+	int i;
+	for (i = 0; i < n_buckets; i += n_sub_buckets) {
+
+		unsigned long count = 0;
+		int j;
+		for (j = i; j != i + n_sub_buckets; ++j) {
+			count += h->counts[j];
+		}
+
+		if (count != 0) {
+			seen += count;
+			printf("  >= %10llu us: %10lu %8.3f%%\n",
+				bucket_lower_bound(i), count,
+				100.0 * seen / h->n_values);
+		}
+	}
+}
+
+static int usage(const char *argv0)
+{
+	fprintf(stderr, "usage: %s [<option>...]"
+		" <target host> <target port>\n", argv0);
+	fprintf(stderr, "options are:\n");
+	fprintf(stderr,
+		"  --duration <secs>     sets run time (default: %d)\n",
+			default_duration);
+	fprintf(stderr,
+		"  --keys <number>       sets keys per update (default: %d)\n",
+			default_n_keys);
+	fprintf(stderr,
+		"  --loglevel <level>    sets log level\n");
+	fprintf(stderr,
+		"  --rate <number>       sets messages per second, over all"
+			" sessions (default: %d)\n", default_rate);
+	fprintf(stderr,
+		"  --retrieves <percent> sets share of retrieve messages"
+			" (default: %d)\n", default_retrieve_percentage);
+	fprintf(stderr,
+		"  --sessions <number>   sets number of sessions"
+			" (default: %d)\n", default_n_sessions);
+
+	return 1;
+}
+
+static int parse_int_option(int argc, char *argv[], int *i, int min_value,
+	int *value)
+{
+	if (++*i == argc) {
+		return -1;
+	}
+
+	*value = atoi(argv[*i]);
+
+	return *value < min_value ? -1 : 0;
+}
+
+static int parse_options(int argc, char *argv[])
+{
+	int i;
+	for (i = 1; i != argc && *argv[i] == '-'; ++i) {
+
+		int r;
+		if (strcmp(argv[i], "--duration") == 0) {
+			r = parse_int_option(argc, argv, &i, 1, &duration);
+		} else if (strcmp(argv[i], "--keys") == 0) {
+			r = parse_int_option(argc, argv, &i, 0, &n_keys);
+		} else if (strcmp(argv[i], "--loglevel") == 0) {
+			int level;
+			r = parse_int_option(argc, argv, &i, 0, &level);
+			set_loglevel(level);
+		} else if (strcmp(argv[i], "--rate") == 0) {
+			r = parse_int_option(argc, argv, &i, 1, &rate);
+		} else if (strcmp(argv[i], "--retrieves") == 0) {
+			r = parse_int_option(argc, argv, &i, 0,
+				&retrieve_percentage);
+		} else if (strcmp(argv[i], "--sessions") == 0) {
+			r = parse_int_option(argc, argv, &i, 1, &n_sessions);
+		} else {
+			r = -1;
+		}
+
+		if (r == -1) {
+			return -1;
+		}
+	}
+
+	return i;
+}
+
+/* thousands of sessions need more fds than the default soft limit */
+static void raise_fd_limit()
+{
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	int i = parse_options(argc, argv);
+	if (i == -1 || argc - i != 2) {
+		return usage(argv[0]);
+	}
+	const char *target_host = argv[i];
+	int target_port = atoi(argv[i + 1]);
+
+	raise_fd_limit();
+
+	dispatcher *disp;
+	return_code rc = dispatcher_create(&disp);
+	if (rc != ok) {
+		fprintf(stderr, "%s: %s\n", argv[0], return_code_string(rc));
+		return 1;
+	}
+
+	stop_handler *sh;
+	rc = stop_handler_create(&sh, disp);
+	if (rc != ok) {
+		fprintf(stderr, "%s: %s\n", argv[0], return_code_string(rc));
+		dispatcher_destroy(disp);
+		return 1;
+	}
+
+	alarm_slot *end_of_run;
+	rc = dispatcher_create_alarm_slot(disp, &end_of_run);
+	if (rc != ok) {
+		fprintf(stderr, "%s: %s\n", argv[0], return_code_string(rc));
+		stop_handler_destroy(sh);
+		dispatcher_destroy(disp);
+		return 1;
+	}
+
+	session *sessions = malloc(sizeof *sessions * n_sessions);
+	if (sessions == NULL) {
+		rc = out_of_memory;
+	}
+
+	int n_created = 0;
+	while (rc == ok && n_created != n_sessions) {
+		rc = create_session(&sessions[n_created], disp, n_created,
+			target_host, target_port);
+		if (rc == ok) {
+			++n_created;
+		}
+	}
+
+	if (rc != ok) {
+		fprintf(stderr, "%s: can't create session %d: %s\n",
+			argv[0], n_created, return_code_string(rc));
+	} else {
+
+		lprintf(info, "%s: running %d sessions\n",
+			argv[0], n_sessions);
+
+		dispatcher_activate_alarm_slot(disp, end_of_run,
+			duration * 1000, &on_end_of_run, disp);
+
+		unsigned long long start = now();
+		rc = dispatcher_run(disp);
+		if (rc != ok) {
+			fprintf(stderr, "%s: %s\n",
+				argv[0], return_code_string(rc));
+		}
+
+		print_report((now() - start) / 1e9);
+	}
+
+	while (n_created != 0) {
+		--n_created;
+		destroy_session(&sessions[n_created]);
+	}
+	free(sessions);
+
+	dispatcher_destroy_alarm_slot(disp, end_of_run);
+	stop_handler_destroy(sh);
+	dispatcher_destroy(disp);
+
+	return rc == ok ? 0 : 1;
+}
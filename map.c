@@ -8,15 +8,178 @@
 
 typedef struct {
 	char *key;
-	char *value;
+	typed_value value; /* a string value points to string */
+	char *string; /* NULL until the first string value */
+	int string_alloc; /* bytes available at string */
+	unsigned int hash;
+	int pos; /* position of this pair's index entry */
 } kvpair;
+
+typedef struct arena_chunk arena_chunk;
+
+struct arena_chunk {
+	arena_chunk *next;
+	int size;
+	int used;
+	char data[];
+};
 	
+/*
+ * kvpairs holds the pairs in insertion order; index is an open
+ * addressing (linear probing) hash table of kvpair indices, kept at
+ * most half full. An index entry is only live if the pair it refers
+ * to refers back to it, so clearing the map leaves the index alone.
+ *
+ * In arena mode, keys and values are carved out of a list of chunks
+ * that map_clear() rewinds instead of freeing.
+ *
+ * Other values than strings are kept in the pair itself, so setting
+ * one never allocates. A pair keeps its string buffer when it changes
+ * type, for the next string value.
+ */
 struct map {
 	kvpair *kvpairs;
 	int n_kvpairs_used;
 	int n_kvpairs_alloc;
+	int *index;
+	int index_size; /* 0 or a power of two */
+	int use_arena;
+	arena_chunk *first_chunk;
+	arena_chunk *curr_chunk;
 };
 
+enum { min_index_size = 8, min_chunk_size = 4096 };
+
+static unsigned int hash_key(const char *key)
+{
+	/* FNV-1a */
+	unsigned int hash = 2166136261u;
+	for (; *key != '\0'; ++key) {
+		hash ^= (unsigned char) *key;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+static int index_entry_live(const map *m, int p)
+{
+	int i = m->index[p];
+	return i >= 0 && i < m->n_kvpairs_used && m->kvpairs[i].pos == p;
+}
+
+/*
+ * Returns the index of key's kvpair, or -1 if key is absent; *pos is
+ * set to the index entry that holds it, or should hold it.
+ */
+static int lookup(const map *m, const char *key, unsigned int hash,
+	int *pos)
+{
+	if (m->index_size == 0) {
+		*pos = -1;
+		return -1;
+	}
+
+	int mask = m->index_size - 1;
+	int p;
+	for (p = hash & mask; index_entry_live(m, p); p = (p + 1) & mask) {
+		const kvpair *pair = &m->kvpairs[m->index[p]];
+		if (pair->hash == hash && strcmp(pair->key, key) == 0) {
+			*pos = p;
+			return m->index[p];
+		}
+	}
+
+	*pos = p;
+	return -1;
+}
+
+static return_code grow_index(map *m)
+{
+	int new_size = m->index_size == 0 ?
+		min_index_size : 2 * m->index_size;
+	int *new_index = malloc(sizeof *new_index * new_size);
+	if (new_index == NULL) {
+		return out_of_memory;
+	}
+
+	int p;
+	for (p = 0; p != new_size; ++p) {
+		new_index[p] = -1;
+	}
+
+	int mask = new_size - 1;
+	int i;
+	for (i = 0; i != m->n_kvpairs_used; ++i) {
+		p = m->kvpairs[i].hash & mask;
+		while (new_index[p] != -1) {
+			p = (p + 1) & mask;
+		}
+		new_index[p] = i;
+		m->kvpairs[i].pos = p;
+	}
+
+	free(m->index);
+	m->index = new_index;
+	m->index_size = new_size;
+
+	return ok;
+}
+
+static char *arena_alloc(map *m, int size)
+{
+	arena_chunk *chunk = m->curr_chunk;
+
+	while (chunk == NULL || chunk->size - chunk->used < size) {
+
+		arena_chunk *next = chunk == NULL ?
+			m->first_chunk : chunk->next;
+
+		if (next == NULL || next->size < size) {
+
+			/* too small chunks stay in the list, for reuse */
+			int chunk_size = size > min_chunk_size ?
+				size : min_chunk_size;
+			arena_chunk *new_chunk =
+				malloc(sizeof *new_chunk + chunk_size);
+			if (new_chunk == NULL) {
+				return NULL;
+			}
+
+			new_chunk->next = next;
+			new_chunk->size = chunk_size;
+			if (chunk == NULL) {
+				m->first_chunk = new_chunk;
+			} else {
+				chunk->next = new_chunk;
+			}
+			next = new_chunk;
+		}
+
+		next->used = 0;
+		chunk = next;
+	}
+
+	m->curr_chunk = chunk;
+
+	char *result = chunk->data + chunk->used;
+	chunk->used += size;
+
+	return result;
+}
+
+static char *alloc_string(map *m, int size)
+{
+	return m->use_arena ? arena_alloc(m, size) : malloc(size);
+}
+
+static void free_string(map *m, char *str)
+{
+	if (! m->use_arena) {
+		free(str);
+	}
+}
+
 static int is_valid_key(const char *key)
 {
 	if (*key == '\0') {
@@ -36,7 +199,7 @@ static int is_valid_key(const char *key)
 	return 1;
 }
 
-return_code map_create(map **result)
+static return_code create_map(map **result, int use_arena)
 {
 	map *m = malloc(sizeof *m);
 	if (m == NULL) {
@@ -46,18 +209,69 @@ return_code map_create(map **result)
 	m->kvpairs = NULL;
 	m->n_kvpairs_used = 0;
 	m->n_kvpairs_alloc = 0;
+	m->index = NULL;
+	m->index_size = 0;
+	m->use_arena = use_arena;
+	m->first_chunk = NULL;
+	m->curr_chunk = NULL;
 
 	*result = m;
 	return ok;
 }
 
-return_code map_set_value(map *m, const char *key, const char *value)
+return_code map_create(map **result)
 {
-	int i;
-	for (i = 0; i != m->n_kvpairs_used; ++i) {
-		if (strcmp(m->kvpairs[i].key, key) == 0) {
-			break;
+	return create_map(result, 0);
+}
+
+return_code map_create_arena(map **result)
+{
+	return create_map(result, 1);
+}
+
+static return_code set_pair_value(map *m, kvpair *pair,
+	const typed_value *value)
+{
+	if (value->type != string_value) {
+		pair->value = *value;
+		return ok;
+	}
+
+	int size = strlen(value->u.string) + 1;
+	if (size > pair->string_alloc) {
+		char *new_string = alloc_string(m, size);
+		if (new_string == NULL) {
+			return out_of_memory;
 		}
+		free_string(m, pair->string);
+		pair->string = new_string;
+		pair->string_alloc = size;
+	}
+
+	memcpy(pair->string, value->u.string, size);
+	pair->value.type = string_value;
+	pair->value.u.string = pair->string;
+
+	return ok;
+}
+
+return_code map_set_value(map *m, const char *key, const char *value)
+{
+	typed_value string;
+	string.type = string_value;
+	string.u.string = value;
+
+	return map_set_typed_value(m, key, &string);
+}
+
+return_code map_set_typed_value(map *m, const char *key,
+	const typed_value *value)
+{
+	unsigned int hash = hash_key(key);
+	int pos;
+	int i = lookup(m, key, hash, &pos);
+	if (i == -1) {
+		i = m->n_kvpairs_used;
 	}
 
 	if (i == m->n_kvpairs_alloc) {
@@ -76,39 +290,56 @@ return_code map_set_value(map *m, const char *key, const char *value)
 		m->n_kvpairs_alloc = new_alloc;
 	}
 
-	char *new_key = NULL;
-	if (i == m->n_kvpairs_used) {
+	if (i != m->n_kvpairs_used) {
+		return set_pair_value(m, &m->kvpairs[i], value);
+	}
 		
-		if (! is_valid_key(key)) {
-			return invalid_map_key;
-		}
+	if (! is_valid_key(key)) {
+		return invalid_map_key;
+	}
 
-		new_key = malloc(strlen(key) + 1);
-		if (new_key == NULL) {
-			return out_of_memory;
+	if (2 * (m->n_kvpairs_used + 1) > m->index_size) {
+		return_code rc = grow_index(m);
+		if (rc != ok) {
+			return rc;
 		}
-		strcpy(new_key, key);
+		lookup(m, key, hash, &pos);
 	}
 
-	char *new_value = malloc(strlen(value) + 1);
-	if (new_value == NULL) {
-		free(new_key);
+	int key_size = strlen(key) + 1;
+	char *new_key = alloc_string(m, key_size);
+	if (new_key == NULL) {
 		return out_of_memory;
 	}
-	strcpy(new_value, value);
+	memcpy(new_key, key, key_size);
 
-	if (new_key == NULL) {
-		free(m->kvpairs[i].value);
-		m->kvpairs[i].value = new_value;
-	} else {
-		m->kvpairs[i].key = new_key;
-		m->kvpairs[i].value = new_value;
-		++m->n_kvpairs_used;
+	kvpair *pair = &m->kvpairs[i];
+	pair->string = NULL;
+	pair->string_alloc = 0;
+
+	return_code rc = set_pair_value(m, pair, value);
+	if (rc != ok) {
+		free_string(m, new_key);
+		return rc;
 	}
 
+	pair->key = new_key;
+	pair->hash = hash;
+	pair->pos = pos;
+	m->index[pos] = i;
+	++m->n_kvpairs_used;
+
 	return ok;
 }
 	
+return_code map_set_index_value(map *m, int idx, const typed_value *value)
+{
+	assert(idx >= 0);
+	assert(idx < m->n_kvpairs_used);
+
+	return set_pair_value(m, &m->kvpairs[idx], value);
+}
+
 int map_get_n_keys(const map *m)
 {
 	return m->n_kvpairs_used;
@@ -126,35 +357,62 @@ const char *map_get_value(const map *m, int idx)
 {
 	assert(idx >= 0);
 	assert(idx < m->n_kvpairs_used);
+	assert(m->kvpairs[idx].value.type == string_value);
 	
-	return m->kvpairs[idx].value;
+	return m->kvpairs[idx].string;
+}
+
+const typed_value *map_get_typed_value(const map *m, int idx)
+{
+	assert(idx >= 0);
+	assert(idx < m->n_kvpairs_used);
+
+	return &m->kvpairs[idx].value;
 }
 
 const char *map_find_value(const map *m, const char *key)
 {
-	int i;
-	for (i = 0; i != m->n_kvpairs_used; ++i) {
-		if (strcmp(m->kvpairs[i].key, key) == 0) {
-			return m->kvpairs[i].value;
-		}
-	}
+	int pos;
+	int i = lookup(m, key, hash_key(key), &pos);
 
-	return NULL;
+	return i == -1 ? NULL : map_get_value(m, i);
+}
+
+int map_find_index(const map *m, const char *key)
+{
+	int pos;
+	return lookup(m, key, hash_key(key), &pos);
 }
 		
 void map_clear(map *m)
 {
-	int i;
-	for (i = 0; i != m->n_kvpairs_used; ++i) {
-		free(m->kvpairs[i].key);
-		free(m->kvpairs[i].value);
+	if (m->use_arena) {
+		m->curr_chunk = m->first_chunk;
+		if (m->curr_chunk != NULL) {
+			m->curr_chunk->used = 0;
+		}
+	} else {
+		int i;
+		for (i = 0; i != m->n_kvpairs_used; ++i) {
+			free(m->kvpairs[i].key);
+			free(m->kvpairs[i].string);
+		}
 	}
+
 	m->n_kvpairs_used = 0;
 }
 
 void map_destroy(map *m)
 {
 	map_clear(m);
+
+	while (m->first_chunk != NULL) {
+		arena_chunk *next = m->first_chunk->next;
+		free(m->first_chunk);
+		m->first_chunk = next;
+	}
+
+	free(m->index);
 	free(m->kvpairs);
 	free(m);
 }
@@ -2,16 +2,34 @@
 #define MAP_H
 
 #include "return_code.h"
+#include "typed_value.h"
 
 typedef struct map map;
 
 return_code map_create(map **result);
 
+/*
+ * An arena map allocates its keys and values in bulk and releases
+ * them all at once; map_clear() takes constant time.
+ */
+return_code map_create_arena(map **result);
+
+/* sets a string value */
 return_code map_set_value(map *m, const char *key, const char *value);
+return_code map_set_typed_value(map *m, const char *key,
+	const typed_value *value);
+/* sets the value of an existing key, without looking it up */
+return_code map_set_index_value(map *m, int idx, const typed_value *value);
 int map_get_n_keys(const map *m);
 const char *map_get_key(const map *m, int idx);
+/* only for string values */
 const char *map_get_value(const map *m, int idx);
+/* valid until the key's value changes */
+const typed_value *map_get_typed_value(const map *m, int idx);
+/* only for string values; returns NULL if key is absent */
 const char *map_find_value(const map *m, const char *key);
+/* returns -1 if key is absent */
+int map_find_index(const map *m, const char *key);
 
 void map_clear(map *m);
 
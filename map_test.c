@@ -49,6 +49,74 @@ static void map_set_value_test()
 	assert(val != NULL);
 	assert(strcmp(val, "value3") == 0);
 
+	assert(map_find_index(m, "key1") == 0);
+	assert(map_find_index(m, "key2") == 1);
+	assert(map_find_index(m, "key3") == -1);
+
+	map_destroy(m);
+}
+
+static void typed_value_test(int use_arena)
+{
+	map *m;
+	return_code rc = use_arena ? map_create_arena(&m) : map_create(&m);
+	assert(rc == ok);
+
+	typed_value value;
+	value.type = integer_value;
+	value.u.integer = -1234567890123LL;
+	rc = map_set_typed_value(m, "int", &value);
+	assert(rc == ok);
+	assert(map_get_typed_value(m, 0)->type == integer_value);
+	assert(map_get_typed_value(m, 0)->u.integer == -1234567890123LL);
+
+	value.type = double_value;
+	value.u.real = 0.25;
+	rc = map_set_typed_value(m, "real", &value);
+	assert(rc == ok);
+	assert(map_get_typed_value(m, 1)->type == double_value);
+	assert(map_get_typed_value(m, 1)->u.real == 0.25);
+	assert(typed_value_equal(map_get_typed_value(m, 1), &value));
+
+	/* in place, by index */
+	value.type = bool_value;
+	value.u.boolean = 1;
+	rc = map_set_index_value(m, 0, &value);
+	assert(rc == ok);
+	assert(map_get_n_keys(m) == 2);
+	assert(map_get_typed_value(m, 0)->type == bool_value);
+	assert(map_get_typed_value(m, 0)->u.boolean == 1);
+
+	char buf[typed_value_text_size];
+	assert(strcmp(typed_value_text(map_get_typed_value(m, 0), buf),
+		"true") == 0);
+	assert(strcmp(typed_value_text(map_get_typed_value(m, 1), buf),
+		"0.25") == 0);
+
+	value.type = string_value;
+	value.u.string = "a much longer value";
+	rc = map_set_index_value(m, 0, &value);
+	assert(rc == ok);
+	assert(strcmp(map_find_value(m, "int"), "a much longer value") == 0);
+	assert(typed_value_equal(map_get_typed_value(m, 0), &value));
+
+	/* and back, keeping the string buffer */
+	value.type = integer_value;
+	value.u.integer = 7;
+	rc = map_set_index_value(m, 0, &value);
+	assert(rc == ok);
+	assert(map_get_typed_value(m, 0)->u.integer == 7);
+	assert(strcmp(typed_value_text(map_get_typed_value(m, 0), buf),
+		"7") == 0);
+
+	rc = map_set_value(m, "int", "x");
+	assert(rc == ok);
+	assert(strcmp(map_get_value(m, 0), "x") == 0);
+	assert(! typed_value_equal(map_get_typed_value(m, 0), &value));
+
+	map_clear(m);
+	assert(map_get_n_keys(m) == 0);
+
 	map_destroy(m);
 }
 
@@ -64,11 +132,120 @@ static void invalid_key_test()
 	map_destroy(m);
 }
 	
+static void arena_test()
+{
+	map *m;
+	return_code rc = map_create_arena(&m);
+	assert(rc == ok);
+
+	char key[32];
+	char value[6000];
+	int round;
+	int i;
+
+	for (round = 0; round != 3; ++round) {
+
+		for (i = 0; i != 1000; ++i) {
+			sprintf(key, "key%d", i);
+			sprintf(value, "value%d", i + round);
+			rc = map_set_value(m, key, value);
+			assert(rc == ok);
+		}
+
+		/* larger than a chunk */
+		memset(value, 'v', sizeof value - 1);
+		value[sizeof value - 1] = '\0';
+		rc = map_set_value(m, "big", value);
+		assert(rc == ok);
+
+		/* shorter overwrite, then a longer one */
+		rc = map_set_value(m, "key1", "v");
+		assert(rc == ok);
+		rc = map_set_value(m, "key2", "a much longer value");
+		assert(rc == ok);
+
+		assert(map_get_n_keys(m) == 1001);
+		for (i = 3; i != 1000; ++i) {
+			sprintf(key, "key%d", i);
+			sprintf(value, "value%d", i + round);
+			const char *val = map_find_value(m, key);
+			assert(val != NULL);
+			assert(strcmp(val, value) == 0);
+		}
+		assert(strcmp(map_find_value(m, "key1"), "v") == 0);
+		assert(strcmp(map_find_value(m, "key2"),
+			"a much longer value") == 0);
+		assert(strlen(map_find_value(m, "big")) == sizeof value - 1);
+
+		map_clear(m);
+		assert(map_get_n_keys(m) == 0);
+		assert(map_find_value(m, "key3") == NULL);
+	}
+
+	map_destroy(m);
+}
+
+/* the timings are in the benchmark */
+static void many_keys_test()
+{
+	enum { n_keys = 100000 };
+
+	map *m;
+	return_code rc = map_create(&m);
+	assert(rc == ok);
+
+	char key[32];
+	char value[32];
+	int i;
+
+	for (i = 0; i != n_keys; ++i) {
+		sprintf(key, "key%d", i);
+		sprintf(value, "%d", i);
+		rc = map_set_value(m, key, value);
+		assert(rc == ok);
+	}
+	assert(map_get_n_keys(m) == n_keys);
+
+	for (i = 0; i != n_keys; ++i) {
+		sprintf(key, "key%d", i);
+		sprintf(value, "%d", i);
+		const char *val = map_find_value(m, key);
+		assert(val != NULL);
+		assert(strcmp(val, value) == 0);
+	}
+
+	/* overwrites keep the insertion order */
+	for (i = 0; i != n_keys; ++i) {
+		sprintf(key, "key%d", i);
+		rc = map_set_value(m, key, "x");
+		assert(rc == ok);
+	}
+	assert(map_get_n_keys(m) == n_keys);
+
+	for (i = 0; i != n_keys; i += 1000) {
+		sprintf(key, "key%d", i);
+		assert(strcmp(map_get_key(m, i), key) == 0);
+		assert(strcmp(map_get_value(m, i), "x") == 0);
+	}
+
+	assert(map_find_value(m, "nokey") == NULL);
+
+	map_clear(m);
+	assert(map_get_n_keys(m) == 0);
+	assert(map_find_value(m, "key0") == NULL);
+
+	map_destroy(m);
+}
+
 int main()
 {
 	map_create_test();
 	map_set_value_test();
+	typed_value_test(0);
+	typed_value_test(1);
 	invalid_key_test();
+	arena_test();
+	many_keys_test();
 
 	return 0;
 }
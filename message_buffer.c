@@ -1,78 +1,366 @@
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include "binary_format.h"
+#include "map.h"
 #include "message_buffer.h"
 
+/*
+ * In gather mode, the buffer is a list of segments that either refer
+ * to bytes copied into data, or to caller-owned memory that must stay
+ * put until it is sent. Short strings are copied anyway: an iovec
+ * entry costs more than copying them. A shared segment's release
+ * function is called once it is discarded. Once more than half of the
+ * segments are read, the unread ones move to the front, and so do the
+ * copied bytes they refer to: a buffer that never quite drains doesn't
+ * keep growing.
+ *
+ * In binary mode, messages are written as described in binary_format.h.
+ * A frame's length is patched in once the message ends; until then,
+ * frame_offset is where it goes in data. In text mode, values that
+ * aren't strings are written as text.
+ * key_ids numbers the keys sent since the magic byte, by map index.
+ */
+enum { min_reference_size = 16 };
+
+typedef struct {
+	const char *ref; /* NULL: bytes are in data, at offset */
+	int offset;
+	int length;
+	void (*release)(void *); /* NULL if not shared */
+	void *release_arg;
+} segment;
+
 struct message_buffer {
 	char *data;
 	int data_size;
 	int write_index;
 	int read_index;
+
+	int gather;
+	segment *segments;
+	int n_segments_used;
+	int n_segments_alloc;
+	int first_segment; /* first segment with unread bytes */
+	int first_segment_read; /* bytes read from first segment */
+	int size; /* unread bytes in all segments */
+
+	int binary;
+	int frame_offset;
+	int frame_start_size; /* message_buffer_size() after the header */
+	map *key_ids; /* NULL until the first binary key */
 };
 
-static return_code message_buffer_add(message_buffer *buf, const char *str)
+static return_code reserve_data(message_buffer *buf, int n_bytes)
 {
-	while (*str != '\0') {
+	if (buf->data_size - buf->write_index >= n_bytes) {
+		return ok;
+	}
+
+	int new_data_size = buf->data_size + buf->data_size / 2 + 1;
+	if (new_data_size - buf->write_index < n_bytes) {
+		new_data_size = buf->write_index + n_bytes;
+	}
 
-		if (buf->write_index == buf->data_size) {
+	char *new_data = buf->data == NULL ?
+		malloc(new_data_size) :
+		realloc(buf->data, new_data_size);
 
-			int new_data_size = buf->data_size + 
-				buf->data_size / 2 + 1;
-			char *new_data = buf->data == NULL ?
-				malloc(new_data_size) :
-				realloc(buf->data, new_data_size);
+	if (new_data == NULL) {
+		return out_of_memory;
+	}
+
+	buf->data_size = new_data_size;
+	buf->data = new_data;
+
+	return ok;
+}
 
-			if (new_data == NULL) {
-				return out_of_memory;
-			}
+static return_code add_segment(message_buffer *buf,
+	const char *ref, int offset, int length)
+{
+	segment *last = buf->n_segments_used == 0 ? NULL :
+		&buf->segments[buf->n_segments_used - 1];
 
-			buf->data_size = new_data_size;
-			buf->data = new_data;
+	if (ref == NULL && last != NULL && last->ref == NULL &&
+		last->offset + last->length == offset) {
+		last->length += length;
+		buf->size += length;
+		return ok;
+	}
+
+	if (buf->n_segments_used == buf->n_segments_alloc) {
+
+		int new_alloc = buf->n_segments_alloc +
+			buf->n_segments_alloc / 2 + 1;
+		segment *new_segments = buf->segments == NULL ?
+			malloc(sizeof *new_segments * new_alloc) :
+			realloc(buf->segments,
+				sizeof *new_segments * new_alloc);
+
+		if (new_segments == NULL) {
+			return out_of_memory;
 		}
 
-		buf->data[buf->write_index] = *str;
-		++buf->write_index;
+		buf->segments = new_segments;
+		buf->n_segments_alloc = new_alloc;
+	}
+
+	segment *seg = &buf->segments[buf->n_segments_used];
+	seg->ref = ref;
+	seg->offset = offset;
+	seg->length = length;
+	seg->release = NULL;
+	seg->release_arg = NULL;
+	++buf->n_segments_used;
+	buf->size += length;
+
+	return ok;
+}
 
-		++str;
+static return_code add_bytes(message_buffer *buf,
+	const char *bytes, int length)
+{
+	return_code rc = reserve_data(buf, length);
+	if (rc != ok) {
+		return rc;
+	}
+
+	memcpy(buf->data + buf->write_index, bytes, length);
+
+	if (buf->gather) {
+		rc = add_segment(buf, NULL, buf->write_index, length);
+		if (rc != ok) {
+			return rc;
+		}
 	}
 
+	buf->write_index += length;
+
 	return ok;
 }
 
+static return_code message_buffer_add(message_buffer *buf, const char *str)
+{
+	return add_bytes(buf, str, strlen(str));
+}
+
+static return_code message_buffer_add_stable(message_buffer *buf,
+	const char *str)
+{
+	int length = strlen(str);
+
+	if (! buf->gather || length < min_reference_size) {
+		return message_buffer_add(buf, str);
+	}
+
+	return add_segment(buf, str, 0, length);
+}
+
 static return_code message_buffer_add_begin_element(message_buffer *buf,
-	const char *name)
+	const char *name, int name_stable)
 {
 	return_code rc = message_buffer_add(buf, "<");
 	if (rc != ok) {
 		return rc;
 	}
 
-	rc = message_buffer_add(buf, name);
+	rc = name_stable ? message_buffer_add_stable(buf, name) :
+		message_buffer_add(buf, name);
 	if (rc != ok) {
 		return rc;
 	}
 
 	return message_buffer_add(buf, ">");
 }
-	
+
 static return_code message_buffer_add_end_element(message_buffer *buf,
-	const char *name)
+	const char *name, int name_stable)
 {
 	return_code rc = message_buffer_add(buf, "</");
 	if (rc != ok) {
 		return rc;
 	}
 
-	rc = message_buffer_add(buf, name);
+	rc = name_stable ? message_buffer_add_stable(buf, name) :
+		message_buffer_add(buf, name);
 	if (rc != ok) {
 		return rc;
 	}
 
 	return message_buffer_add(buf, ">");
 }
-	
-return_code message_buffer_create(message_buffer **result)
+
+static return_code add_string_value(message_buffer *buf,
+	const char *key, int key_stable, const char *value)
+{
+	return_code rc = message_buffer_add(buf, "\t");
+	if (rc != ok) {
+		return rc;
+	}
+
+	rc = message_buffer_add_begin_element(buf, key, key_stable);
+	if (rc != ok) {
+		return rc;
+	}
+
+	rc = message_buffer_add(buf, value);
+	if (rc != ok) {
+		return rc;
+	}
+
+	rc = message_buffer_add_end_element(buf, key, key_stable);
+	if (rc != ok) {
+		return rc;
+	}
+
+	return message_buffer_add(buf, "\n");
+}
+
+static return_code add_varint(message_buffer *buf, unsigned long long value)
+{
+	char bytes[max_varint_size];
+	int length = 0;
+
+	while (value >= 0x80) {
+		bytes[length++] = (char) ((value & 0x7f) | 0x80);
+		value >>= 7;
+	}
+	bytes[length++] = (char) value;
+
+	return add_bytes(buf, bytes, length);
+}
+
+static return_code add_binary_string(message_buffer *buf,
+	const char *str, int stable)
+{
+	return_code rc = add_varint(buf, strlen(str));
+	if (rc != ok) {
+		return rc;
+	}
+
+	return stable ? message_buffer_add_stable(buf, str) :
+		message_buffer_add(buf, str);
+}
+
+static return_code add_binary_key(message_buffer *buf,
+	const char *key, int stable)
+{
+	return_code rc;
+
+	if (buf->key_ids == NULL) {
+		rc = map_create_arena(&buf->key_ids);
+		if (rc != ok) {
+			return rc;
+		}
+	}
+
+	int id = map_find_index(buf->key_ids, key);
+	if (id != -1) {
+		return add_varint(buf, 2 * (unsigned long long) id + 1);
+	}
+
+	if (map_get_n_keys(buf->key_ids) < max_key_ids) {
+		rc = map_set_value(buf->key_ids, key, "");
+		if (rc != ok) {
+			return rc;
+		}
+	}
+
+	rc = add_varint(buf, 2 * (unsigned long long) strlen(key));
+	if (rc != ok) {
+		return rc;
+	}
+
+	return stable ? message_buffer_add_stable(buf, key) :
+		message_buffer_add(buf, key);
+}
+
+static return_code add_tag(message_buffer *buf, value_tag tag)
+{
+	char c = tag;
+	return add_bytes(buf, &c, 1);
+}
+
+static return_code add_binary_value(message_buffer *buf,
+	const char *key, int key_stable, const typed_value *value)
+{
+	return_code rc = add_binary_key(buf, key, key_stable);
+	if (rc != ok) {
+		return rc;
+	}
+
+	unsigned long long bits;
+	char bytes[double_value_size];
+	int i;
+
+	switch (value->type) {
+
+	case string_value :
+
+		rc = add_tag(buf, string_value_tag);
+		if (rc != ok) {
+			return rc;
+		}
+		return add_binary_string(buf, value->u.string, 0);
+
+	case integer_value :
+
+		rc = add_tag(buf, integer_value_tag);
+		if (rc != ok) {
+			return rc;
+		}
+		/* zigzag: 0, -1, 1, -2, ... */
+		return add_varint(buf, value->u.integer < 0 ?
+			~((unsigned long long) value->u.integer << 1) :
+			(unsigned long long) value->u.integer << 1);
+
+	case double_value :
+
+		rc = add_tag(buf, double_value_tag);
+		if (rc != ok) {
+			return rc;
+		}
+		memcpy(&bits, &value->u.real, sizeof bits);
+		for (i = 0; i != double_value_size; ++i) {
+			bytes[i] = (char) (bits >> (8 * i));
+		}
+		return add_bytes(buf, bytes, double_value_size);
+
+	case bool_value :
+
+		rc = add_tag(buf, bool_value_tag);
+		if (rc != ok) {
+			return rc;
+		}
+		bytes[0] = value->u.boolean != 0;
+		return add_bytes(buf, bytes, 1);
+
+	default :
+
+		assert(0);
+		break;
+	}
+
+	return ok;
+}
+
+static return_code add_typed_value(message_buffer *buf,
+	const char *key, int key_stable, const typed_value *value)
+{
+	if (buf->binary) {
+		return add_binary_value(buf, key, key_stable, value);
+	}
+
+	char text[typed_value_text_size];
+	return add_string_value(buf, key, key_stable,
+		typed_value_text(value, text));
+}
+
+static return_code create_message_buffer(message_buffer **result,
+	int gather)
 {
 	message_buffer *buf = malloc(sizeof *buf);
 	if (buf == NULL) {
@@ -84,14 +372,68 @@ return_code message_buffer_create(message_buffer **result)
 	buf->write_index = 0;
 	buf->read_index = 0;
 
+	buf->gather = gather;
+	buf->segments = NULL;
+	buf->n_segments_used = 0;
+	buf->n_segments_alloc = 0;
+	buf->first_segment = 0;
+	buf->first_segment_read = 0;
+	buf->size = 0;
+
+	buf->binary = 0;
+	buf->frame_offset = 0;
+	buf->frame_start_size = 0;
+	buf->key_ids = NULL;
+
 	*result = buf;
 	return ok;
 }
 
+return_code message_buffer_create(message_buffer **result)
+{
+	return create_message_buffer(result, 0);
+}
+
+return_code message_buffer_create_gather(message_buffer **result)
+{
+	return create_message_buffer(result, 1);
+}
+
+void message_buffer_set_binary(message_buffer *buf)
+{
+	buf->binary = 1;
+}
+
+return_code message_buffer_add_binary_magic(message_buffer *buf)
+{
+	char magic = binary_protocol_magic;
+
+	if (buf->key_ids != NULL) {
+		map_clear(buf->key_ids);
+	}
+
+	return add_bytes(buf, &magic, 1);
+}
+
 return_code message_buffer_add_begin_message(message_buffer *buf,
 	const char *message_type)
 {
-	return_code rc = message_buffer_add_begin_element(buf, message_type);
+	if (buf->binary) {
+
+		static const char header[frame_header_size] = { 0 };
+
+		buf->frame_offset = buf->write_index;
+		return_code rc = add_bytes(buf, header, frame_header_size);
+		if (rc != ok) {
+			return rc;
+		}
+		buf->frame_start_size = message_buffer_size(buf);
+
+		return add_binary_string(buf, message_type, 0);
+	}
+
+	return_code rc = message_buffer_add_begin_element(buf,
+		message_type, 0);
 	if (rc != ok) {
 		return rc;
 	}
@@ -102,42 +444,86 @@ return_code message_buffer_add_begin_message(message_buffer *buf,
 return_code message_buffer_add_string_value(message_buffer *buf,
 	const char *key, const char *value)
 {
-	return_code rc = message_buffer_add(buf, "\t");
-	if (rc != ok) {
-		return rc;
-	}
+	typed_value string;
+	string.type = string_value;
+	string.u.string = value;
 
-	rc = message_buffer_add_begin_element(buf, key);
-	if (rc != ok) {
-		return rc;
-	}
-
-	rc = message_buffer_add(buf, value);
-	if (rc != ok) {
-		return rc;
-	}
+	return add_typed_value(buf, key, 0, &string);
+}
 
-	rc = message_buffer_add_end_element(buf, key);
-	if (rc != ok) {
-		return rc;
-	}
+return_code message_buffer_add_string_value_stable_key(
+	message_buffer *buf, const char *key, const char *value)
+{
+	typed_value string;
+	string.type = string_value;
+	string.u.string = value;
 
-	return message_buffer_add(buf, "\n");
+	return add_typed_value(buf, key, 1, &string);
 }
 
 return_code message_buffer_add_integer_value(message_buffer *buf,
+	const char *key, long long value)
+{
+	typed_value integer;
+	integer.type = integer_value;
+	integer.u.integer = value;
+
+	return add_typed_value(buf, key, 0, &integer);
+}
+
+return_code message_buffer_add_double_value(message_buffer *buf,
+	const char *key, double value)
+{
+	typed_value real;
+	real.type = double_value;
+	real.u.real = value;
+
+	return add_typed_value(buf, key, 0, &real);
+}
+
+return_code message_buffer_add_bool_value(message_buffer *buf,
 	const char *key, int value)
 {
-	char value_buf[22]; // enough for 64 bit
-	sprintf(value_buf, "%d", value);
-		
-	return message_buffer_add_string_value(buf, key, value_buf);
+	typed_value boolean;
+	boolean.type = bool_value;
+	boolean.u.boolean = value != 0;
+
+	return add_typed_value(buf, key, 0, &boolean);
+}
+
+return_code message_buffer_add_typed_value(message_buffer *buf,
+	const char *key, const typed_value *value)
+{
+	return add_typed_value(buf, key, 0, value);
+}
+
+return_code message_buffer_add_typed_value_stable_key(
+	message_buffer *buf, const char *key, const typed_value *value)
+{
+	return add_typed_value(buf, key, 1, value);
 }
 
 return_code message_buffer_add_end_message(message_buffer *buf,
 	const char *message_type)
 {
-	return_code rc = message_buffer_add_end_element(buf, message_type);
+	if (buf->binary) {
+
+		unsigned long size = message_buffer_size(buf) -
+			buf->frame_start_size;
+		assert(size <= max_frame_size);
+
+		unsigned char *header = (unsigned char *)
+			buf->data + buf->frame_offset;
+		header[0] = size >> 24;
+		header[1] = size >> 16;
+		header[2] = size >> 8;
+		header[3] = size;
+
+		return ok;
+	}
+
+	return_code rc = message_buffer_add_end_element(buf,
+		message_type, 0);
 	if (rc != ok) {
 		return rc;
 	}
@@ -145,14 +531,101 @@ return_code message_buffer_add_end_message(message_buffer *buf,
 	return message_buffer_add(buf, "\n");
 }
 
+return_code message_buffer_add_shared(message_buffer *buf,
+	const char *data, int size,
+	void (*release)(void *), void *release_arg)
+{
+	assert(buf->gather);
+	assert(size > 0);
+
+	return_code rc = add_segment(buf, data, 0, size);
+	if (rc != ok) {
+		return rc;
+	}
+
+	segment *seg = &buf->segments[buf->n_segments_used - 1];
+	seg->release = release;
+	seg->release_arg = release_arg;
+
+	return ok;
+}
+
 const char *message_buffer_data(const message_buffer *buf)
 {
+	assert(! buf->gather);
+
 	return buf->data + buf->read_index;
 }
 
 int message_buffer_size(const message_buffer *buf)
 {
-	return buf->write_index - buf->read_index;
+	return buf->gather ? buf->size : buf->write_index - buf->read_index;
+}
+
+int message_buffer_fill_iovecs(const message_buffer *buf,
+	struct iovec *iov, int max_iovs)
+{
+	if (! buf->gather) {
+		if (max_iovs == 0 || message_buffer_size(buf) == 0) {
+			return 0;
+		}
+		iov[0].iov_base = buf->data + buf->read_index;
+		iov[0].iov_len = message_buffer_size(buf);
+		return 1;
+	}
+
+	int n_iovs = 0;
+	int skip = buf->first_segment_read;
+
+	int i;
+	for (i = buf->first_segment;
+		i != buf->n_segments_used && n_iovs != max_iovs; ++i) {
+
+		const segment *seg = &buf->segments[i];
+		const char *base = seg->ref != NULL ? seg->ref :
+			buf->data + seg->offset;
+
+		iov[n_iovs].iov_base = (char *) base + skip;
+		iov[n_iovs].iov_len = seg->length - skip;
+		++n_iovs;
+
+		skip = 0;
+	}
+
+	return n_iovs;
+}
+
+/* moves the unread segments, and their copied bytes, to the front */
+static void compact_segments(message_buffer *buf)
+{
+	int n_unread = buf->n_segments_used - buf->first_segment;
+	memmove(buf->segments, buf->segments + buf->first_segment,
+		sizeof *buf->segments * n_unread);
+	buf->n_segments_used = n_unread;
+	buf->first_segment = 0;
+
+	/* copied bytes are added in order */
+	int base = buf->write_index;
+	int i;
+	for (i = 0; i != n_unread; ++i) {
+		if (buf->segments[i].ref == NULL) {
+			base = buf->segments[i].offset;
+			break;
+		}
+	}
+
+	if (base == 0) {
+		return;
+	}
+
+	memmove(buf->data, buf->data + base, buf->write_index - base);
+	buf->write_index -= base;
+	buf->frame_offset -= base;
+	for (; i != n_unread; ++i) {
+		if (buf->segments[i].ref == NULL) {
+			buf->segments[i].offset -= base;
+		}
+	}
 }
 
 void message_buffer_discard(message_buffer *buf, int n_bytes)
@@ -160,15 +633,60 @@ void message_buffer_discard(message_buffer *buf, int n_bytes)
 	assert(n_bytes >= 0);
 	assert(n_bytes <= message_buffer_size(buf));
 
-	buf->read_index += n_bytes;
-	if (buf->read_index == buf->write_index) {
+	if (! buf->gather) {
+		buf->read_index += n_bytes;
+		if (buf->read_index == buf->write_index) {
+			buf->write_index = 0;
+			buf->read_index = 0;
+		}
+		return;
+	}
+
+	buf->size -= n_bytes;
+	while (n_bytes != 0) {
+
+		assert(buf->first_segment != buf->n_segments_used);
+		const segment *seg = &buf->segments[buf->first_segment];
+
+		int left = seg->length - buf->first_segment_read;
+		if (n_bytes < left) {
+			buf->first_segment_read += n_bytes;
+			break;
+		}
+
+		n_bytes -= left;
+		if (seg->release != NULL) {
+			(*seg->release)(seg->release_arg);
+		}
+		++buf->first_segment;
+		buf->first_segment_read = 0;
+	}
+
+	if (buf->size == 0) {
 		buf->write_index = 0;
-		buf->read_index = 0;
+		buf->n_segments_used = 0;
+		buf->first_segment = 0;
+		buf->first_segment_read = 0;
+	} else if (buf->first_segment > buf->n_segments_used / 2) {
+		compact_segments(buf);
 	}
 }
-	
+
 void message_buffer_destroy(message_buffer *buf)
 {
+	int i;
+	for (i = buf->first_segment; i < buf->n_segments_used; ++i) {
+		const segment *seg = &buf->segments[i];
+		if (seg->release != NULL) {
+			(*seg->release)(seg->release_arg);
+		}
+	}
+
+	if (buf->key_ids != NULL) {
+		map_destroy(buf->key_ids);
+	}
+
+	free(buf->segments);
 	free(buf->data);
 	free(buf);
 }
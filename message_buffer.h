@@ -1,23 +1,61 @@
 #ifndef MESSAGE_BUFFER_H
 #define MESSAGE_BUFFER_H
 
+#include <sys/uio.h>
+
 #include "return_code.h"
+#include "typed_value.h"
 
 typedef struct message_buffer message_buffer;
 
 return_code message_buffer_create(message_buffer **result);
 
+/*
+ * A gather buffer can refer to memory it does not own, and must be
+ * read with message_buffer_fill_iovecs() instead of
+ * message_buffer_data().
+ */
+return_code message_buffer_create_gather(message_buffer **result);
+
+/* later messages are binary; see binary_format.h */
+void message_buffer_set_binary(message_buffer *buf);
+/* starts a connection, so later keys are spelled out again */
+return_code message_buffer_add_binary_magic(message_buffer *buf);
+
 return_code message_buffer_add_begin_message(message_buffer *buf, 
 	const char *message_type);
 return_code message_buffer_add_string_value(message_buffer *buf,
 	const char *key, const char *value);
+/* key must stay valid and unchanged until it is discarded */
+return_code message_buffer_add_string_value_stable_key(
+	message_buffer *buf, const char *key, const char *value);
 return_code message_buffer_add_integer_value(message_buffer *buf,
+	const char *key, long long value);
+return_code message_buffer_add_double_value(message_buffer *buf,
+	const char *key, double value);
+return_code message_buffer_add_bool_value(message_buffer *buf,
 	const char *key, int value);
+return_code message_buffer_add_typed_value(message_buffer *buf,
+	const char *key, const typed_value *value);
+/* key must stay valid and unchanged until it is discarded */
+return_code message_buffer_add_typed_value_stable_key(
+	message_buffer *buf, const char *key, const typed_value *value);
 return_code message_buffer_add_end_message(message_buffer *buf,
 	const char *message_type);
 
+/*
+ * Adds size bytes of caller-owned data, which may be shared with other
+ * buffers, to a gather buffer; release(release_arg) is called once
+ * they are discarded, or when the buffer is destroyed.
+ */
+return_code message_buffer_add_shared(message_buffer *buf,
+	const char *data, int size,
+	void (*release)(void *), void *release_arg);
+
 const char *message_buffer_data(const message_buffer *buf);
 int message_buffer_size(const message_buffer *buf);
+int message_buffer_fill_iovecs(const message_buffer *buf,
+	struct iovec *iov, int max_iovs);
 void message_buffer_discard(message_buffer *buf, int n_bytes);
 
 void message_buffer_destroy(message_buffer *buf);
@@ -0,0 +1,123 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "message_buffer.h"
+
+#undef NDEBUG
+#include <assert.h>
+
+static void add_message(message_buffer *buf, int i)
+{
+	/* long enough to be referred to instead of copied */
+	static const char stable_key[] = "aLongStableKeyName";
+
+	char value[16];
+	sprintf(value, "%d", i);
+
+	return_code rc = message_buffer_add_begin_message(buf, "status");
+	assert(rc == ok);
+	rc = message_buffer_add_string_value(buf, "k", value);
+	assert(rc == ok);
+	rc = message_buffer_add_string_value_stable_key(buf,
+		stable_key, value);
+	assert(rc == ok);
+	rc = message_buffer_add_end_message(buf, "status");
+	assert(rc == ok);
+}
+
+/* returns the unread bytes of a gather buffer, copied to out */
+static int gather_contents(const message_buffer *buf, char *out)
+{
+	enum { max_iovs = 1024 };
+
+	struct iovec iov[max_iovs];
+	int n_iovs = message_buffer_fill_iovecs(buf, iov, max_iovs);
+	assert(n_iovs < max_iovs);
+
+	int length = 0;
+	int i;
+	for (i = 0; i != n_iovs; ++i) {
+		memcpy(out + length, iov[i].iov_base, iov[i].iov_len);
+		length += iov[i].iov_len;
+	}
+
+	return length;
+}
+
+/* a gather buffer that never drains reads the same as a plain one */
+static void never_drained_test()
+{
+	enum { n_rounds = 10000, kept = 7 };
+
+	message_buffer *gather;
+	return_code rc = message_buffer_create_gather(&gather);
+	assert(rc == ok);
+
+	message_buffer *plain;
+	rc = message_buffer_create(&plain);
+	assert(rc == ok);
+
+	char contents[4096];
+	int i;
+	for (i = 0; i != n_rounds; ++i) {
+
+		add_message(gather, i);
+		add_message(plain, i);
+
+		int size = message_buffer_size(plain);
+		assert(message_buffer_size(gather) == size);
+		assert(size < sizeof contents);
+		assert(gather_contents(gather, contents) == size);
+		assert(memcmp(contents, message_buffer_data(plain), size) == 0);
+
+		/* some of a message stays behind */
+		message_buffer_discard(gather, size - kept);
+		message_buffer_discard(plain, size - kept);
+	}
+
+	message_buffer_destroy(plain);
+	message_buffer_destroy(gather);
+}
+
+static int n_releases = 0;
+
+static void release(void *arg)
+{
+	++n_releases;
+}
+
+static void shared_test()
+{
+	static const char shared[] = "shared data";
+
+	message_buffer *buf;
+	return_code rc = message_buffer_create_gather(&buf);
+	assert(rc == ok);
+
+	int i;
+	for (i = 0; i != 100; ++i) {
+		rc = message_buffer_add_shared(buf, shared,
+			sizeof shared - 1, &release, NULL);
+		assert(rc == ok);
+		add_message(buf, i);
+
+		/* past the shared data, but not the message after it */
+		message_buffer_discard(buf, message_buffer_size(buf) - 3);
+		assert(n_releases == i + 1);
+	}
+
+	rc = message_buffer_add_shared(buf, shared,
+		sizeof shared - 1, &release, NULL);
+	assert(rc == ok);
+
+	message_buffer_destroy(buf);
+	assert(n_releases == 101);
+}
+
+int main()
+{
+	never_drained_test();
+	shared_test();
+
+	return 0;
+}
@@ -1,5 +1,10 @@
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "push_lexer.h"
 
@@ -25,12 +30,71 @@ static int is_whitespace(char c)
 	return c == ' ' || c == '\t' || c == '\n' || c == '\r';
 }
 
-static return_code append_char(push_lexer *lexer, char c)
+/*
+ * The scan functions return the length of the prefix of src that
+ * process_char() would just append in the current state. Character
+ * data runs are typically long, so they are scanned 16 bytes at a
+ * time where SSE2 is available; element names are short.
+ */
+static int scan_character_data(const char *src, int src_length)
+{
+	int length = 0;
+
+#ifdef __SSE2__
+	const __m128i lts = _mm_set1_epi8('<');
+	const __m128i gts = _mm_set1_epi8('>');
+	const __m128i nuls = _mm_setzero_si128();
+
+	for (; src_length - length >= 16; length += 16) {
+
+		__m128i chunk = _mm_loadu_si128(
+			(const __m128i *) (src + length));
+		__m128i hits = _mm_or_si128(
+			_mm_or_si128(_mm_cmpeq_epi8(chunk, lts),
+				_mm_cmpeq_epi8(chunk, gts)),
+			_mm_cmpeq_epi8(chunk, nuls));
+
+		int mask = _mm_movemask_epi8(hits);
+		if (mask != 0) {
+			return length + __builtin_ctz(mask);
+		}
+	}
+#endif
+
+	for (; length != src_length; ++length) {
+		char c = src[length];
+		if (c == '<' || c == '>' || c == '\0') {
+			break;
+		}
+	}
+
+	return length;
+}
+
+static int scan_element_name(const char *src, int src_length)
+{
+	int length;
+	for (length = 0; length != src_length; ++length) {
+		char c = src[length];
+		if (c == '/' || c == '>' || c == '\0' || is_whitespace(c)) {
+			break;
+		}
+	}
+
+	return length;
+}
+
+static return_code append_chars(push_lexer *lexer,
+	const char *src, int length)
 {
-	if (lexer->data_buffer_length == lexer->data_buffer_alloc) {
+	if (lexer->data_buffer_alloc - lexer->data_buffer_length < length) {
 
 		int new_alloc = lexer->data_buffer_alloc +
 			lexer->data_buffer_alloc / 2 + 1;
+		if (new_alloc - lexer->data_buffer_length < length) {
+			new_alloc = lexer->data_buffer_length + length;
+		}
+
 		char *new_data_buffer = lexer->data_buffer == NULL ?
 			malloc(new_alloc) :
 			realloc(lexer->data_buffer, new_alloc);
@@ -43,12 +107,17 @@ static return_code append_char(push_lexer *lexer, char c)
 		lexer->data_buffer_alloc = new_alloc;
 	}
 
-	lexer->data_buffer[lexer->data_buffer_length] = c;
-	++lexer->data_buffer_length;
+	memcpy(lexer->data_buffer + lexer->data_buffer_length, src, length);
+	lexer->data_buffer_length += length;
 
 	return ok;
 }
 
+static return_code append_char(push_lexer *lexer, char c)
+{
+	return append_chars(lexer, &c, 1);
+}
+
 static return_code report_character_data(push_lexer *lexer)
 {
 	int begin;
@@ -79,7 +148,8 @@ static return_code report_character_data(push_lexer *lexer)
 		}
 
 		rc = (*lexer->vtbl->on_character_data)(
-			lexer->target_object, lexer->data_buffer + begin);
+			lexer->target_object, lexer->data_buffer + begin,
+			end - begin);
 		if (rc != ok) {
 			return rc;
 		}
@@ -96,8 +166,8 @@ static return_code report_open_element(push_lexer *lexer)
 		return rc;
 	}
 
-	rc = (*lexer->vtbl->on_open_element)(
-		lexer->target_object, lexer->data_buffer);
+	rc = (*lexer->vtbl->on_open_element)(lexer->target_object,
+		lexer->data_buffer, lexer->data_buffer_length - 1);
 	if (rc != ok) {
 		return rc;
 	}
@@ -113,14 +183,14 @@ static return_code report_openclose_element(push_lexer *lexer)
 		return rc;
 	}
 
-	rc = (*lexer->vtbl->on_open_element)(
-		lexer->target_object, lexer->data_buffer);
+	rc = (*lexer->vtbl->on_open_element)(lexer->target_object,
+		lexer->data_buffer, lexer->data_buffer_length - 1);
 	if (rc != ok) {
 		return rc;
 	}
 
-	rc = (*lexer->vtbl->on_close_element)(
-		lexer->target_object, lexer->data_buffer);
+	rc = (*lexer->vtbl->on_close_element)(lexer->target_object,
+		lexer->data_buffer, lexer->data_buffer_length - 1);
 	if (rc != ok) {
 		return rc;
 	}
@@ -136,8 +206,8 @@ static return_code report_close_element(push_lexer *lexer)
 		return rc;
 	}
 
-	rc = (*lexer->vtbl->on_close_element)(
-		lexer->target_object, lexer->data_buffer);
+	rc = (*lexer->vtbl->on_close_element)(lexer->target_object,
+		lexer->data_buffer, lexer->data_buffer_length - 1);
 	if (rc != ok) {
 		return rc;
 	}
@@ -293,11 +363,33 @@ return_code push_lexer_push(push_lexer *lexer,
 	const char *end = src + src_length;
 
 	while (src != end) {
-		return_code rc = process_char(lexer, *src);
+
+		/* fast path: bulk-append runs of plain characters */
+		int run = 0;
+		switch (lexer->state) {
+		case in_character_data :
+			run = scan_character_data(src, end - src);
+			break;
+		case in_open_element :
+		case in_close_element :
+			run = scan_element_name(src, end - src);
+			break;
+		default :
+			break;
+		}
+
+		return_code rc;
+		if (run != 0) {
+			rc = append_chars(lexer, src, run);
+			src += run;
+		} else {
+			rc = process_char(lexer, *src);
+			++src;
+		}
+
 		if (rc != ok) {
 			return rc;
 		}
-		++src;
 	}
 
 	return ok;
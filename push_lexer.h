@@ -5,13 +5,17 @@
 
 typedef struct push_lexer push_lexer;
 
+/*
+ * Strings passed to the callbacks are null-terminated, and only valid
+ * during the call; length excludes the terminator.
+ */
 typedef struct {
 	return_code (*on_character_data)(void *target_object,
-		const char *data);
+		const char *data, int length);
 	return_code (*on_open_element)(void *target_object,
-		const char *tag);
+		const char *tag, int length);
 	return_code (*on_close_element)(void *target_object,
-		const char *tag);
+		const char *tag, int length);
 } push_lexer_vtbl;
 
 return_code push_lexer_create(push_lexer **result,
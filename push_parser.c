@@ -5,16 +5,66 @@
 #include "push_lexer.h"
 #include "push_parser.h"
 
+/*
+ * The current message type and key are kept, null-terminated, one
+ * after the other in names; the buffer is reused for every message,
+ * so a parser that has seen its longest names no longer allocates.
+ */
 struct push_parser {
 	void *target_object;
-	const push_parser_vtbl *vtbl;
+	const push_parser_vtbl *vtbl; /* either this one */
+	const push_parser_view_vtbl *view_vtbl; /* or this one is set */
 	push_lexer *lexer;
 	int nesting_level;
-	char *current_message_type; /* set when nesting_level >= 1 */
-	char *current_key; /* set when nesting_level >= 2 */
+	char *names;
+	int names_alloc;
+	int message_type_length; /* set when nesting_level >= 1 */
+	int key_length; /* set when nesting_level >= 2 */
 };
 
-static return_code on_character_data(void *target_object, const char *data)
+static const char *current_key(const push_parser *parser)
+{
+	return parser->names + parser->message_type_length + 1;
+}
+
+static return_code store_name(push_parser *parser, int offset,
+	const char *name, int length)
+{
+	int size = offset + length + 1;
+
+	if (size > parser->names_alloc) {
+
+		int new_alloc = parser->names_alloc +
+			parser->names_alloc / 2 + 1;
+		if (new_alloc < size) {
+			new_alloc = size;
+		}
+
+		char *new_names = parser->names == NULL ?
+			malloc(new_alloc) :
+			realloc(parser->names, new_alloc);
+
+		if (new_names == NULL) {
+			return out_of_memory;
+		}
+
+		parser->names = new_names;
+		parser->names_alloc = new_alloc;
+	}
+
+	memcpy(parser->names + offset, name, length + 1);
+
+	return ok;
+}
+
+static int name_matches(const char *name, int name_length,
+	const char *tag, int length)
+{
+	return name_length == length && memcmp(name, tag, length) == 0;
+}
+
+static return_code on_character_data(void *target_object,
+	const char *data, int length)
 {	
 	push_parser *parser = target_object;
 
@@ -24,9 +74,14 @@ static return_code on_character_data(void *target_object, const char *data)
 		return unexpected_character_data;
 		break;
 	case 2 :
-		assert(parser->current_key != NULL);
+		if (parser->view_vtbl != NULL) {
+			return (*parser->view_vtbl->on_message_data)(
+				parser->target_object,
+				current_key(parser), parser->key_length,
+				data, length);
+		}
 		return (*parser->vtbl->on_message_data)(
-			parser->target_object, parser->current_key, data);
+			parser->target_object, current_key(parser), data);
 		break;
 	default :
 		assert(0);
@@ -36,29 +91,34 @@ static return_code on_character_data(void *target_object, const char *data)
 	return ok;
 }
 
-static return_code on_open_element(void *target_object, const char *tag)
+static return_code on_open_element(void *target_object,
+	const char *tag, int length)
 {
 	push_parser *parser = target_object;
+	return_code rc;
 	
 	switch (parser->nesting_level) {
 	case 0 :
-		assert(parser->current_message_type == NULL);
-		parser->current_message_type = malloc(strlen(tag) + 1);
-		if (parser->current_message_type == NULL) {
-			return out_of_memory;
-		} 
-		strcpy(parser->current_message_type, tag);
+		rc = store_name(parser, 0, tag, length);
+		if (rc != ok) {
+			return rc;
+		}
+		parser->message_type_length = length;
 		++parser->nesting_level;
+		if (parser->view_vtbl != NULL) {
+			return (*parser->view_vtbl->on_begin_message)(
+				parser->target_object, parser->names, length);
+		}
 		return (*parser->vtbl->on_begin_message)(
-			parser->target_object, parser->current_message_type);
+			parser->target_object, parser->names);
 		break;
 	case 1 :
-		assert(parser->current_key == NULL);
-		parser->current_key = malloc(strlen(tag) + 1);
-		if (parser->current_key == NULL) {
-			return out_of_memory;
+		rc = store_name(parser, parser->message_type_length + 1,
+			tag, length);
+		if (rc != ok) {
+			return rc;
 		}
-		strcpy(parser->current_key, tag);
+		parser->key_length = length;
 		++parser->nesting_level;
 		break;
 	case 2 :
@@ -72,7 +132,8 @@ static return_code on_open_element(void *target_object, const char *tag)
 	return ok;
 }
 
-static return_code on_close_element(void *target_object, const char *tag)
+static return_code on_close_element(void *target_object,
+	const char *tag, int length)
 {
 	push_parser *parser = target_object;
 
@@ -81,22 +142,21 @@ static return_code on_close_element(void *target_object, const char *tag)
 		return unexpected_end_element;
 		break;
 	case 1 :
-		assert(parser->current_message_type != NULL);
-		if (strcmp(parser->current_message_type, tag) != 0) {
+		if (! name_matches(parser->names,
+			parser->message_type_length, tag, length)) {
 			return message_type_mismatch;
 		}
-		free(parser->current_message_type);
-		parser->current_message_type = NULL;
 		--parser->nesting_level;
-		return (*parser->vtbl->on_end_message)(parser->target_object);
+		return parser->view_vtbl != NULL ?
+			(*parser->view_vtbl->on_end_message)(
+				parser->target_object) :
+			(*parser->vtbl->on_end_message)(parser->target_object);
 		break;
 	case 2 :
-		assert(parser->current_key != NULL);
-		if (strcmp(parser->current_key, tag) != 0) {
+		if (! name_matches(current_key(parser),
+			parser->key_length, tag, length)) {
 			return data_key_mismatch;
 		}
-		free(parser->current_key);
-		parser->current_key = NULL;
 		--parser->nesting_level;
 		break;
 	default :
@@ -113,8 +173,8 @@ static const push_lexer_vtbl lexer_vtbl = {
 	&on_close_element
 };
 	
-return_code push_parser_create(push_parser **result,
-	void *target_object, const push_parser_vtbl *vtbl)
+static return_code create_parser(push_parser **result, void *target_object,
+	const push_parser_vtbl *vtbl, const push_parser_view_vtbl *view_vtbl)
 {
 	push_parser *parser = malloc(sizeof *parser);
 	if (parser == NULL) {
@@ -123,6 +183,7 @@ return_code push_parser_create(push_parser **result,
 
 	parser->target_object = target_object;
 	parser->vtbl = vtbl;
+	parser->view_vtbl = view_vtbl;
 
 	return_code rc = push_lexer_create(
 		&parser->lexer, parser, &lexer_vtbl);
@@ -132,13 +193,27 @@ return_code push_parser_create(push_parser **result,
 	}
 	
 	parser->nesting_level = 0;
-	parser->current_message_type = NULL;
-	parser->current_key = NULL;
+	parser->names = NULL;
+	parser->names_alloc = 0;
+	parser->message_type_length = 0;
+	parser->key_length = 0;
 	
 	*result = parser;
 	return ok;
 }
 
+return_code push_parser_create(push_parser **result,
+	void *target_object, const push_parser_vtbl *vtbl)
+{
+	return create_parser(result, target_object, vtbl, NULL);
+}
+
+return_code push_parser_create_view(push_parser **result,
+	void *target_object, const push_parser_view_vtbl *view_vtbl)
+{
+	return create_parser(result, target_object, NULL, view_vtbl);
+}
+
 return_code push_parser_push(push_parser *parser,
 	const char *src, int src_length)
 {
@@ -147,8 +222,7 @@ return_code push_parser_push(push_parser *parser,
 	
 void push_parser_destroy(push_parser *parser)
 {
-	free(parser->current_key);
-	free(parser->current_message_type);
+	free(parser->names);
 	push_lexer_destroy(parser->lexer);
 	free(parser);
 }
@@ -2,6 +2,7 @@
 #define PUSH_PARSER_H
 
 #include "return_code.h"
+#include "typed_value.h"
 
 typedef struct push_parser push_parser;
 
@@ -13,11 +14,36 @@ typedef struct {
 	return_code (*on_end_message)(void *target_object);
 } push_parser_vtbl;
 
+/*
+ * Like push_parser_vtbl, but strings come with their lengths. They
+ * point into the parser's buffers, are still null-terminated, and are
+ * only valid during the call.
+ *
+ * A parser for a format with typed values passes them to
+ * on_typed_message_data, if set, instead of to on_message_data as
+ * text; text only has strings.
+ */
+typedef struct {
+	return_code (*on_begin_message)(void *target_object,
+		const char *type, int type_length);
+	return_code (*on_message_data)(void *target_object,
+		const char *key, int key_length,
+		const char *data, int data_length);
+	return_code (*on_end_message)(void *target_object);
+	return_code (*on_typed_message_data)(void *target_object,
+		const char *key, int key_length, const typed_value *value);
+} push_parser_view_vtbl;
+
 return_code push_parser_create(push_parser **result,
 	void *target_object,
 	const push_parser_vtbl *vtbl
 );
 
+return_code push_parser_create_view(push_parser **result,
+	void *target_object,
+	const push_parser_view_vtbl *view_vtbl
+);
+
 return_code push_parser_push(push_parser *parser,
 	const char *src, int src_length);
 
@@ -0,0 +1,214 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "push_parser.h"
+
+#undef NDEBUG
+#include <assert.h>
+
+/* records parser events as text, for easy comparison */
+typedef struct {
+	char events[16384];
+	int length;
+} recorder;
+
+static void record(recorder *rec, const char *fmt,
+	const char *arg1, const char *arg2)
+{
+	int n = snprintf(rec->events + rec->length,
+		sizeof rec->events - rec->length, fmt, arg1, arg2);
+	assert(n >= 0);
+	assert(n < sizeof rec->events - rec->length);
+	rec->length += n;
+}
+
+static return_code on_begin_message(void *target_object, const char *type)
+{
+	record(target_object, "begin(%s%s)", type, "");
+	return ok;
+}
+
+static return_code on_message_data(void *target_object,
+	const char *key, const char *data)
+{
+	record(target_object, "data(%s=%s)", key, data);
+	return ok;
+}
+
+static return_code on_end_message(void *target_object)
+{
+	record(target_object, "end%s%s", "", "");
+	return ok;
+}
+
+static const push_parser_vtbl recorder_vtbl = {
+	&on_begin_message,
+	&on_message_data,
+	&on_end_message
+};
+
+static return_code on_begin_message_view(void *target_object,
+	const char *type, int type_length)
+{
+	assert(strlen(type) == type_length);
+
+	return on_begin_message(target_object, type);
+}
+
+static return_code on_message_data_view(void *target_object,
+	const char *key, int key_length, const char *data, int data_length)
+{
+	assert(strlen(key) == key_length);
+	assert(strlen(data) == data_length);
+
+	return on_message_data(target_object, key, data);
+}
+
+static const push_parser_view_vtbl recorder_view_vtbl = {
+	&on_begin_message_view,
+	&on_message_data_view,
+	&on_end_message
+};
+
+/* pushes input in two parts, split at split_point */
+static return_code parse(recorder *rec, int use_views,
+	const char *input, int length, int split_point)
+{
+	rec->length = 0;
+	rec->events[0] = '\0';
+
+	push_parser *parser;
+	return_code rc = use_views ?
+		push_parser_create_view(&parser, rec, &recorder_view_vtbl) :
+		push_parser_create(&parser, rec, &recorder_vtbl);
+	assert(rc == ok);
+
+	rc = push_parser_push(parser, input, split_point);
+	if (rc == ok) {
+		rc = push_parser_push(parser, input + split_point,
+			length - split_point);
+	}
+
+	push_parser_destroy(parser);
+
+	return rc;
+}
+
+/*
+ * checks the outcome is the same wherever input is split, for both
+ * kinds of vtbl
+ */
+static void check(const char *input, int length,
+	return_code expected_rc, const char *expected_events)
+{
+	int use_views;
+	for (use_views = 0; use_views != 2; ++use_views) {
+
+		int split_point;
+		for (split_point = 0; split_point <= length; ++split_point) {
+
+			recorder rec;
+			return_code rc = parse(&rec, use_views,
+				input, length, split_point);
+
+			assert(rc == expected_rc);
+			if (expected_events != NULL) {
+				assert(strcmp(rec.events,
+					expected_events) == 0);
+			}
+		}
+	}
+}
+
+static void check_string(const char *input,
+	return_code expected_rc, const char *expected_events)
+{
+	check(input, strlen(input), expected_rc, expected_events);
+}
+
+static void messages_test()
+{
+	check_string("", ok, "");
+	check_string(" \n\t ", ok, "");
+	check_string("<update></update>", ok, "begin(update)end");
+	check_string("<update/>", ok, "begin(update)end");
+
+	check_string(
+		"<update>\n"
+		"\t<temperature>  21 degrees  </temperature>\n"
+		"\t<a_somewhat_longer_key_name>a value that spans "
+			"more than a few vector widths, to exercise "
+			"the bulk scanning</a_somewhat_longer_key_name>\n"
+		"\t<empty></empty>\n"
+		"\t<selfclosed/>\n"
+		"</update>\n"
+		"<retrieve/>\n"
+		"<a_longer_message_type><k>v</k></a_longer_message_type>\n"
+		"<t><a_longer_key>v</a_longer_key></t>\n",
+		ok,
+		"begin(update)"
+		"data(temperature=21 degrees)"
+		"data(a_somewhat_longer_key_name=a value that spans "
+			"more than a few vector widths, to exercise "
+			"the bulk scanning)"
+		"end"
+		"begin(retrieve)end"
+		"begin(a_longer_message_type)data(k=v)end"
+		"begin(t)data(a_longer_key=v)end"
+	);
+}
+
+static void errors_test()
+{
+	check_string("<update>></update>", unexpected_gt, NULL);
+	check_string("plain text > more", unexpected_gt, NULL);
+	check_string("<upd ate>", unexpected_whitespace, NULL);
+	check_string("<update>\n</upd\tate>", unexpected_whitespace, NULL);
+	check_string("<update/ >", gt_expected, NULL);
+	check_string("<update></up/date>", unexpected_slash, NULL);
+	check_string("text outside <update/>", unexpected_character_data,
+		NULL);
+	check_string("<update><a><b>", unexpected_begin_element, NULL);
+	check_string("</update>", unexpected_end_element, NULL);
+	check_string("<update></retrieve>", message_type_mismatch, NULL);
+	check_string("<update><a>1</b>", data_key_mismatch, NULL);
+	check_string("<update><ab>1</a>", data_key_mismatch, NULL);
+	check_string("<update></updates>", message_type_mismatch, NULL);
+
+	static const char with_nul[] = "<update><key>va\0lue</key></update>";
+	check(with_nul, sizeof with_nul - 1, unexpected_null_char, NULL);
+
+	static const char nul_in_tag[] = "<update><ke\0y>";
+	check(nul_in_tag, sizeof nul_in_tag - 1, unexpected_null_char, NULL);
+}
+
+static void long_data_test()
+{
+	/* long runs go through the bulk path across several pushes */
+	static char input[10000];
+	static char expected[10000];
+
+	strcpy(input, "<update><k>");
+	int length = strlen(input);
+	int i;
+	for (i = 0; i != 8000; ++i) {
+		input[length + i] = 'a' + i % 26;
+	}
+	input[length + i] = '\0';
+	strcat(input, "</k></update>");
+
+	strcpy(expected, "begin(update)data(k=");
+	strncat(expected, input + length, 8000);
+	strcat(expected, ")end");
+
+	check_string(input, ok, expected);
+}
+
+int main()
+{
+	messages_test();
+	errors_test();
+	long_data_test();
+
+	return 0;
+}
@@ -0,0 +1,98 @@
+#include <assert.h>
+#include <stdlib.h>
+
+#include "receive_buffer.h"
+
+/*
+ * A receive that fills the buffer doubles it, up to max_size; one that
+ * uses less than a quarter halves it. Once an input event received the
+ * budget, the rest waits for the next one, so that a busy peer doesn't
+ * keep the dispatcher from others.
+ */
+struct receive_buffer {
+	char *data;
+	int size;
+	int max_size;
+	int budget;
+	int budget_left; /* in this event */
+};
+
+static void resize(receive_buffer *buf, int new_size)
+{
+	char *new_data = realloc(buf->data, new_size);
+	if (new_data != NULL) {
+		buf->data = new_data;
+		buf->size = new_size;
+	}
+}
+
+return_code receive_buffer_create(receive_buffer **result,
+	int max_size, int budget)
+{
+	assert(max_size > 0);
+
+	receive_buffer *buf = malloc(sizeof *buf);
+	if (buf == NULL) {
+		return out_of_memory;
+	}
+
+	buf->size = max_size < min_receive_size ? max_size : min_receive_size;
+	buf->data = malloc(buf->size);
+	if (buf->data == NULL) {
+		free(buf);
+		return out_of_memory;
+	}
+
+	buf->max_size = max_size;
+	buf->budget = budget;
+	buf->budget_left = budget;
+
+	*result = buf;
+	return ok;
+}
+
+char *receive_buffer_data(receive_buffer *buf)
+{
+	return buf->data;
+}
+
+int receive_buffer_size(const receive_buffer *buf)
+{
+	return buf->size;
+}
+
+void receive_buffer_start(receive_buffer *buf)
+{
+	buf->budget_left = buf->budget;
+}
+
+int receive_buffer_received(receive_buffer *buf, int bytes_received)
+{
+	assert(bytes_received <= buf->size);
+
+	buf->budget_left -= bytes_received;
+
+	/* a short read means the socket is empty */
+	int drained = bytes_received < buf->size;
+
+	if (bytes_received == buf->size) {
+		int new_size = buf->size * 2;
+		if (new_size > buf->max_size) {
+			new_size = buf->max_size;
+		}
+		if (new_size > buf->size) {
+			resize(buf, new_size);
+		}
+	} else if (bytes_received < buf->size / 4 &&
+		buf->size / 2 >= min_receive_size) {
+		resize(buf, buf->size / 2);
+	}
+
+	return ! drained && buf->budget_left > 0;
+}
+
+void receive_buffer_destroy(receive_buffer *buf)
+{
+	free(buf->data);
+	free(buf);
+}
@@ -0,0 +1,32 @@
+#ifndef RECEIVE_BUFFER_H
+#define RECEIVE_BUFFER_H
+
+#include "return_code.h"
+
+/*
+ * A buffer to receive into, which adapts its size to what arrives,
+ * between min_receive_size (or max_size, if that is less) and
+ * max_size. Each input event may receive up to a budget.
+ */
+typedef struct receive_buffer receive_buffer;
+
+enum { min_receive_size = 1024 };
+
+return_code receive_buffer_create(receive_buffer **result,
+	int max_size, int budget);
+
+char *receive_buffer_data(receive_buffer *buf);
+int receive_buffer_size(const receive_buffer *buf);
+
+/* starts an input event, with a full budget */
+void receive_buffer_start(receive_buffer *buf);
+
+/*
+ * Records bytes_received into the data, and adapts the size for the
+ * next receive; returns whether to receive again in this event.
+ */
+int receive_buffer_received(receive_buffer *buf, int bytes_received);
+
+void receive_buffer_destroy(receive_buffer *buf);
+
+#endif
@@ -0,0 +1,77 @@
+#include "receive_buffer.h"
+
+#undef NDEBUG
+#include <assert.h>
+
+/* full receives double the buffer up to the maximum, short ones halve it */
+static void size_test()
+{
+	receive_buffer *buf;
+	return_code rc = receive_buffer_create(&buf, 8192, 1000000);
+	assert(rc == ok);
+	assert(receive_buffer_size(buf) == min_receive_size);
+
+	receive_buffer_start(buf);
+	assert(receive_buffer_received(buf, 1024));
+	assert(receive_buffer_size(buf) == 2048);
+	assert(receive_buffer_received(buf, 2048));
+	assert(receive_buffer_size(buf) == 4096);
+	assert(receive_buffer_received(buf, 4096));
+	assert(receive_buffer_size(buf) == 8192);
+	assert(receive_buffer_received(buf, 8192));
+	assert(receive_buffer_size(buf) == 8192);
+
+	/* a short receive drains the socket; a big one keeps the size */
+	assert(! receive_buffer_received(buf, 4096));
+	assert(receive_buffer_size(buf) == 8192);
+
+	receive_buffer_start(buf);
+	assert(! receive_buffer_received(buf, 100));
+	assert(receive_buffer_size(buf) == 4096);
+	assert(! receive_buffer_received(buf, 100));
+	assert(receive_buffer_size(buf) == 2048);
+	assert(! receive_buffer_received(buf, 100));
+	assert(receive_buffer_size(buf) == 1024);
+	assert(! receive_buffer_received(buf, 0));
+	assert(receive_buffer_size(buf) == min_receive_size);
+
+	receive_buffer_destroy(buf);
+
+	/* a maximum below the minimum wins */
+	rc = receive_buffer_create(&buf, 100, 1000000);
+	assert(rc == ok);
+	assert(receive_buffer_size(buf) == 100);
+	receive_buffer_start(buf);
+	assert(receive_buffer_received(buf, 100));
+	assert(receive_buffer_size(buf) == 100);
+	receive_buffer_destroy(buf);
+}
+
+/* an input event receives up to the budget */
+static void budget_test()
+{
+	receive_buffer *buf;
+	return_code rc = receive_buffer_create(&buf, 1024, 3000);
+	assert(rc == ok);
+
+	receive_buffer_start(buf);
+	assert(receive_buffer_received(buf, 1024));
+	assert(receive_buffer_received(buf, 1024));
+	assert(! receive_buffer_received(buf, 1024));
+
+	/* the next event gets a new one */
+	receive_buffer_start(buf);
+	assert(receive_buffer_received(buf, 1024));
+	assert(receive_buffer_received(buf, 1024));
+	assert(! receive_buffer_received(buf, 1024));
+
+	receive_buffer_destroy(buf);
+}
+
+int main()
+{
+	size_test();
+	budget_test();
+
+	return 0;
+}
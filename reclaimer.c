@@ -0,0 +1,154 @@
+#include <assert.h>
+#include <stdlib.h>
+
+#include "reclaimer.h"
+
+/*
+ * Reads count themselves in the epoch they enter, by its parity. The
+ * epoch only advances from e to e + 1 once no read from e - 1 is left,
+ * so while the epoch is e, all reads entered in e or e - 1. An item
+ * retired in e is unreachable for reads that enter later; once the
+ * epoch is e + 2, the reads that may have seen it are all gone.
+ *
+ * The pending items are a lock-free stack. Collecting takes all of
+ * them, reclaims those that are old enough, and pushes back the rest.
+ * Everything is sequentially consistent: a read that sees the epoch
+ * after an advance also sees all that was unlinked before it.
+ */
+struct reclaimer {
+	unsigned long epoch;
+	long n_readers[2]; /* by the parity of their epoch */
+	retired *pending;
+	int n_pending;
+};
+
+return_code reclaimer_create(reclaimer **result)
+{
+	reclaimer *rec = malloc(sizeof *rec);
+	if (rec == NULL) {
+		return out_of_memory;
+	}
+
+	/* nothing is retired before 2 */
+	rec->epoch = 2;
+	rec->n_readers[0] = 0;
+	rec->n_readers[1] = 0;
+	rec->pending = NULL;
+	rec->n_pending = 0;
+
+	*result = rec;
+	return ok;
+}
+
+unsigned long reclaimer_enter(reclaimer *rec)
+{
+	for (;;) {
+		unsigned long epoch = __atomic_load_n(&rec->epoch,
+			__ATOMIC_SEQ_CST);
+		__atomic_add_fetch(&rec->n_readers[epoch & 1], 1,
+			__ATOMIC_SEQ_CST);
+
+		/* counted too late for this one: try the next */
+		if (__atomic_load_n(&rec->epoch, __ATOMIC_SEQ_CST) == epoch) {
+			return epoch;
+		}
+		__atomic_sub_fetch(&rec->n_readers[epoch & 1], 1,
+			__ATOMIC_SEQ_CST);
+	}
+}
+
+void reclaimer_leave(reclaimer *rec, unsigned long token)
+{
+	__atomic_sub_fetch(&rec->n_readers[token & 1], 1, __ATOMIC_SEQ_CST);
+}
+
+static void push(reclaimer *rec, retired *first, retired *last)
+{
+	last->next = __atomic_load_n(&rec->pending, __ATOMIC_SEQ_CST);
+	while (! __atomic_compare_exchange_n(&rec->pending, &last->next,
+		first, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+		;
+	}
+}
+
+void reclaimer_retire(reclaimer *rec, retired *item,
+	void (*reclaim)(retired *item))
+{
+	item->epoch = __atomic_load_n(&rec->epoch, __ATOMIC_SEQ_CST);
+	item->reclaim = reclaim;
+
+	__atomic_add_fetch(&rec->n_pending, 1, __ATOMIC_SEQ_CST);
+	push(rec, item, item);
+}
+
+/* returns the epoch after trying to advance it */
+static unsigned long try_advance(reclaimer *rec)
+{
+	unsigned long epoch = __atomic_load_n(&rec->epoch, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&rec->n_readers[(epoch - 1) & 1],
+		__ATOMIC_SEQ_CST) == 0) {
+		/* someone else may have advanced it already */
+		__atomic_compare_exchange_n(&rec->epoch, &epoch, epoch + 1,
+			0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+		epoch = __atomic_load_n(&rec->epoch, __ATOMIC_SEQ_CST);
+	}
+
+	return epoch;
+}
+
+void reclaimer_collect(reclaimer *rec)
+{
+	if (__atomic_load_n(&rec->pending, __ATOMIC_SEQ_CST) == NULL) {
+		return;
+	}
+
+	/* without reads, what was just retired can go right away */
+	try_advance(rec);
+	unsigned long epoch = try_advance(rec);
+
+	retired *item = __atomic_exchange_n(&rec->pending, NULL,
+		__ATOMIC_SEQ_CST);
+
+	retired *kept = NULL;
+	retired *last_kept = NULL;
+	int n_reclaimed = 0;
+	while (item != NULL) {
+		retired *next = item->next;
+		if (item->epoch + 2 <= epoch) {
+			item->reclaim(item);
+			++n_reclaimed;
+		} else {
+			item->next = kept;
+			kept = item;
+			if (last_kept == NULL) {
+				last_kept = item;
+			}
+		}
+		item = next;
+	}
+
+	if (kept != NULL) {
+		push(rec, kept, last_kept);
+	}
+	__atomic_sub_fetch(&rec->n_pending, n_reclaimed, __ATOMIC_SEQ_CST);
+}
+
+int reclaimer_n_pending(reclaimer *rec)
+{
+	return __atomic_load_n(&rec->n_pending, __ATOMIC_SEQ_CST);
+}
+
+void reclaimer_destroy(reclaimer *rec)
+{
+	assert(rec->n_readers[0] == 0 && rec->n_readers[1] == 0);
+
+	retired *item = rec->pending;
+	while (item != NULL) {
+		retired *next = item->next;
+		item->reclaim(item);
+		item = next;
+	}
+
+	free(rec);
+}
@@ -0,0 +1,47 @@
+#ifndef RECLAIMER_H
+#define RECLAIMER_H
+
+#include "return_code.h"
+
+/*
+ * Frees what shared data no longer refers to, once no reader can still
+ * be looking at it, without readers taking locks or counting
+ * references: epoch-based reclamation.
+ */
+typedef struct reclaimer reclaimer;
+
+/* the first member of anything retired */
+typedef struct retired retired;
+
+struct retired {
+	retired *next;
+	unsigned long epoch;
+	void (*reclaim)(retired *item);
+};
+
+return_code reclaimer_create(reclaimer **result);
+
+/*
+ * Brackets a read: what is retired during it stays valid until it
+ * ends. Returns the token to pass to reclaimer_leave().
+ */
+unsigned long reclaimer_enter(reclaimer *rec);
+void reclaimer_leave(reclaimer *rec, unsigned long token);
+
+/*
+ * Passes item to reclaim() once no read that may have seen it is left.
+ * Call after item can't be reached anymore by reads that start later.
+ */
+void reclaimer_retire(reclaimer *rec, retired *item,
+	void (*reclaim)(retired *item));
+
+/* reclaims what it can; never waits for reads */
+void reclaimer_collect(reclaimer *rec);
+
+/* the items retired that aren't reclaimed yet */
+int reclaimer_n_pending(reclaimer *rec);
+
+/* reclaims all that is left; no reads may be going on */
+void reclaimer_destroy(reclaimer *rec);
+
+#endif
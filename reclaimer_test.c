@@ -0,0 +1,164 @@
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "reclaimer.h"
+
+#undef NDEBUG
+#include <assert.h>
+
+typedef struct {
+	retired r;
+	int value;
+} item;
+
+static int n_reclaimed = 0;
+
+static void reclaim(retired *r)
+{
+	item *it = (item *) r;
+	it->value = -1;
+	++n_reclaimed;
+}
+
+/* nothing is reclaimed while a read that may have seen it goes on */
+static void read_test()
+{
+	reclaimer *rec;
+	return_code rc = reclaimer_create(&rec);
+	assert(rc == ok);
+
+	/* without reads, right away */
+	item a = { { 0 }, 1 };
+	reclaimer_retire(rec, &a.r, &reclaim);
+	assert(reclaimer_n_pending(rec) == 1);
+	reclaimer_collect(rec);
+	assert(reclaimer_n_pending(rec) == 0);
+	assert(a.value == -1);
+
+	unsigned long token = reclaimer_enter(rec);
+
+	item b = { { 0 }, 2 };
+	reclaimer_retire(rec, &b.r, &reclaim);
+
+	int i;
+	for (i = 0; i != 10; ++i) {
+		reclaimer_collect(rec);
+	}
+	assert(reclaimer_n_pending(rec) == 1);
+	assert(b.value == 2);
+
+	/* a later read doesn't hold b up */
+	unsigned long later_token = reclaimer_enter(rec);
+	reclaimer_leave(rec, token);
+
+	reclaimer_collect(rec);
+	assert(reclaimer_n_pending(rec) == 0);
+	assert(b.value == -1);
+
+	/* but it does what is retired during it */
+	item c = { { 0 }, 3 };
+	reclaimer_retire(rec, &c.r, &reclaim);
+	reclaimer_collect(rec);
+	assert(c.value == 3);
+
+	reclaimer_leave(rec, later_token);
+	reclaimer_collect(rec);
+	assert(c.value == -1);
+
+	/* the rest goes with the reclaimer */
+	item d = { { 0 }, 4 };
+	token = reclaimer_enter(rec);
+	reclaimer_retire(rec, &d.r, &reclaim);
+	reclaimer_leave(rec, token);
+
+	assert(n_reclaimed == 3);
+	reclaimer_destroy(rec);
+	assert(n_reclaimed == 4);
+	assert(d.value == -1);
+}
+
+/* readers check the current item while a writer replaces it */
+enum { n_readers = 3, n_replacements = 20000 };
+
+typedef struct {
+	retired r;
+	int magic;
+} shared_item;
+
+enum { magic = 0x5eed };
+
+typedef struct {
+	reclaimer *rec;
+	shared_item *current;
+	int done;
+} shared;
+
+static void free_item(retired *r)
+{
+	shared_item *it = (shared_item *) r;
+	it->magic = 0;
+	free(it);
+}
+
+static void *run_reader(void *arg)
+{
+	shared *sh = arg;
+
+	while (! __atomic_load_n(&sh->done, __ATOMIC_SEQ_CST)) {
+		unsigned long token = reclaimer_enter(sh->rec);
+		shared_item *it = __atomic_load_n(&sh->current,
+			__ATOMIC_SEQ_CST);
+		assert(it->magic == magic);
+		reclaimer_leave(sh->rec, token);
+	}
+
+	return NULL;
+}
+
+static void threads_test()
+{
+	shared sh;
+	return_code rc = reclaimer_create(&sh.rec);
+	assert(rc == ok);
+	sh.current = malloc(sizeof *sh.current);
+	assert(sh.current != NULL);
+	sh.current->magic = magic;
+	sh.done = 0;
+
+	pthread_t readers[n_readers];
+	int i;
+	for (i = 0; i != n_readers; ++i) {
+		int r = pthread_create(&readers[i], NULL, &run_reader, &sh);
+		assert(r == 0);
+	}
+
+	for (i = 0; i != n_replacements; ++i) {
+		shared_item *it = malloc(sizeof *it);
+		assert(it != NULL);
+		it->magic = magic;
+
+		shared_item *old = __atomic_exchange_n(&sh.current, it,
+			__ATOMIC_SEQ_CST);
+		reclaimer_retire(sh.rec, &old->r, &free_item);
+		reclaimer_collect(sh.rec);
+	}
+
+	__atomic_store_n(&sh.done, 1, __ATOMIC_SEQ_CST);
+	for (i = 0; i != n_readers; ++i) {
+		pthread_join(readers[i], NULL);
+	}
+
+	reclaimer_collect(sh.rec);
+	assert(reclaimer_n_pending(sh.rec) == 0);
+
+	reclaimer_destroy(sh.rec);
+	free(sh.current);
+}
+
+int main()
+{
+	read_test();
+	threads_test();
+
+	return 0;
+}
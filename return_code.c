@@ -55,6 +55,18 @@ const char *return_code_string(return_code code)
 		return "invalid message type";
 	case key_expected :
 		return "key expected";
+	case cant_create_epoll :
+		return "can't create epoll instance";
+	case cant_create_pipe :
+		return "can't create pipe";
+	case invalid_version :
+		return "invalid version";
+	case invalid_frame :
+		return "invalid binary frame";
+	case frame_too_large :
+		return "binary frame too large";
+	case cant_create_thread :
+		return "can't create thread";
 	default :
 		return "unknown return code";
 	}
@@ -29,6 +29,12 @@ typedef enum {
 	data_key_mismatch,
 	invalid_message_type,
 	key_expected,
+	cant_create_epoll,
+	cant_create_pipe,
+	invalid_version,
+	invalid_frame,
+	frame_too_large,
+	cant_create_thread,
 	
 	n_return_codes
 
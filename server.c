@@ -1,3 +1,5 @@
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -12,19 +14,79 @@ enum { default_port = 0 };
 
 static const char *ip = default_ip;
 static int port = default_port;
+static dispatcher_backend backend = default_backend;
+static int n_threads = 1;
+static int n_shards = 1;
+static session_limits limits = {
+	default_high_watermark,
+	default_low_watermark,
+	default_stall_timeout,
+	default_max_receive_size,
+	default_receive_budget
+};
+
+/* each worker thread runs its own dispatcher */
+typedef struct {
+	dispatcher *disp;
+	stop_handler *sh;
+	pthread_t thread;
+	return_code rc;
+} worker;
+
+static void *run_worker(void *arg)
+{
+	worker *w = arg;
+
+	w->rc = dispatcher_run(w->disp);
+	if (w->rc != ok) {
+		/* have the stop handlers stop the other workers */
+		raise(SIGTERM);
+	}
+
+	return NULL;
+}
 
 static int usage(const char *argv0)
 {
 	fprintf(stderr, "usage: %s [<option>...]\n", argv0);
 	fprintf(stderr, "options are:\n");
+	fprintf(stderr,
+		"  --backend <name>    sets dispatcher backend: "
+			"poll or epoll\n");
+	fprintf(stderr,
+		"  --high-watermark <bytes> pauses input above this"
+			" much queued output (default: %d)\n",
+			default_high_watermark);
 	fprintf(stderr,
 		"  --ip <address>      sets ip address (default: %s)\n",
 			default_ip);
 	fprintf(stderr,
 		"  --loglevel <level>  sets log level\n");
+	fprintf(stderr,
+		"  --low-watermark <bytes>  resumes input at this"
+			" much queued output (default: %d)\n",
+			default_low_watermark);
+	fprintf(stderr,
+		"  --max-receive-size <bytes> caps a session's receive"
+			" buffer (default: %d)\n",
+			default_max_receive_size);
 	fprintf(stderr,
 		"  --port <number>     sets port number (default: %d)\n",
 			default_port);
+	fprintf(stderr,
+		"  --receive-budget <bytes> sets bytes read per session"
+			" wakeup (default: %d)\n",
+			default_receive_budget);
+	fprintf(stderr,
+		"  --shards <number>   splits the data for concurrent"
+			" access (default: 1)\n");
+	fprintf(stderr,
+		"  --stall-timeout <msecs>  evicts sessions whose output"
+			" stalls this long (default: %d)\n",
+			default_stall_timeout);
+	fprintf(stderr,
+		"  --threads <number>  sets number of dispatcher threads"
+			" (default: 1)\n");
 
 	return 1;
 }
@@ -35,7 +97,31 @@ static int parse_options(int argc, char *argv[])
 
 	for (i = 1; i != argc && *argv[i] == '-'; ++i) {
 
-		if (strcmp(argv[i], "--ip") == 0) {
+		if (strcmp(argv[i], "--backend") == 0) {
+
+			if (++i == argc) {
+				return -1;
+			}
+
+			if (strcmp(argv[i], "poll") == 0) {
+				backend = poll_backend;
+			} else if (strcmp(argv[i], "epoll") == 0) {
+				backend = epoll_backend;
+			} else {
+				return -1;
+			}
+
+		} else if (strcmp(argv[i], "--high-watermark") == 0) {
+
+			if (++i == argc) {
+				return -1;
+			}
+			limits.high_watermark = atoi(argv[i]);
+			if (limits.high_watermark < 0) {
+				return -1;
+			}
+
+		} else if (strcmp(argv[i], "--ip") == 0) {
 			
 			if (++i == argc) {
 				return -1;
@@ -50,6 +136,26 @@ static int parse_options(int argc, char *argv[])
 			}
 			set_loglevel(atoi(argv[i]));
 
+		} else if (strcmp(argv[i], "--low-watermark") == 0) {
+
+			if (++i == argc) {
+				return -1;
+			}
+			limits.low_watermark = atoi(argv[i]);
+			if (limits.low_watermark < 0) {
+				return -1;
+			}
+
+		} else if (strcmp(argv[i], "--max-receive-size") == 0) {
+
+			if (++i == argc) {
+				return -1;
+			}
+			limits.max_receive_size = atoi(argv[i]);
+			if (limits.max_receive_size < 1) {
+				return -1;
+			}
+
 		} else if (strcmp(argv[i], "--port") == 0) {
 
 			if (++i == argc) {
@@ -57,6 +163,47 @@ static int parse_options(int argc, char *argv[])
 			}
 			port = atoi(argv[i]);
 
+		} else if (strcmp(argv[i], "--receive-budget") == 0) {
+
+			if (++i == argc) {
+				return -1;
+			}
+			limits.receive_budget = atoi(argv[i]);
+			if (limits.receive_budget < 1) {
+				return -1;
+			}
+
+		} else if (strcmp(argv[i], "--stall-timeout") == 0) {
+
+			if (++i == argc) {
+				return -1;
+			}
+			int stall_timeout = atoi(argv[i]);
+			if (stall_timeout < 0) {
+				return -1;
+			}
+			limits.stall_timeout = stall_timeout;
+
+		} else if (strcmp(argv[i], "--shards") == 0) {
+
+			if (++i == argc) {
+				return -1;
+			}
+			n_shards = atoi(argv[i]);
+			if (n_shards < 1) {
+				return -1;
+			}
+
+		} else if (strcmp(argv[i], "--threads") == 0) {
+
+			if (++i == argc) {
+				return -1;
+			}
+			n_threads = atoi(argv[i]);
+			if (n_threads < 1) {
+				return -1;
+			}
+
 		} else {
 
 			return -1;
@@ -68,53 +215,122 @@ static int parse_options(int argc, char *argv[])
 			
 int main(int argc, char *argv[])
 {
-	if (parse_options(argc, argv) != argc) {
+	if (parse_options(argc, argv) != argc ||
+		limits.low_watermark > limits.high_watermark) {
 		return usage(argv[0]);
 	}
 
 	lprintf(info, "%s: initializing\n", argv[0]);
 
-	return_code rc;
-
-	dispatcher *disp;
-	rc = dispatcher_create(&disp);
-	if (rc != ok) {
-		lprintf(fatal, "%s: can't create dispatcher: %s\n",
-			argv[0], return_code_string(rc));
+	worker *workers = malloc(sizeof *workers * n_threads);
+	if (workers == NULL) {
+		lprintf(fatal, "%s: %s\n",
+			argv[0], return_code_string(out_of_memory));
 		return 1;
 	}
 
-	stop_handler *sh;
-	rc = stop_handler_create(&sh, disp);
-	if (rc != ok) {
-		lprintf(fatal, "%s: can't create stop handler: %s\n",
-			argv[0], return_code_string(rc));
-		dispatcher_destroy(disp);
+	dispatcher **disps = malloc(sizeof *disps * n_threads);
+	if (disps == NULL) {
+		lprintf(fatal, "%s: %s\n",
+			argv[0], return_code_string(out_of_memory));
+		free(workers);
 		return 1;
 	}
-	
-	data_store *store;
-	rc = data_store_create(&store, disp, ip, port);
-	if (rc != ok) {
-		lprintf(fatal, "%s: can't create data store: %s\n",
-			argv[0], return_code_string(rc));
-		stop_handler_destroy(sh);
-		dispatcher_destroy(disp);
-		return 1;
+
+	return_code rc = ok;
+
+	int n_workers;
+	for (n_workers = 0; n_workers != n_threads; ++n_workers) {
+
+		worker *w = &workers[n_workers];
+
+		rc = dispatcher_create_with_backend(&w->disp, backend);
+		if (rc != ok) {
+			lprintf(fatal, "%s: can't create dispatcher: %s\n",
+				argv[0], return_code_string(rc));
+			break;
+		}
+
+		rc = stop_handler_create(&w->sh, w->disp);
+		if (rc != ok) {
+			lprintf(fatal, "%s: can't create stop handler: %s\n",
+				argv[0], return_code_string(rc));
+			dispatcher_destroy(w->disp);
+			break;
+		}
+
+		w->rc = ok;
+		disps[n_workers] = w->disp;
 	}
 
-	lprintf(info, "%s: running\n", argv[0]);
+	data_store *store = NULL;
+	if (rc == ok) {
+		rc = data_store_create_multi(&store,
+			disps, n_workers, ip, port);
+		if (rc != ok) {
+			lprintf(fatal, "%s: can't create data store: %s\n",
+				argv[0], return_code_string(rc));
+		} else {
+			data_store_set_session_limits(store, &limits);
+			rc = data_store_set_n_shards(store, n_shards);
+			if (rc != ok) {
+				lprintf(fatal, "%s: can't create shards: %s\n",
+					argv[0], return_code_string(rc));
+			}
+		}
+	}
+
+	if (rc == ok) {
+
+		lprintf(info, "%s: running %d thread(s)\n",
+			argv[0], n_workers);
 
-	rc = dispatcher_run(disp);
-	if (rc != ok) {
-		lprintf(fatal, "%s: %s\n", argv[0], return_code_string(rc));
+		int n_started;
+		for (n_started = 1; n_started != n_workers; ++n_started) {
+			if (pthread_create(&workers[n_started].thread, NULL,
+				&run_worker, &workers[n_started]) != 0) {
+				lprintf(fatal, "%s: %s\n", argv[0],
+					return_code_string(cant_create_thread));
+				rc = cant_create_thread;
+				break;
+			}
+		}
+
+		if (rc != ok) {
+			/* stops the workers started so far, and the first */
+			raise(SIGTERM);
+		}
+		run_worker(&workers[0]);
+
+		int i;
+		for (i = 1; i != n_started; ++i) {
+			pthread_join(workers[i].thread, NULL);
+		}
+
+		for (i = 0; i != n_workers; ++i) {
+			if (workers[i].rc != ok) {
+				lprintf(fatal, "%s: %s\n", argv[0],
+					return_code_string(workers[i].rc));
+				rc = workers[i].rc;
+			}
+		}
+
+		lprintf(info, "%s: cleaning up\n", argv[0]);
 	}
 
-	lprintf(info, "%s: cleaning up\n", argv[0]);
+	if (store != NULL) {
+		/* unregisters the acceptor and wakeups before the dispatchers go */
+		data_store_destroy(store);
+	}
+
+	while (n_workers != 0) {
+		--n_workers;
+		stop_handler_destroy(workers[n_workers].sh);
+		dispatcher_destroy(workers[n_workers].disp);
+	}
 
-	data_store_destroy(store);
-	stop_handler_destroy(sh);
-	dispatcher_destroy(disp);
+	free(disps);
+	free(workers);
 
 	lprintf(info, "%s: done\n", argv[0]);
 
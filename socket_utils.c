@@ -87,6 +87,26 @@ void set_reuseaddress(int fd)
 	assert(r != -1);
 }
 
+void set_reuseport(int fd)
+{
+	const int optval = 1;
+	int r = setsockopt(fd, SOL_SOCKET, SO_REUSEPORT,
+		&optval, sizeof optval);
+	(void) r;
+	assert(r != -1);
+}
+
+int get_socket_error(int fd)
+{
+	int optval;
+	socklen_t optlen = sizeof optval;
+	int r = getsockopt(fd, SOL_SOCKET, SO_ERROR, &optval, &optlen);
+	(void) r;
+	assert(r != -1);
+
+	return optval;
+}
+
 void await_input(int fd)
 {
 	struct pollfd pfds[1];
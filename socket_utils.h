@@ -7,6 +7,10 @@ void set_nonblocking(int fd);
 void set_keepalive(int fd);
 void disable_nagle(int fd);
 void set_reuseaddress(int fd);
+void set_reuseport(int fd);
+
+/* returns the pending error on fd, clearing it */
+int get_socket_error(int fd);
 
 void await_input(int fd);
 void await_output(int fd);
@@ -18,22 +18,50 @@ struct stop_handler {
 	connection *receiver;
 	io_slot *receiver_slot;
 	struct sigaction saved_actions[n_signals];
+	stop_handler *next;
 };
 
-static stop_handler *current_stop_handler = NULL;
+/*
+ * There is one stop handler per dispatcher; a signal stops them all.
+ * The first one created installs the signal handler, the last one
+ * destroyed restores the original actions.
+ */
+static stop_handler *first_stop_handler = NULL;
 
 static void signal_handler(int sig)
 {
 	char c = sig;
 	int saved_errno = errno;
 
-	int bytes_sent_ignored;
-	connection_send_nonblocking(current_stop_handler->sender, 
-		&bytes_sent_ignored, &c, sizeof c);
+	stop_handler *sh;
+	for (sh = first_stop_handler; sh != NULL; sh = sh->next) {
+		int bytes_sent_ignored;
+		connection_send_nonblocking(sh->sender, 
+			&bytes_sent_ignored, &c, sizeof c);
+	}
 
 	errno = saved_errno;
 }
 
+/* keeps signal_handler() from seeing a half-updated list */
+static void block_signals(sigset_t *saved_mask)
+{
+	sigset_t mask;
+	sigemptyset(&mask);
+
+	int i;
+	for (i = 0; i != n_signals; ++i) {
+		sigaddset(&mask, signals[i]);
+	}
+
+	pthread_sigmask(SIG_BLOCK, &mask, saved_mask);
+}
+
+static void restore_signals(const sigset_t *saved_mask)
+{
+	pthread_sigmask(SIG_SETMASK, saved_mask, NULL);
+}
+
 static return_code input_handler(void *user_data)
 {
 	stop_handler *sh = user_data;
@@ -106,22 +134,38 @@ return_code stop_handler_create(stop_handler **result, dispatcher *disp)
 		return rc;
 	}
 
-	assert(current_stop_handler == NULL);
-	current_stop_handler = sh;
+	sigset_t saved_mask;
+	block_signals(&saved_mask);
 
-	struct sigaction new_action;
-	memset(&new_action, '\0', sizeof new_action);
-	new_action.sa_handler = &signal_handler;
-	new_action.sa_flags = SA_RESTART;
+	if (first_stop_handler == NULL) {
 
-	int i;
-	for (i = 0; i != n_signals; ++i) {
-		int r = sigaction(signals[i],
-			&new_action, &sh->saved_actions[i]);
-		(void) r;
-		assert(r == 0);
+		struct sigaction new_action;
+		memset(&new_action, '\0', sizeof new_action);
+		new_action.sa_handler = &signal_handler;
+		new_action.sa_flags = SA_RESTART;
+
+		int i;
+		for (i = 0; i != n_signals; ++i) {
+			int r = sigaction(signals[i],
+				&new_action, &sh->saved_actions[i]);
+			(void) r;
+			assert(r == 0);
+		}
+
+	} else {
+
+		int i;
+		for (i = 0; i != n_signals; ++i) {
+			sh->saved_actions[i] =
+				first_stop_handler->saved_actions[i];
+		}
 	}
 
+	sh->next = first_stop_handler;
+	first_stop_handler = sh;
+
+	restore_signals(&saved_mask);
+
 	connection_activate_io_slot(sh->receiver, sh->disp,
 		sh->receiver_slot, input, input_handler, sh);		
 		
@@ -133,13 +177,24 @@ void stop_handler_destroy(stop_handler *sh)
 {
 	dispatcher_deactivate_io_slot(sh->disp, sh->receiver_slot);
 
-	int i;
-	for (i = 0; i != n_signals; ++i) {
-		sigaction(signals[i], &sh->saved_actions[i], NULL);
+	sigset_t saved_mask;
+	block_signals(&saved_mask);
+
+	stop_handler **link = &first_stop_handler;
+	while (*link != sh) {
+		assert(*link != NULL);
+		link = &(*link)->next;
 	}
-	
-	assert(current_stop_handler == sh);
-	current_stop_handler = NULL;
+	*link = sh->next;
+
+	if (first_stop_handler == NULL) {
+		int i;
+		for (i = 0; i != n_signals; ++i) {
+			sigaction(signals[i], &sh->saved_actions[i], NULL);
+		}
+	}
+
+	restore_signals(&saved_mask);
 	
 	dispatcher_destroy_io_slot(sh->disp, sh->receiver_slot);
 	connection_destroy(sh->receiver);
@@ -0,0 +1,51 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "typed_value.h"
+
+int typed_value_equal(const typed_value *a, const typed_value *b)
+{
+	if (a->type != b->type) {
+		return 0;
+	}
+
+	switch (a->type) {
+	case string_value :
+		return strcmp(a->u.string, b->u.string) == 0;
+	case integer_value :
+		return a->u.integer == b->u.integer;
+	case double_value :
+		return a->u.real == b->u.real;
+	case bool_value :
+		return a->u.boolean == b->u.boolean;
+	default :
+		assert(0);
+		break;
+	}
+
+	return 0;
+}
+
+const char *typed_value_text(const typed_value *value, char *buf)
+{
+	switch (value->type) {
+	case string_value :
+		return value->u.string;
+	case integer_value :
+		sprintf(buf, "%lld", value->u.integer);
+		break;
+	case double_value :
+		/* enough digits to read back the same double */
+		sprintf(buf, "%.17g", value->u.real);
+		break;
+	case bool_value :
+		strcpy(buf, value->u.boolean ? "true" : "false");
+		break;
+	default :
+		assert(0);
+		break;
+	}
+
+	return buf;
+}
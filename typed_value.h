@@ -0,0 +1,33 @@
+#ifndef TYPED_VALUE_H
+#define TYPED_VALUE_H
+
+typedef enum {
+	string_value,
+	integer_value,
+	double_value,
+	bool_value
+} value_type;
+
+/* a string value's characters are owned by whoever holds it */
+typedef struct {
+	value_type type;
+	union {
+		const char *string;
+		long long integer;
+		double real;
+		int boolean; /* 0 or 1 */
+	} u;
+} typed_value;
+
+enum { typed_value_text_size = 32 }; /* fits any non-string value */
+
+/* values of different types are never equal */
+int typed_value_equal(const typed_value *a, const typed_value *b);
+
+/*
+ * Returns the value as text: a string value as is, others written to
+ * buf, which must hold typed_value_text_size bytes.
+ */
+const char *typed_value_text(const typed_value *value, char *buf);
+
+#endif